@@ -0,0 +1,414 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include "../rectilinear.h"
+
+/*
+  Microbenchmarks of the core kernels. Compile from the wave_approach folder by:
+
+  g++ -std=c++11 -O3 -DNDEBUG benchmark/microbenchmark.cpp rectilinear.cpp -o microbenchmark.o -pthread
+
+  Run from the wave_approach folder, as the BitReader and countUp workloads read base_3_size_5_refinement_32/d10.bin.
+  All workloads are generated from a fixed seed, so two builds run the same operations. To compare two builds:
+
+  ./microbenchmark_old.o > old.txt
+  ./microbenchmark.o --compare old.txt
+ */
+
+using namespace rectilinear;
+
+#define SEED 2389
+#define MODELS 1024
+#define ROUNDS 5
+
+volatile uint64_t sink; // Results are added here, so the compiler can not remove the work
+
+/*
+  Random models with the layer sizes of a token: The bricks of the first layer are placed near FirstBrick without intersections.
+  Each brick of a higher layer intersects a random brick of the layer below. The models need not be connected.
+ */
+static void randomCombination(std::mt19937_64 &rng, int token, Combination &c) {
+  uint8_t layerSizes[MAX_HEIGHT];
+  Combination::getLayerSizesFromToken(token, layerSizes);
+  const uint8_t height = Combination::heightOfToken(token);
+  while(true) {
+    c = Combination();
+    bool ok = true;
+    for(uint8_t layer = 0; ok && layer < height; layer++) {
+      const uint8_t toAdd = layer == 0 ? layerSizes[0]-1 : layerSizes[layer];
+      for(uint8_t i = 0; ok && i < toAdd; i++) {
+	ok = false;
+	for(int attempt = 0; !ok && attempt < 1000; attempt++) {
+	  Brick b(rng() % 2 == 0, 0, 0);
+	  if(layer == 0) {
+	    b.x = (int16_t)(FirstBrick.x + (int)(rng() % 17) - 8);
+	    b.y = (int16_t)(FirstBrick.y + (int)(rng() % 17) - 8);
+	  }
+	  else {
+	    const Brick &below = c.bricks[layer-1][rng() % c.layerSizes[layer-1]];
+	    b.x = (int16_t)(below.x + (int)(rng() % 7) - 3);
+	    b.y = (int16_t)(below.y + (int)(rng() % 7) - 3);
+	    if(!b.intersects(below))
+	      continue;
+	  }
+	  ok = true;
+	  if(layer < c.height) {
+	    for(uint8_t j = 0; ok && j < c.layerSizes[layer]; j++)
+	      ok = !c.bricks[layer][j].intersects(b);
+	  }
+	  if(ok)
+	    c.addBrick(b, layer);
+	}
+      }
+    }
+    if(ok)
+      return;
+  }
+}
+
+static void randomCombinations(std::mt19937_64 &rng, const int *tokens, const int tokenCount, std::vector<Combination> &v) {
+  v.resize(MODELS);
+  for(int i = 0; i < MODELS; i++)
+    randomCombination(rng, tokens[i % tokenCount], v[i]);
+}
+
+struct Workloads {
+  std::vector<std::pair<Brick,Brick> > brickPairs;
+  std::vector<uint8_t> toAdd; // For canReach() of brickPairs
+  std::vector<Combination> models; // Various refinements
+  std::vector<Combination> bases; // Layer 0 of at least 2 bricks, for encodeConnectivity()
+  std::vector<Base> layers; // Layer 0 of 3 bricks, for reduceFromUnreachable()
+  std::vector<Combination> partials; // Partial models of maxPartial
+  std::vector<std::vector<LayerBrick> > candidates; // Of the partials
+  Combination maxPartial, maxLayers;
+  std::vector<std::vector<Report> > reports; // Batches of base_3_size_5_refinement_32/d10.bin
+  Combination maxReports;
+
+  Workloads() : maxPartial(2221), maxLayers(3221), maxReports(32) {
+  }
+};
+Workloads w;
+
+namespace rectilinear {
+  /*
+    Access to private kernels of NonEncodingCombinationBuilder.
+   */
+  struct Microbenchmark {
+    static void findCandidates(const Combination &c, const Combination &maxCombination, std::vector<LayerBrick> &v) {
+      BrickPlane neighbours[MAX_HEIGHT];
+      for(uint8_t i = 0; i < MAX_HEIGHT; i++)
+	neighbours[i].reset();
+      NonEncodingCombinationBuilder b(c, 0, c.size, neighbours, &maxCombination);
+      v.clear();
+      b.findPotentialBricksForNextWave(v);
+    }
+
+    static uint64_t findPotentialBricksForNextWave() {
+      BrickPlane neighbours[MAX_HEIGHT];
+      for(uint8_t i = 0; i < MAX_HEIGHT; i++)
+	neighbours[i].reset();
+      std::vector<LayerBrick> v;
+      uint64_t ret = 0;
+      for(std::vector<Combination>::const_iterator it = w.partials.begin(); it != w.partials.end(); it++) {
+	NonEncodingCombinationBuilder b(*it, 0, it->size, neighbours, &w.maxPartial);
+	v.clear();
+	b.findPotentialBricksForNextWave(v);
+	ret += v.size();
+      }
+      sink += ret;
+      return w.partials.size();
+    }
+
+    static uint64_t simon() {
+      BrickPlane neighbours[MAX_HEIGHT];
+      for(uint8_t i = 0; i < MAX_HEIGHT; i++)
+	neighbours[i].reset();
+      uint64_t ret = 0;
+      for(size_t i = 0; i < w.partials.size(); i++) {
+	const Combination &c = w.partials[i];
+	NonEncodingCombinationBuilder b(c, 0, c.size, neighbours, &w.maxPartial);
+	ret += b.simon(w.candidates[i]);
+      }
+      sink += ret;
+      return w.partials.size();
+    }
+  };
+}
+
+static uint64_t benchIntersects() {
+  uint64_t ret = 0;
+  for(std::vector<std::pair<Brick,Brick> >::const_iterator it = w.brickPairs.begin(); it != w.brickPairs.end(); it++)
+    ret += it->first.intersects(it->second);
+  sink += ret;
+  return w.brickPairs.size();
+}
+
+static uint64_t benchCanReach() {
+  uint64_t ret = 0;
+  for(size_t i = 0; i < w.brickPairs.size(); i++)
+    ret += Brick::canReach(w.brickPairs[i].first, w.brickPairs[i].second, w.toAdd[i]);
+  sink += ret;
+  return w.brickPairs.size();
+}
+
+// Includes copying the model, so that each operation normalizes a model that is not normalized:
+static uint64_t benchNormalize() {
+  Combination c;
+  uint64_t ret = 0;
+  for(std::vector<Combination>::const_iterator it = w.models.begin(); it != w.models.end(); it++) {
+    c.copy(*it);
+    c.normalize();
+    ret += c.bricks[0][0].x;
+  }
+  sink += ret;
+  return w.models.size();
+}
+
+static uint64_t benchIs180Symmetric() {
+  uint64_t ret = 0;
+  for(std::vector<Combination>::const_iterator it = w.models.begin(); it != w.models.end(); it++)
+    ret += it->is180Symmetric();
+  sink += ret;
+  return w.models.size();
+}
+
+static uint64_t benchIs90Symmetric() {
+  uint64_t ret = 0;
+  for(std::vector<Combination>::const_iterator it = w.models.begin(); it != w.models.end(); it++)
+    ret += it->is90Symmetric();
+  sink += ret;
+  return w.models.size();
+}
+
+static uint64_t benchEncodeConnectivity() {
+  uint64_t ret = 0;
+  for(std::vector<Combination>::iterator it = w.bases.begin(); it != w.bases.end(); it++)
+    ret += it->encodeConnectivity(it->getTokenFromLayerSizes());
+  sink += ret;
+  return w.bases.size();
+}
+
+// An operation is a pick returned by next():
+static uint64_t benchBrickPickerNext() {
+  uint64_t ret = 0;
+  for(size_t i = 0; i < w.partials.size(); i++) {
+    Combination c(w.partials[i]);
+    const int leftToPlace = w.maxPartial.size - c.size;
+    for(int toPick = 1; toPick <= MIN(3, leftToPlace); toPick++) {
+      BrickPicker picker(w.candidates[i], 0, toPick);
+      while(picker.next(c, w.maxPartial)) {
+	ret++;
+	for(int j = 0; j < toPick; j++)
+	  c.removeLastBrick();
+      }
+    }
+  }
+  sink += ret;
+  return ret;
+}
+
+static uint64_t benchReduceFromUnreachable() {
+  CBase out;
+  uint64_t ret = 0;
+  for(std::vector<Base>::const_iterator it = w.layers.begin(); it != w.layers.end(); it++) {
+    it->reduceFromUnreachable(w.maxLayers, out);
+    ret += out.layerSize;
+  }
+  sink += ret;
+  return w.layers.size();
+}
+
+// An operation is a pair of reports of a batch, as when summing precomputations:
+static uint64_t benchCountUp() {
+  uint64_t ret = 0, ops = 0;
+  for(std::vector<std::vector<Report> >::const_iterator it = w.reports.begin(); it != w.reports.end(); it++) {
+    for(std::vector<Report>::const_iterator it1 = it->begin(); it1 != it->end(); it1++) {
+      for(std::vector<Report>::const_iterator it2 = it->begin(); it2 != it->end(); it2++)
+	ret += Report::countUp(*it1, *it2).all;
+      ops += it->size();
+    }
+  }
+  sink += ret;
+  return ops;
+}
+
+// An operation is a report decoded. BitReader writes to std::cout, which is silenced here:
+static uint64_t benchBitReaderNext() {
+  std::stringstream silenced;
+  std::streambuf *coutBuffer = std::cout.rdbuf(silenced.rdbuf());
+  uint64_t ops = 0;
+  {
+    BitReader reader(w.maxReports, 10, "");
+    Report reports[MAX_BATCH_REPORTS];
+    int cnt;
+    while((cnt = reader.next(reports)) > 0)
+      ops += cnt;
+  }
+  std::cout.rdbuf(coutBuffer);
+  sink += ops;
+  return ops;
+}
+
+static void setUpWorkloads() {
+  std::mt19937_64 rng(SEED);
+
+  for(int i = 0; i < 4096; i++) {
+    Brick a(rng() % 2 == 0, (int16_t)(rng() % 13), (int16_t)(rng() % 13));
+    Brick b(rng() % 2 == 0, (int16_t)(rng() % 13), (int16_t)(rng() % 13));
+    w.brickPairs.push_back(std::make_pair(a, b));
+    w.toAdd.push_back((uint8_t)(1 + rng() % 3));
+  }
+
+  const int modelTokens[7] = {22, 32, 222, 321, 231, 2221, 44};
+  randomCombinations(rng, modelTokens, 7, w.models);
+  const int baseTokens[4] = {21, 32, 221, 421};
+  randomCombinations(rng, baseTokens, 4, w.bases);
+
+  std::vector<Combination> layers;
+  const int layerTokens[1] = {3};
+  randomCombinations(rng, layerTokens, 1, layers);
+  for(std::vector<Combination>::const_iterator it = layers.begin(); it != layers.end(); it++)
+    w.layers.push_back(Base(*it, 0));
+
+  const int partialTokens[3] = {11, 111, 211};
+  randomCombinations(rng, partialTokens, 3, w.partials);
+  w.candidates.resize(w.partials.size());
+  for(size_t i = 0; i < w.partials.size(); i++)
+    Microbenchmark::findCandidates(w.partials[i], w.maxPartial, w.candidates[i]);
+
+  std::stringstream silenced;
+  std::streambuf *coutBuffer = std::cout.rdbuf(silenced.rdbuf());
+  {
+    BitReader reader(w.maxReports, 10, "");
+    std::vector<Report> v;
+    while(reader.next(v)) {
+      w.reports.push_back(v);
+      v.clear();
+    }
+  }
+  std::cout.rdbuf(coutBuffer);
+  if(w.reports.empty())
+    std::cerr << "No reports read from base_3_size_5_refinement_32/d10.bin. Run from the wave_approach folder to benchmark countUp and BitReader::next" << std::endl;
+}
+
+struct Benchmark {
+  const char *name;
+  uint64_t (*run)(); // Runs the workload once and returns the number of operations
+  bool needsReports;
+};
+
+/*
+  The workload is repeated until a round takes at least minSeconds. The fastest and the median of ROUNDS rounds are reported.
+ */
+static void measure(const Benchmark &b, const double minSeconds, double &fastest, double &median) {
+  uint64_t repetitions = 1;
+  while(true) {
+    std::chrono::time_point<std::chrono::steady_clock> timeStart { std::chrono::steady_clock::now() };
+    for(uint64_t i = 0; i < repetitions; i++)
+      b.run();
+    std::chrono::duration<double, std::ratio<1> > duration(std::chrono::steady_clock::now() - timeStart);
+    if(duration.count() >= minSeconds)
+      break;
+    repetitions *= 2;
+  }
+
+  double nsPerOp[ROUNDS];
+  for(int round = 0; round < ROUNDS; round++) {
+    uint64_t ops = 0;
+    std::chrono::time_point<std::chrono::steady_clock> timeStart { std::chrono::steady_clock::now() };
+    for(uint64_t i = 0; i < repetitions; i++)
+      ops += b.run();
+    std::chrono::duration<double, std::nano> duration(std::chrono::steady_clock::now() - timeStart);
+    nsPerOp[round] = ops == 0 ? 0 : duration.count() / ops;
+  }
+  std::sort(nsPerOp, nsPerOp + ROUNDS);
+  fastest = nsPerOp[0];
+  median = nsPerOp[ROUNDS/2];
+}
+
+// Lines "NAME FASTEST MEDIAN" of a previous run. Lines starting with '#' are skipped:
+static bool loadPrevious(const std::string &fileName, std::map<std::string,double> &previous) {
+  std::ifstream istream(fileName.c_str());
+  if(!istream.good()) {
+    std::cerr << "Unable to read " << fileName << std::endl;
+    return false;
+  }
+  std::string line;
+  while(std::getline(istream, line)) {
+    if(line.empty() || line[0] == '#')
+      continue;
+    std::stringstream ss(line);
+    std::string name;
+    double fastest;
+    if(ss >> name >> fastest)
+      previous[name] = fastest;
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  double minSeconds = 0.05;
+  std::string filter, compareFileName;
+  for(int i = 1; i < argc; i++) {
+    std::string arg(argv[i]);
+    if(arg == "--seconds" && i+1 < argc)
+      minSeconds = atof(argv[++i]);
+    else if(arg == "--filter" && i+1 < argc)
+      filter = argv[++i];
+    else if(arg == "--compare" && i+1 < argc)
+      compareFileName = argv[++i];
+    else {
+      std::cerr << "Usage: [--seconds SECONDS] [--filter NAME] [--compare FILE]" << std::endl;
+      std::cerr << " Each round runs for at least SECONDS (default 0.05). Only kernels with NAME in their names are run." << std::endl;
+      std::cerr << " FILE is the output of a previous run, such as of another build, to compare the fastest rounds with." << std::endl;
+      return 1;
+    }
+  }
+  std::map<std::string,double> previous;
+  if(!compareFileName.empty() && !loadPrevious(compareFileName, previous))
+    return 2;
+
+  BinomialCoefficient::init();
+  EncodingCounts::init();
+  setUpWorkloads();
+
+  const Benchmark benchmarks[12] = {
+    {"Brick::intersects", benchIntersects, false},
+    {"Combination::normalize", benchNormalize, false},
+    {"Combination::is180Symmetric", benchIs180Symmetric, false},
+    {"Combination::is90Symmetric", benchIs90Symmetric, false},
+    {"Combination::encodeConnectivity", benchEncodeConnectivity, false},
+    {"findPotentialBricksForNextWave", Microbenchmark::findPotentialBricksForNextWave, false},
+    {"simon", Microbenchmark::simon, false},
+    {"BrickPicker::next", benchBrickPickerNext, false},
+    {"Base::reduceFromUnreachable", benchReduceFromUnreachable, false},
+    {"Brick::canReach", benchCanReach, false},
+    {"Report::countUp", benchCountUp, true},
+    {"BitReader::next", benchBitReaderNext, true}
+  };
+
+  std::cout << "# kernel ns/op (fastest of " << ROUNDS << " rounds) ns/op (median)";
+  if(!previous.empty())
+    std::cout << " previous/fastest";
+  std::cout << std::endl;
+  for(int i = 0; i < 12; i++) {
+    const Benchmark &b = benchmarks[i];
+    if(!filter.empty() && std::string(b.name).find(filter) == std::string::npos)
+      continue;
+    if(b.needsReports && w.reports.empty())
+      continue;
+    double fastest, median;
+    measure(b, minSeconds, fastest, median);
+    std::cout << std::left << std::setw(34) << b.name << std::right << std::fixed << std::setprecision(3)
+	      << std::setw(12) << fastest << std::setw(12) << median;
+    std::map<std::string,double>::const_iterator it = previous.find(b.name);
+    if(it != previous.end())
+      std::cout << std::setw(10) << std::setprecision(2) << (fastest == 0 ? 0 : it->second / fastest) << "x";
+    std::cout << std::endl;
+  }
+  return 0;
+}
@@ -3,6 +3,13 @@
 #include <assert.h>
 #include <sstream>
 #include <fstream>
+#include <algorithm>
+#include <sys/stat.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 #include "rectilinear.h"
 
 using namespace rectilinear;
@@ -58,50 +65,68 @@ uint64_t get(char *argv) {
    Consider all placement of bricks in layer k and compute |A'| based the models that can be built on the two sides of the layer.
 */
 void printUsage() {
-  std::cout << "Usage: [RPST] [parameters...]" << std::endl;
-  std::cout << "R: Compute a single refinement. Parameters: REFINEMENT [THREADS]" << std::endl;
-  std::cout << "P: Compute precomputations. Parameters: REFINEMENT MAX_DIST [THREADS]. Results of precomputations are saved to files in folder /base_<BASE>_size_<SIZE_TOTAL>_refinement_REFINEMENT. THREADS-1 worker threads will be spawned" << std::endl;
+  std::cout << "Usage: [RMECAJBHPSTV] [parameters...]" << std::endl;
+  std::cout << "R: Compute a single refinement. Parameters: REFINEMENT [THREADS] [--shard i/N] [--journal FILE [--journal-depth 1|2] [--journal-batch RECORDS] [--journal-sync SECONDS]] [--stats FILE [--stats-interval SECONDS]]" << std::endl;
+  std::cout << "   With --shard only shard i of N is computed and saved to shard_REFINEMENT_i_of_N.txt" << std::endl;
+  std::cout << "   With --journal completed bases (depth 1, default) or also their large work units (depth 2) are appended to FILE and skipped when restarting. Records are written in batches of RECORDS (default 64) and synced to disk at most every SECONDS (default 10)" << std::endl;
+  std::cout << "M: Merge shards of a refinement computed using R with --shard. Parameters: REFINEMENT N" << std::endl;
+  std::cout << "E: Estimate the size of the wave tree and the running time of a refinement by random probes. Parameters: REFINEMENT [SECONDS] [THREADS] [--seed SEED] [--max-dist MAX_DIST]" << std::endl;
+  std::cout << "   Probes are run for SECONDS (default 10). With --max-dist the time of P mode up to MAX_DIST is estimated as well" << std::endl;
+  std::cout << "C: Estimate the counts of a refinement by random probes. Parameters: REFINEMENT [SECONDS] [--seed SEED]" << std::endl;
+  std::cout << "   Probes are run for SECONDS (default 10). Estimates for refinements with known counts are checked against these" << std::endl;
+  std::cout << "A: Assemble a(N) and a180(N) from the counts of refinements using Lemma 1. Parameters: N [RESULTS_FILE...]" << std::endl;
+  std::cout << "   Results files contain lines \"<REFINEMENT> ALL (SYMMETRIC180)\", such as results.txt and the output files of R mode. Missing refinements are listed" << std::endl;
+  std::cout << "J: Run jobs sharing THREADS threads, largest first. Parameters: [REFINEMENT...] [S:LEFT:BASE:RIGHT:MAX_DIST...] [--size N] [--threads THREADS] [--results FILE] [--estimate SECONDS] [--stats FILE [--stats-interval SECONDS]]" << std::endl;
+  std::cout << "   A REFINEMENT is counted as in R mode. S:LEFT:BASE:RIGHT:MAX_DIST computes the precomputations needed and sums them as in S mode" << std::endl;
+  std::cout << "   With --size all missing refinements without bottlenecks of size N are counted, and a(N) is assembled using Lemma 1" << std::endl;
+  std::cout << "   Counts are appended to FILE (default jobs_results.txt) and jobs with counts in FILE are skipped. The time of each job is estimated by random probes for SECONDS (default 1)" << std::endl;
+  std::cout << "B: Benchmark R, P and S modes on the refinements of X mode. Parameters: [--threads THREADS] [--full] [--repeat N] [--output FILE] [--baseline FILE] [--tolerance FRACTION] [--dir FOLDER]" << std::endl;
+  std::cout << "   Each case runs in a child process using THREADS threads (default 2) in FOLDER (default benchmark_work). The fastest of N runs (default 1) is written to FILE (default benchmark_results.json)" << std::endl;
+  std::cout << "   With --full R mode is also run on <2221>, <232> and <322>. With --baseline wall times slower than in the FILE of a previous run by more than FRACTION (default 0.1) fail" << std::endl;
+  std::cout << "H: Measure the scaling of R mode (or P mode when MAX_DIST is given) at 1, 2, 4, ... threads. Parameters: REFINEMENT [MAX_DIST] [--max-threads N] [--dir FOLDER]" << std::endl;
+  std::cout << "   Speedup, efficiency and the seconds spent waiting on contended locks, idle workers, joins of bases and idle tails of P mode are listed for each number of threads up to N (default all cores)" << std::endl;
+  std::cout << "P: Compute precomputations. Parameters: REFINEMENT MAX_DIST [THREADS] [--format 1|2] [--stats FILE [--stats-interval SECONDS]]. Results of precomputations are saved to files in folder /base_<BASE>_size_<SIZE_TOTAL>_refinement_REFINEMENT. THREADS-1 worker threads will be spawned" << std::endl;
+  std::cout << "   Files are written in format 2 (indexed, variable width counts) unless --format 1 is given. Both formats are read by S, T and P modes" << std::endl;
+  std::cout << "With --stats of R, J and P a JSON line with nodes, leaves, simon() calls, completed units, rates and ETA is appended to FILE every SECONDS (default 10)" << std::endl;
   std::cout << "S: Sum precomputations for a refinement. Parameters: LEFT BASE RIGHT MAX_DIST" << std::endl;
   std::cout << "T: Test precomputations against previous results. Parameters: BASE REFINEMENT MIN_DIST MAX_DIST FOLDER_SUFFIX" << std::endl;
+  std::cout << "V: Convert the precomputation files of a refinement up to MAX_DIST to format 2 in place. Parameters: REFINEMENT MAX_DIST" << std::endl;
   std::cout << "X: Run a test suite with regression tests. No parameters needed." << std::endl;
 }
 
-int runSumPrecomputations(int leftToken, int base, int rightToken, int maxDist) {
+// Token of the refinement with the layers of leftToken, the base layer and the layers of rightToken:
+uint64_t tokenOfSum(int leftToken, int base, int rightToken) {
+  return PackedToken::fromDecimal(leftToken).append(base).concat(PackedToken::fromDecimal(rightToken)).toDecimal();
+}
+
+int runSumPrecomputations(int leftToken, int base, int rightToken, int maxDist, Counts &counts) {
   std::cout << "Summing precomputations, leftToken=" << leftToken << ", base=" << base << ", rightToken=" << rightToken << ", maxDist=" << maxDist << std::endl;
+  int token = (int)tokenOfSum(leftToken, base, rightToken);
   leftToken = leftToken * 10 + base;
   rightToken = Combination::reverseToken(rightToken);
-  int token = leftToken;
-  {
-    int tk = rightToken;
-    while(tk > 0) {
-      token = 10 * token + tk % 10;
-      tk /= 10;
-    }
-  }
-
   rightToken = rightToken * 10 + base;
 
   const Combination maxL(Combination::reverseToken(leftToken));
   const Combination maxR(Combination::reverseToken(rightToken));
-  Counts counts, countsLeft, countsRight;
+  counts.reset();
+  Counts countsLeft, countsRight;
   for(int D = 2; D <= maxDist; D++) {
     // Read files and handle batches one by one:
     BitReader reader1(maxL, D, "");
     BitReader reader2(maxR, D, "");
 
-    std::vector<Report> l, r;
-    while(reader1.next(l)) {
-#ifdef DEBUG
-      bool ok =
-#endif
-      reader2.next(r); assert(ok);
+    Report l[MAX_BATCH_REPORTS], r[MAX_BATCH_REPORTS];
+    int sizeL, sizeR;
+    while((sizeL = reader1.next(l)) > 0) {
+      sizeR = reader2.next(r);
+      assert(sizeR > 0);
       bool bs180 = false, bs90 = false, first = true; // All value initialization not necessary, but makes compiling with -Wall happy
 
       Base baseCombination;
       Counts c, cl, cr;
       // Match all connectivities:
-      for(std::vector<Report>::const_iterator it1 = l.begin(); it1 != l.end(); it1++) {
-	const Report &report1 = *it1;
+      for(int i1 = 0; i1 < sizeL; i1++) {
+	const Report &report1 = l[i1];
 	if(first) {
 	  bs180 = report1.baseSymmetric180;
 	  bs90 = report1.baseSymmetric90;
@@ -113,16 +138,16 @@ int runSumPrecomputations(int leftToken, int base, int rightToken, int maxDist)
 	  assert(bs90 == report1.baseSymmetric90);
 	  assert(baseCombination == report1.c);
 	}
-	for(std::vector<Report>::const_iterator it2 = r.begin(); it2 != r.end(); it2++) {
-	  Counts fromUp = Report::countUp(report1, *it2);
+	for(int i2 = 0; i2 < sizeR; i2++) {
+	  Counts fromUp = Report::countUp(report1, r[i2]);
 	  c += fromUp;
-	  //std::cout << " " << report1 << " <> " << *it2 << " -> " << fromUp << std::endl;
+	  //std::cout << " " << report1 << " <> " << r[i2] << " -> " << fromUp << std::endl;
 	}
 	if(Report::connected(report1, report1))
 	  cl += report1.counts;
       }
-      for(std::vector<Report>::const_iterator it2 = r.begin(); it2 != r.end(); it2++) {
-	const Report &report2 = *it2;
+      for(int i2 = 0; i2 < sizeR; i2++) {
+	const Report &report2 = r[i2];
 	assert(bs180 == report2.baseSymmetric180);
 	assert(bs90 == report2.baseSymmetric90);
 	assert(baseCombination == report2.c);
@@ -178,10 +203,7 @@ int runSumPrecomputations(int leftToken, int base, int rightToken, int maxDist)
 
       countsLeft += cl;
       countsRight += cr;
-
-      l.clear();
-      r.clear();
-    } // while(reader1.next(rm) && reader2.next(rm))
+    } // while(reader1.next(l) && reader2.next(r))
   } // for d = 2 .. maxDist
 
   if(!Combination::checkCounts(token, counts))
@@ -194,6 +216,11 @@ int runSumPrecomputations(int leftToken, int base, int rightToken, int maxDist)
   return 0;
 }
 
+int runSumPrecomputations(int leftToken, int base, int rightToken, int maxDist) {
+  Counts counts;
+  return runSumPrecomputations(leftToken, base, rightToken, maxDist, counts);
+}
+
 int runSumPrecomputations(int argc, char** argv) {
   if(argc < 6) {
     printUsage();
@@ -206,6 +233,54 @@ int runSumPrecomputations(int argc, char** argv) {
   return runSumPrecomputations(leftToken, base, rightToken, maxDist);
 }
 
+void writeRefinementOutput(uint64_t token, const Counts &counts, double seconds) {
+  std::stringstream ss; ss << "output_" << token << ".txt";
+  std::ofstream fileStream(ss.str().c_str());
+  fileStream << "<" << token << "> " << counts << std::endl;
+  fileStream << "Computation time: " << seconds << " seconds" << std::endl;
+  fileStream << std::endl;
+
+  fileStream << "Code line for sums-for-token.py:" << std::endl;
+  fileStream << "    '" << token << "', " << counts.all << ", " << counts.symmetric180 << "," << std::endl;
+  fileStream << std::endl;
+
+  fileStream << "Code line for Combination::setupKnownCounts():" << std::endl;
+  fileStream << "    m[" << token << "] = Counts(" << counts.all << ", " << counts.symmetric180 << ", " << counts.symmetric90 << ");" << std::endl;
+
+  fileStream.flush();
+  fileStream.close();
+}
+
+std::string shardFileName(uint64_t token, int shardIndex, int shardCount) {
+  std::stringstream ss; ss << "shard_" << token << "_" << shardIndex << "_of_" << shardCount << ".txt";
+  return ss.str();
+}
+
+// Prints the histograms of the hot paths when compiled with -DPROFILE:
+void reportProfile() {
+#ifdef PROFILE
+  Profile::report(std::cout);
+#endif
+}
+
+// Starts telemetry if a stats file is given. Returns false if the stats file can not be written:
+bool startTelemetry(const std::string &statsFileName, double statsInterval, Telemetry *&telemetry) {
+  telemetry = NULL;
+  if(statsFileName.empty())
+    return true;
+  if(statsInterval <= 0) {
+    std::cerr << "Invalid stats interval: " << statsInterval << std::endl;
+    return false;
+  }
+  telemetry = new Telemetry(statsFileName, statsInterval);
+  if(!telemetry->ok()) {
+    delete telemetry;
+    telemetry = NULL;
+    return false;
+  }
+  return true;
+}
+
 int runRefinement(int argc, char** argv) {
   if(argc < 3) {
     printUsage();
@@ -216,33 +291,1002 @@ int runRefinement(int argc, char** argv) {
   uint64_t token = get(argv[2]);
   Combination maxCombination(token);
 
-  int threads = argc > 3 ? get(argv[3]) : std::thread::hardware_concurrency();
+  int threads = std::thread::hardware_concurrency();
+  int shardIndex = 0, shardCount = 1;
+  std::string journalFileName;
+  int journalDepth = 1, journalBatch = 64;
+  double journalSync = 10;
+  std::string statsFileName;
+  double statsInterval = 10;
+  for(int i = 3; i < argc; i++) {
+    std::string arg(argv[i]);
+    if(arg == "--journal" && i+1 < argc)
+      journalFileName = argv[++i];
+    else if(arg == "--stats" && i+1 < argc)
+      statsFileName = argv[++i];
+    else if(arg == "--stats-interval" && i+1 < argc)
+      statsInterval = atof(argv[++i]);
+    else if(arg == "--journal-depth" && i+1 < argc)
+      journalDepth = (int)get(argv[++i]);
+    else if(arg == "--journal-batch" && i+1 < argc)
+      journalBatch = (int)get(argv[++i]);
+    else if(arg == "--journal-sync" && i+1 < argc)
+      journalSync = atof(argv[++i]);
+    else if(arg == "--shard" && i+1 < argc) {
+      char slash;
+      std::stringstream ss(argv[++i]);
+      if(!(ss >> shardIndex >> slash >> shardCount) || slash != '/' || shardIndex < 0 || shardIndex >= shardCount) {
+	std::cerr << "Invalid shard: " << argv[i] << ". Expected i/N with 0 <= i < N" << std::endl;
+	return 2;
+      }
+    }
+    else if(arg[0] == '-') {
+      printUsage();
+      return 1;
+    }
+    else
+      threads = get(argv[i]);
+  }
+  journalBatch = MAX(1, journalBatch); // Not in the loop above, as MAX() evaluates its arguments twice
+  if(journalDepth != 1 && journalDepth != 2) {
+    std::cerr << "Invalid journal depth: " << journalDepth << ". Expected 1 or 2" << std::endl;
+    return 2;
+  }
+  Journal *journal = NULL;
+  if(!journalFileName.empty()) {
+    journal = new Journal(journalFileName, token, shardIndex, shardCount, journalDepth, journalBatch, journalSync);
+    if(!journal->ok()) {
+      delete journal;
+      return 2;
+    }
+    if(journal->size() > 0)
+      std::cout << "Resuming using " << journal->size() << " completed units from " << journalFileName << std::endl;
+  }
+
+  Telemetry *telemetry;
+  if(!startTelemetry(statsFileName, statsInterval, telemetry)) {
+    delete journal;
+    return 2;
+  }
+
+  if(shardCount > 1) {
+    std::cout << "Counting shard " << shardIndex << "/" << shardCount << " for <" << token << "> of size " << (int)maxCombination.size << " using " << threads << " threads" << std::endl;
+    Counts counts = NonEncodingCombinationBuilder::buildShard(threads, maxCombination, shardIndex, shardCount, journal);
+    delete journal;
+    delete telemetry; // Writes the final stats line
+    std::chrono::duration<double, std::ratio<1> > duration = std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > >(std::chrono::steady_clock::now() - timeStart);
+    std::cout << "Shard counts before division: " << counts << std::endl;
+    reportProfile();
+    std::cout << "Computation time: " << duration.count() << " seconds" << std::endl;
+
+    std::string fileName = shardFileName(token, shardIndex, shardCount);
+    std::ofstream fileStream(fileName.c_str());
+    fileStream << counts.all << std::endl;
+    fileStream << counts.symmetric180 << std::endl;
+    fileStream << counts.symmetric90 << std::endl;
+    fileStream << duration.count() << std::endl;
+    fileStream.flush();
+    fileStream.close();
+    std::cout << "Wrote " << fileName << std::endl;
+    return 0;
+  }
+
   std::cout << "Counting for <" << token << "> of size " << (int)maxCombination.size << " using " << threads << " threads" << std::endl;
-  Counts counts = NonEncodingCombinationBuilder::buildWithPartials(threads, maxCombination);
+  Counts counts = NonEncodingCombinationBuilder::buildShard(threads, maxCombination, 0, 1, journal);
+  counts = NonEncodingCombinationBuilder::finalizeCounts(counts, maxCombination);
+  delete journal;
+  delete telemetry; // Writes the final stats line
+  reportProfile();
   Combination::checkCounts(token, counts);
 
   std::chrono::duration<double, std::ratio<1> > duration = std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > >(std::chrono::steady_clock::now() - timeStart);
   std::cout << "Computation time: " << duration.count() << " seconds" << std::endl;
 
-  // Write to file:
-  std::stringstream ss; ss << "output_" << token << ".txt";
-  std::ofstream fileStream(ss.str().c_str());
-  fileStream << "<" << token << "> " << counts << std::endl;
-  fileStream << "Computation time: " << duration.count() << " seconds" << std::endl;
-  fileStream << std::endl;
+  writeRefinementOutput(token, counts, duration.count());
+  return 0;
+}
 
-  fileStream << "Code line for sums-for-token.py:" << std::endl;
-  fileStream << "    '" << token << "', " << counts.all << ", " << counts.symmetric180 << "," << std::endl;
-  fileStream << std::endl;
+int runMergeShards(int argc, char** argv) {
+  if(argc < 4) {
+    printUsage();
+    return 1;
+  }
+  uint64_t token = get(argv[2]);
+  int shardCount = (int)get(argv[3]);
+  Combination maxCombination(token);
 
-  fileStream << "Code line for Combination::setupKnownCounts():" << std::endl;
-  fileStream << "    m[" << token << "] = Counts(" << counts.all << ", " << counts.symmetric180 << ", " << counts.symmetric90 << ");" << std::endl;
+  Counts sum;
+  double seconds = 0;
+  for(int i = 0; i < shardCount; i++) {
+    std::string fileName = shardFileName(token, i, shardCount);
+    std::ifstream istream(fileName.c_str());
+    Counts c;
+    double s;
+    if(!(istream >> c.all >> c.symmetric180 >> c.symmetric90 >> s)) {
+      std::cerr << "Missing or incomplete shard file " << fileName << std::endl;
+      return 2;
+    }
+    sum += c;
+    seconds += s;
+  }
 
-  fileStream.flush();
-  fileStream.close();
+  Counts counts = NonEncodingCombinationBuilder::finalizeCounts(sum, maxCombination);
+  Combination::checkCounts(token, counts);
+  std::cout << "Computation time: " << seconds << " seconds in " << shardCount << " shards" << std::endl;
+
+  writeRefinementOutput(token, counts, seconds);
   return 0;
 }
 
+int runEstimate(int argc, char** argv) {
+  if(argc < 3) {
+    printUsage();
+    return 1;
+  }
+  uint64_t token = get(argv[2]);
+  Combination maxCombination(token);
+
+  double seconds = 10;
+  int threads = std::thread::hardware_concurrency();
+  uint64_t seed = 1;
+  int maxDist = 0;
+  int positional = 0;
+  for(int i = 3; i < argc; i++) {
+    std::string arg(argv[i]);
+    if(arg == "--seed" && i+1 < argc)
+      seed = get(argv[++i]);
+    else if(arg == "--max-dist" && i+1 < argc)
+      maxDist = (int)get(argv[++i]);
+    else if(arg[0] == '-') {
+      printUsage();
+      return 1;
+    }
+    else if(positional++ == 0)
+      seconds = atof(argv[i]);
+    else
+      threads = get(argv[i]);
+  }
+  const int workerCount = MAX(1, threads-1);
+
+  std::cout << "Estimating <" << token << "> of size " << (int)maxCombination.size << " for " << seconds << " seconds using seed " << seed << std::endl;
+  TreeEstimator estimator(maxCombination, seed);
+  std::cout << "Bases of first wave: " << estimator.numberOfBases() << std::endl;
+
+  SampleStatistics nodes, leaves, time;
+  std::chrono::time_point<std::chrono::steady_clock> timeStart { std::chrono::steady_clock::now() };
+  while(true) {
+    TreeProbe p = estimator.probe();
+    nodes.add(p.nodes);
+    leaves.add(p.leaves);
+    time.add(p.seconds);
+    std::chrono::duration<double, std::ratio<1> > duration(std::chrono::steady_clock::now() - timeStart);
+    if(duration.count() >= seconds || estimator.numberOfBases() == 0)
+      break;
+  }
+
+  std::cout << "Probes: " << nodes.size() << std::endl;
+  std::cout << "Nodes: " << nodes << " (95% confidence)" << std::endl;
+  std::cout << "Leaves: " << leaves << " (95% confidence)" << std::endl;
+  std::cout << "Nodes per second: " << (nodes.getMean() / time.getMean()) << std::endl;
+  std::cout << "Estimated computation time: " << time << " seconds (95% confidence)" << std::endl;
+  std::cout << "Estimated computation time using " << workerCount << " worker threads: " << (time.getMean() / workerCount) << " seconds" << std::endl;
+
+  if(maxDist > 0) {
+    uint8_t base = maxCombination.layerSizes[0];
+    if(base < 2 || base >= maxCombination.size) {
+      std::cerr << "Unsupported base of refinement for precomputations: " << (int)base << std::endl;
+      return 2;
+    }
+    Lemma3 lemma3(base, threads, maxCombination);
+    lemma3.estimate(maxDist, seconds, seed);
+  }
+  return 0;
+}
+
+int runCountEstimate(int argc, char** argv) {
+  if(argc < 3) {
+    printUsage();
+    return 1;
+  }
+  uint64_t token = get(argv[2]);
+  Combination maxCombination(token);
+
+  double seconds = 10;
+  uint64_t seed = 1;
+  for(int i = 3; i < argc; i++) {
+    std::string arg(argv[i]);
+    if(arg == "--seed" && i+1 < argc)
+      seed = get(argv[++i]);
+    else
+      seconds = atof(argv[i]);
+  }
+
+  std::cout << "Estimating counts for <" << token << "> of size " << (int)maxCombination.size << " for " << seconds << " seconds using seed " << seed << std::endl;
+  TreeEstimator estimator(maxCombination, seed);
+
+  // Each probe estimates the counts before NonEncodingCombinationBuilder::finalizeCounts(), which is linear:
+  const double ls0 = maxCombination.layerSizes[0];
+  SampleStatistics all, symmetric180;
+  std::chrono::time_point<std::chrono::steady_clock> timeStart { std::chrono::steady_clock::now() };
+  while(true) {
+    TreeProbe p = estimator.probe();
+    all.add((p.all + p.symmetric180 + 2 * p.symmetric90) / (2 * ls0));
+    symmetric180.add((p.symmetric180 + p.symmetric90) / ls0);
+    std::chrono::duration<double, std::ratio<1> > duration(std::chrono::steady_clock::now() - timeStart);
+    if(duration.count() >= seconds || estimator.numberOfBases() == 0)
+      break;
+  }
+
+  std::cout << "Probes: " << all.size() << std::endl;
+  std::cout << "all: " << all.getMean() << " (standard error " << all.standardError() << ")" << std::endl;
+  std::cout << "symmetric180: " << symmetric180.getMean() << " (standard error " << symmetric180.standardError() << ")" << std::endl;
+
+  // Self check:
+  CountsMap known;
+  Combination::setupKnownCounts(known);
+  Token reversed = Combination::reverseToken(token);
+  if(known.find(token) == known.end())
+    token = reversed;
+  if(known.find(token) == known.end()) {
+    std::cout << "NEW <" << token << "> No known counts to check against" << std::endl;
+    return 0;
+  }
+  const Counts &c = known[token];
+  // Allow 4 standard errors. Exact estimates have a standard error of 0:
+  const double errorAll = all.getMean() - c.all, error180 = symmetric180.getMean() - c.symmetric180;
+  const bool ok = errorAll*errorAll <= 16 * all.standardError() * all.standardError() + 1e-6 * c.all;
+  std::cout << (ok ? "OK <" : "ESTIMATE OUTSIDE ERROR BOUNDS <") << token << "> known counts " << c << std::endl;
+  if(error180*error180 > 16 * symmetric180.standardError() * symmetric180.standardError() + 1e-6 * c.symmetric180) {
+    // Symmetric models are found on few paths with large weights, so short runs tend to underestimate symmetric180 and its error:
+    std::cout << "symmetric180 is outside 4 standard errors. Run longer for a reliable estimate of symmetric180" << std::endl;
+  }
+  return ok ? 0 : 3;
+}
+
+// Sums the refinements of size 'remaining' more bricks on top of prefix having height layers in total:
+Counts assembleRefinements(Lemma1 &lemma1, Token prefix, int layers, int height, int remaining, std::set<Token> &missing, bool print) {
+  if(layers == height) {
+    if(remaining != 0)
+      return Counts();
+    Counts c;
+    if(lemma1.get(prefix, c, missing)) {
+      if(print && c.all > 0)
+	std::cout << "  <" << prefix << "> " << c << std::endl;
+    }
+    else if(print) {
+      std::cout << "  <" << prefix << "> #" << std::endl;
+    }
+    return c;
+  }
+  Counts ret;
+  for(int i = MIN(9, remaining - (height-layers-1)); i >= 1; i--)
+    ret += assembleRefinements(lemma1, 10 * prefix + i, layers + 1, height, remaining - i, missing, print);
+  return ret;
+}
+
+// Finds the refinements without bottlenecks that are missing to assemble a(N):
+void findMissingRefinements(Lemma1 &lemma1, int N, std::set<Token> &missing) {
+  for(int height = 2; height <= N; height++)
+    assembleRefinements(lemma1, 0, 0, height, N, missing, false);
+}
+
+// Prints the counts of the refinements of size N and sets total to a(N). Returns 3 if refinements are missing:
+int assemble(Lemma1 &lemma1, int N, Counts &total) {
+  std::cout << "Refinements of size " << N << std::endl;
+  std::set<Token> missing;
+  total.reset();
+  for(int height = 2; height <= N; height++) {
+    std::cout << " Height " << height << std::endl;
+    std::set<Token> missingForHeight;
+    Counts sum = assembleRefinements(lemma1, 0, 0, height, N, missingForHeight, true);
+    if(missingForHeight.empty())
+      std::cout << "   SUM " << sum << std::endl;
+    else
+      std::cout << "   SUM INCOMPLETE " << sum << std::endl;
+    total += sum;
+    missing.insert(missingForHeight.begin(), missingForHeight.end());
+  }
+
+  if(missing.empty()) {
+    std::cout << "TOTAL " << total << std::endl;
+    std::cout << "a(" << N << ") = " << total.all << ", a180(" << N << ") = " << total.symmetric180 << std::endl;
+    return 0;
+  }
+  std::cout << "TOTAL INCOMPLETE " << total << std::endl;
+  std::cout << "Missing refinements without a bottleneck (" << missing.size() << "):" << std::endl;
+  for(std::set<Token>::const_iterator it = missing.begin(); it != missing.end(); it++)
+    std::cout << "  <" << *it << ">" << std::endl;
+  return 3;
+}
+
+int runAssemble(int argc, char** argv) {
+  if(argc < 3) {
+    printUsage();
+    return 1;
+  }
+  int N = (int)get(argv[2]);
+  if(N < 2 || N > 11) {
+    std::cerr << "Unsupported size: " << N << ". Counts of larger sizes do not fit in 64 bits" << std::endl;
+    return 2;
+  }
+  Lemma1 lemma1;
+  for(int i = 3; i < argc; i++) {
+    if(!lemma1.load(argv[i]))
+      return 2;
+  }
+  Counts total;
+  return assemble(lemma1, N, total);
+}
+
+bool isSupportedRefinement(uint64_t token) {
+  const PackedToken t = PackedToken::fromDecimal(token);
+  if(t.length() < 1 || t.length() > MAX_HEIGHT || t.sum() > MAX_BRICKS)
+    return false;
+  for(uint8_t i = 0; i < t.length(); i++) {
+    if(t.fromRight(i) > MAX_LAYER_SIZE)
+      return false;
+  }
+  return true;
+}
+
+/*
+  Job of J mode: R jobs count a refinement, P jobs compute precomputations, and S jobs sum the precomputations of two P jobs.
+  Counts of R and S jobs are appended to the results file, so they are skipped when restarting.
+ */
+struct Job {
+  char type;
+  uint64_t token; // Refinement counted by R and S jobs. Refinement precomputed by P jobs
+  int left, base, right, maxDist; // Parameters of runSumPrecomputations() for S jobs. P jobs use maxDist
+  double cost, rank; // Estimated seconds using a single thread. Rank adds the largest rank of the jobs depending on this job
+  std::vector<int> dependencies; // Jobs to be done before this job
+  int threads;
+  bool started, done, failed;
+
+  Job(char type, uint64_t token) : type(type), token(token), left(0), base(0), right(0), maxDist(0), cost(0), rank(0), threads(0), started(false), done(false), failed(false) {}
+};
+
+/*
+  Runs the jobs of J mode. Jobs are started largest rank first as their dependencies are done,
+  and each job gets a share of the free threads proportional to its rank among the jobs ready to start.
+ */
+class JobRunner {
+  std::vector<Job> jobs;
+  std::string resultsFileName;
+  int threadCount, freeThreads;
+  std::mutex mutex; // Protects jobs, freeThreads and the results file
+  std::condition_variable jobDone;
+
+  void record(const Job &job, const Counts &counts) {
+    std::lock_guard<std::mutex> guard(mutex);
+    std::ofstream ostream(resultsFileName.c_str(), std::ios::app);
+    ostream << "<" << job.token << "> " << counts << std::endl;
+  }
+
+  bool runR(const Job &job) {
+    Combination maxCombination(job.token);
+    std::stringstream ss; ss << "journal_" << job.token << ".txt";
+    const std::string journalFileName = ss.str();
+    Counts counts;
+    std::chrono::time_point<std::chrono::steady_clock> timeStart;
+    {
+      Journal journal(journalFileName, job.token, 0, 1, 1, 64, 10);
+      if(!journal.ok())
+	return false;
+      timeStart = std::chrono::steady_clock::now();
+      counts = NonEncodingCombinationBuilder::buildShard(job.threads, maxCombination, 0, 1, &journal);
+      counts = NonEncodingCombinationBuilder::finalizeCounts(counts, maxCombination);
+    } // Flushes and closes the journal
+    if(!Combination::checkCounts(job.token, counts))
+      return false;
+    std::chrono::duration<double, std::ratio<1> > duration(std::chrono::steady_clock::now() - timeStart);
+    writeRefinementOutput(job.token, counts, duration.count());
+    record(job, counts);
+    remove(journalFileName.c_str()); // The recorded result is used when restarting
+    return true;
+  }
+
+  bool runP(const Job &job) {
+    Combination maxCombination(job.token);
+    std::stringstream ss; ss << "base_" << (int)maxCombination.layerSizes[0] << "_size_" << (int)maxCombination.size << "_refinement_" << job.token;
+    if(mkdir(ss.str().c_str(), 0755) != 0 && errno != EEXIST) {
+      std::cerr << "Unable to create folder " << ss.str() << std::endl;
+      return false;
+    }
+    Lemma3 lemma3(maxCombination.layerSizes[0], job.threads, maxCombination);
+    lemma3.precompute(job.maxDist); // Complete files are kept
+    return true;
+  }
+
+  bool runS(const Job &job) {
+    Counts counts;
+    if(runSumPrecomputations(job.left, job.base, job.right, job.maxDist, counts) != 0)
+      return false;
+    record(job, counts);
+    return true;
+  }
+
+  void run(const int i) {
+    Job &job = jobs[i];
+    std::cout << "Starting " << job.type << " job <" << job.token << "> using " << job.threads << " threads. Estimated time: " << job.cost << " seconds using a single thread" << std::endl;
+    std::chrono::time_point<std::chrono::steady_clock> timeStart { std::chrono::steady_clock::now() };
+    bool ok;
+    if(job.type == 'R')
+      ok = runR(job);
+    else if(job.type == 'P')
+      ok = runP(job);
+    else
+      ok = runS(job);
+    std::chrono::duration<double, std::ratio<1> > duration(std::chrono::steady_clock::now() - timeStart);
+    std::cout << (ok ? "Done " : "FAILED ") << job.type << " job <" << job.token << "> in " << duration.count() << " seconds" << std::endl;
+
+    std::lock_guard<std::mutex> guard(mutex);
+    job.done = true;
+    job.failed = !ok;
+    freeThreads += job.threads;
+    jobDone.notify_all();
+  }
+
+public:
+  JobRunner(const std::string &resultsFileName, const int threadCount) : resultsFileName(resultsFileName), threadCount(threadCount), freeThreads(threadCount) {}
+
+  int add(const Job &job) {
+    jobs.push_back(job);
+    return (int)jobs.size() - 1;
+  }
+
+  void dependOn(const int job, const int dependency) {
+    jobs[job].dependencies.push_back(dependency);
+  }
+
+  // Skips R and S jobs with counts in the results file, and P jobs only needed by skipped jobs:
+  void skipRecorded(const Lemma1 &lemma1) {
+    std::vector<bool> needed(jobs.size(), false);
+    for(int i = (int)jobs.size()-1; i >= 0; i--) {
+      Job &job = jobs[i];
+      if(job.type == 'P')
+	job.done = !needed[i];
+      else
+	job.done = lemma1.isLoaded(job.token);
+      if(job.done) {
+	std::cout << "Skipping " << job.type << " job <" << job.token << ">" << std::endl;
+	continue;
+      }
+      for(std::vector<int>::const_iterator it = job.dependencies.begin(); it != job.dependencies.end(); it++)
+	needed[*it] = true;
+    }
+  }
+
+  void estimate(const double seconds) {
+    for(std::vector<Job>::iterator it = jobs.begin(); it != jobs.end(); it++) {
+      Job &job = *it;
+      if(job.done || job.type == 'S')
+	continue; // Summing is fast compared to precomputing
+      Combination maxCombination(job.token);
+      if(job.type == 'P') {
+	Lemma3 lemma3(maxCombination.layerSizes[0], 1, maxCombination);
+	job.cost = lemma3.estimate(job.maxDist, seconds, 1);
+	continue;
+      }
+      TreeEstimator estimator(maxCombination, 1);
+      SampleStatistics time;
+      std::chrono::time_point<std::chrono::steady_clock> timeStart { std::chrono::steady_clock::now() };
+      do {
+	time.add(estimator.probe().seconds);
+      }
+      while(std::chrono::duration<double, std::ratio<1> >(std::chrono::steady_clock::now() - timeStart).count() < seconds);
+      job.cost = time.getMean();
+      std::cout << "Estimated time for <" << job.token << ">: " << time << " seconds using a single thread" << std::endl;
+    }
+    // Jobs only depend on jobs added before them:
+    for(int i = (int)jobs.size()-1; i >= 0; i--) {
+      double maxRank = 0;
+      for(int j = i+1; j < (int)jobs.size(); j++) {
+	if(std::find(jobs[j].dependencies.begin(), jobs[j].dependencies.end(), i) != jobs[j].dependencies.end())
+	  maxRank = MAX(maxRank, jobs[j].rank);
+      }
+      jobs[i].rank = jobs[i].cost + maxRank;
+    }
+  }
+
+  bool runAll() {
+    std::vector<std::thread*> threads;
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true) {
+      // Find jobs ready to start:
+      std::vector<int> ready;
+      bool allDone = true, anyRunning = false;
+      for(int i = 0; i < (int)jobs.size(); i++) {
+	const Job &job = jobs[i];
+	allDone &= job.done;
+	anyRunning |= job.started && !job.done;
+	if(job.started || job.done)
+	  continue;
+	bool dependenciesDone = true;
+	for(std::vector<int>::const_iterator it = job.dependencies.begin(); it != job.dependencies.end(); it++)
+	  dependenciesDone &= jobs[*it].done && !jobs[*it].failed;
+	if(dependenciesDone)
+	  ready.push_back(i);
+      }
+      if(allDone || (ready.empty() && !anyRunning))
+	break; // Done, or remaining jobs depend on failed jobs
+
+      std::sort(ready.begin(), ready.end(), [this](const int a, const int b) { return jobs[a].rank > jobs[b].rank; });
+      double rankSum = 0;
+      for(std::vector<int>::const_iterator it = ready.begin(); it != ready.end(); it++)
+	rankSum += jobs[*it].rank;
+      const int free = freeThreads;
+      for(std::vector<int>::const_iterator it = ready.begin(); it != ready.end() && freeThreads > 0; it++) {
+	Job &job = jobs[*it];
+	const int share = rankSum > 0 ? (int)(free * job.rank / rankSum + 0.5) : free / (int)ready.size();
+	job.threads = MAX(1, MIN(freeThreads, share));
+	job.started = true;
+	freeThreads -= job.threads;
+	threads.push_back(new std::thread(&JobRunner::run, this, *it));
+      }
+      jobDone.wait(lock);
+    }
+    lock.unlock();
+    for(std::vector<std::thread*>::iterator it = threads.begin(); it != threads.end(); it++) {
+      (*it)->join();
+      delete *it;
+    }
+
+    bool ok = true;
+    for(std::vector<Job>::const_iterator it = jobs.begin(); it != jobs.end(); it++) {
+      if(!it->done || it->failed) {
+	std::cerr << "Job " << it->type << " <" << it->token << "> was not completed" << std::endl;
+	ok = false;
+      }
+    }
+    return ok;
+  }
+};
+
+int runJobs(int argc, char** argv) {
+  std::string resultsFileName("jobs_results.txt");
+  int threads = std::thread::hardware_concurrency();
+  int N = 0;
+  double estimateSeconds = 1, statsInterval = 10;
+  std::string statsFileName;
+  std::vector<std::string> specs;
+  for(int i = 2; i < argc; i++) {
+    std::string arg(argv[i]);
+    if(arg == "--size" && i+1 < argc)
+      N = (int)get(argv[++i]);
+    else if(arg == "--threads" && i+1 < argc)
+      threads = (int)get(argv[++i]);
+    else if(arg == "--results" && i+1 < argc)
+      resultsFileName = argv[++i];
+    else if(arg == "--estimate" && i+1 < argc)
+      estimateSeconds = atof(argv[++i]);
+    else if(arg == "--stats" && i+1 < argc)
+      statsFileName = argv[++i];
+    else if(arg == "--stats-interval" && i+1 < argc)
+      statsInterval = atof(argv[++i]);
+    else
+      specs.push_back(arg);
+  }
+  threads = MAX(1, threads);
+  if(N != 0 && (N < 2 || N > 11)) {
+    std::cerr << "Unsupported size: " << N << std::endl;
+    return 2;
+  }
+
+  Lemma1 lemma1;
+  {
+    std::ifstream istream(resultsFileName.c_str());
+    if(istream.good() && !lemma1.load(resultsFileName))
+      return 2;
+  }
+
+  JobRunner runner(resultsFileName, threads);
+  if(N != 0) {
+    std::set<Token> missing;
+    findMissingRefinements(lemma1, N, missing);
+    for(std::set<Token>::const_iterator it = missing.begin(); it != missing.end(); it++) {
+      std::stringstream ss; ss << *it;
+      specs.push_back(ss.str());
+    }
+  }
+  for(std::vector<std::string>::const_iterator it = specs.begin(); it != specs.end(); it++) {
+    const std::string &spec = *it;
+    if(spec[0] == 'S') {
+      // S:LEFT:BASE:RIGHT:MAX_DIST sums the precomputations of two P jobs:
+      Job s('S', 0);
+      char c1, c2, c3, c4;
+      std::stringstream ss(spec.substr(1));
+      if(!(ss >> c1 >> s.left >> c2 >> s.base >> c3 >> s.right >> c4 >> s.maxDist) || c1 != ':' || c2 != ':' || c3 != ':' || c4 != ':') {
+	std::cerr << "Invalid job: " << spec << ". Expected S:LEFT:BASE:RIGHT:MAX_DIST" << std::endl;
+	return 2;
+      }
+      s.token = tokenOfSum(s.left, s.base, s.right);
+      Job pl('P', Combination::reverseToken(s.left * 10 + s.base));
+      Job pr('P', Combination::reverseToken(Combination::reverseToken(s.right) * 10 + s.base));
+      pl.maxDist = pr.maxDist = s.maxDist;
+      if(!isSupportedRefinement(s.token) || !isSupportedRefinement(pl.token) || !isSupportedRefinement(pr.token)) {
+	std::cerr << "Unsupported job: " << spec << std::endl;
+	return 2;
+      }
+      const int il = runner.add(pl);
+      const int ir = pl.token == pr.token ? il : runner.add(pr);
+      const int is = runner.add(s);
+      runner.dependOn(is, il);
+      if(ir != il)
+	runner.dependOn(is, ir);
+    }
+    else {
+      uint64_t token = get((char*)spec.c_str());
+      if(!isSupportedRefinement(token)) {
+	std::cerr << "Unsupported refinement: <" << token << "> Skipping" << std::endl;
+	continue;
+      }
+      runner.add(Job('R', token));
+    }
+  }
+
+  runner.skipRecorded(lemma1);
+  runner.estimate(estimateSeconds);
+  Telemetry *telemetry;
+  if(!startTelemetry(statsFileName, statsInterval, telemetry))
+    return 2;
+  std::chrono::time_point<std::chrono::steady_clock> timeStart { std::chrono::steady_clock::now() };
+  const bool ok = runner.runAll();
+  delete telemetry; // Writes the final stats line
+  reportProfile();
+  std::chrono::duration<double, std::ratio<1> > duration(std::chrono::steady_clock::now() - timeStart);
+  std::cout << "Jobs completed in " << duration.count() << " seconds using " << threads << " threads" << std::endl;
+  if(!ok)
+    return 3;
+
+  if(N != 0) {
+    // Lemma 1 composition of the recorded results:
+    Lemma1 lemma1WithResults;
+    if(!lemma1WithResults.load(resultsFileName))
+      return 2;
+    Counts total;
+    return assemble(lemma1WithResults, N, total);
+  }
+  return 0;
+}
+
+/*
+  A case of B mode runs an R, P or S job with a fixed number of threads in a child process,
+  so that the CPU time and peak RSS of the case are those reported by wait4() for the child.
+ */
+struct BenchmarkResult {
+  std::string name;
+  double wall, cpu; // Seconds
+  long peakRssKB;
+  uint64_t nodes; // Of the wave tree (see Telemetry)
+  double lockWait, idle, joinWait, tail; // Seconds summed over the threads (see WaitStatistics)
+  bool ok;
+
+  BenchmarkResult() : wall(0), cpu(0), peakRssKB(0), nodes(0), lockWait(0), idle(0), joinWait(0), tail(0), ok(false) {}
+};
+
+std::string benchmarkName(const Job &job) {
+  std::stringstream ss;
+  if(job.type == 'S')
+    ss << "S " << job.left << ":" << job.base << ":" << job.right << ":" << job.maxDist;
+  else if(job.type == 'P')
+    ss << "P " << job.token << ":" << job.maxDist;
+  else
+    ss << "R " << job.token;
+  return ss.str();
+}
+
+// Runs a case in the child process. Precomputation files are overwritten, so that P cases compute all files:
+int runBenchmarkCase(const Job &job, const int threads) {
+  if(job.type == 'R') {
+    Combination maxCombination(job.token);
+    Counts counts = NonEncodingCombinationBuilder::buildShard(threads, maxCombination, 0, 1, NULL);
+    counts = NonEncodingCombinationBuilder::finalizeCounts(counts, maxCombination);
+    return Combination::checkCounts(job.token, counts) ? 0 : 3;
+  }
+  if(job.type == 'P') {
+    Combination maxCombination(job.token);
+    std::stringstream ss; ss << "base_" << (int)maxCombination.layerSizes[0] << "_size_" << (int)maxCombination.size << "_refinement_" << job.token;
+    if(mkdir(ss.str().c_str(), 0755) != 0 && errno != EEXIST) {
+      std::cerr << "Unable to create folder " << ss.str() << std::endl;
+      return 2;
+    }
+    Lemma3 lemma3(maxCombination.layerSizes[0], threads, maxCombination);
+    lemma3.precompute(job.maxDist, true);
+    return 0;
+  }
+  Counts counts;
+  return runSumPrecomputations(job.left, job.base, job.right, job.maxDist, counts);
+}
+
+bool runBenchmark(const Job &job, const int threads, BenchmarkResult &result) {
+  result.name = benchmarkName(job);
+  int fds[2];
+  if(pipe(fds) != 0) {
+    std::cerr << "Unable to create pipe: " << strerror(errno) << std::endl;
+    return false;
+  }
+  std::cout.flush();
+  std::chrono::time_point<std::chrono::steady_clock> timeStart { std::chrono::steady_clock::now() };
+  const pid_t pid = fork();
+  if(pid < 0) {
+    std::cerr << "Unable to fork: " << strerror(errno) << std::endl;
+    close(fds[0]);
+    close(fds[1]);
+    return false;
+  }
+  if(pid == 0) {
+    // Child: Output of the job is silenced. The nodes expanded and the wait statistics are written to the pipe:
+    close(fds[0]);
+    if(freopen("/dev/null", "w", stdout) == NULL)
+      _exit(2);
+    const int exitCode = runBenchmarkCase(job, threads);
+    std::cout.flush();
+    uint64_t stats[5], leaves, simonCalls, units;
+    Telemetry::sum(stats[0], leaves, simonCalls, units);
+    stats[1] = WaitStatistics::lockWait;
+    stats[2] = WaitStatistics::idle;
+    stats[3] = WaitStatistics::joinWait;
+    stats[4] = WaitStatistics::tail;
+    ssize_t written = write(fds[1], stats, sizeof(stats));
+    close(fds[1]);
+    _exit(written == sizeof(stats) ? exitCode : 2);
+  }
+
+  close(fds[1]);
+  uint64_t stats[5];
+  if(read(fds[0], stats, sizeof(stats)) == sizeof(stats)) {
+    result.nodes = stats[0];
+    result.lockWait = stats[1] / 1e9;
+    result.idle = stats[2] / 1e9;
+    result.joinWait = stats[3] / 1e9;
+    result.tail = stats[4] / 1e9;
+  }
+  close(fds[0]);
+  int status;
+  struct rusage usage;
+  if(wait4(pid, &status, 0, &usage) != pid) {
+    std::cerr << "Unable to wait for " << result.name << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+  std::chrono::duration<double, std::ratio<1> > duration(std::chrono::steady_clock::now() - timeStart);
+  result.wall = duration.count();
+  result.cpu = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+  result.peakRssKB = usage.ru_maxrss;
+  result.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  return true;
+}
+
+// Absolute path of fileName, as B mode changes the working directory:
+std::string absolutePath(const std::string &fileName) {
+  if(fileName.empty() || fileName[0] == '/')
+    return fileName;
+  char cwd[4096];
+  if(getcwd(cwd, sizeof(cwd)) == NULL)
+    return fileName;
+  return std::string(cwd) + "/" + fileName;
+}
+
+// Value of "key" in a line of a results file of B mode. Strings are returned without quotes:
+std::string jsonValue(const std::string &line, const std::string &key) {
+  const std::string pattern = "\"" + key + "\":";
+  size_t start = line.find(pattern);
+  if(start == std::string::npos)
+    return "";
+  start += pattern.size();
+  if(line[start] == '"') {
+    const size_t end = line.find('"', start+1);
+    return end == std::string::npos ? "" : line.substr(start+1, end-start-1);
+  }
+  const size_t end = line.find_first_of(",}", start);
+  return line.substr(start, end == std::string::npos ? std::string::npos : end-start);
+}
+
+// Wall times of the cases of a results file of B mode. Each case is on a line of its own:
+bool loadBenchmarkBaseline(const std::string &fileName, std::map<std::string,double> &baseline) {
+  std::ifstream istream(fileName.c_str());
+  if(!istream.good()) {
+    std::cerr << "Unable to read baseline " << fileName << std::endl;
+    return false;
+  }
+  std::string line;
+  while(std::getline(istream, line)) {
+    const std::string name = jsonValue(line, "name"), wall = jsonValue(line, "wall");
+    if(!name.empty() && !wall.empty())
+      baseline[name] = atof(wall.c_str());
+  }
+  return true;
+}
+
+int runBenchmarks(int argc, char** argv) {
+  int threads = 2, repeat = 1;
+  bool full = false;
+  double tolerance = 0.1;
+  std::string outputFileName("benchmark_results.json"), baselineFileName, directory("benchmark_work");
+  for(int i = 2; i < argc; i++) {
+    std::string arg(argv[i]);
+    if(arg == "--threads" && i+1 < argc)
+      threads = (int)get(argv[++i]);
+    else if(arg == "--repeat" && i+1 < argc)
+      repeat = (int)get(argv[++i]);
+    else if(arg == "--full")
+      full = true;
+    else if(arg == "--output" && i+1 < argc)
+      outputFileName = argv[++i];
+    else if(arg == "--baseline" && i+1 < argc)
+      baselineFileName = argv[++i];
+    else if(arg == "--tolerance" && i+1 < argc)
+      tolerance = atof(argv[++i]);
+    else if(arg == "--dir" && i+1 < argc)
+      directory = argv[++i];
+    else {
+      printUsage();
+      return 1;
+    }
+  }
+  threads = MAX(1, threads);
+  repeat = MAX(1, repeat);
+
+  std::map<std::string,double> baseline;
+  if(!baselineFileName.empty() && !loadBenchmarkBaseline(baselineFileName, baseline))
+    return 2;
+  outputFileName = absolutePath(outputFileName);
+
+  // Cases as in X mode. P cases run before the S cases summing their files:
+  std::vector<Job> cases;
+  const int refinements[4] = {221, 222, 321, 33};
+  for(int i = 0; i < 4; i++)
+    cases.push_back(Job('R', refinements[i]));
+  if(full) {
+    const int fullRefinements[3] = {2221, 232, 322};
+    for(int i = 0; i < 3; i++)
+      cases.push_back(Job('R', fullRefinements[i]));
+  }
+  const int precomputations[3][4] = {{1, 2, 1, 8}, {2, 3, 2, 16}, {12, 2, 21, 16}}; // LEFT BASE RIGHT MAX_DIST
+  for(int i = 0; i < 3; i++) {
+    Job p('P', Combination::reverseToken(precomputations[i][0] * 10 + precomputations[i][1]));
+    p.maxDist = precomputations[i][3];
+    cases.push_back(p);
+  }
+  for(int i = 0; i < 3; i++) {
+    Job s('S', tokenOfSum(precomputations[i][0], precomputations[i][1], precomputations[i][2]));
+    s.left = precomputations[i][0];
+    s.base = precomputations[i][1];
+    s.right = precomputations[i][2];
+    s.maxDist = precomputations[i][3];
+    cases.push_back(s);
+  }
+
+  if(mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+    std::cerr << "Unable to create folder " << directory << std::endl;
+    return 2;
+  }
+  if(chdir(directory.c_str()) != 0) {
+    std::cerr << "Unable to change to folder " << directory << std::endl;
+    return 2;
+  }
+
+  std::cout << "Running " << cases.size() << " benchmarks using " << threads << " threads in " << directory << std::endl;
+  std::vector<BenchmarkResult> results;
+  bool ok = true, regressed = false;
+  for(std::vector<Job>::const_iterator it = cases.begin(); it != cases.end(); it++) {
+    BenchmarkResult best;
+    for(int i = 0; i < repeat; i++) {
+      BenchmarkResult result;
+      if(!runBenchmark(*it, threads, result))
+	return 2;
+      if(i == 0 || !result.ok || (best.ok && result.wall < best.wall))
+	best = result;
+      if(!result.ok)
+	break;
+    }
+    results.push_back(best);
+    ok = ok && best.ok;
+
+    std::cout << (best.ok ? "OK     " : "FAILED ") << best.name << ": " << best.wall << " seconds, CPU " << best.cpu << " seconds, peak RSS " << best.peakRssKB << " KB";
+    if(best.nodes > 0)
+      std::cout << ", " << (uint64_t)(best.nodes / best.wall) << " nodes/second";
+    std::map<std::string,double>::const_iterator b = baseline.find(best.name);
+    if(b != baseline.end() && b->second > 0) {
+      const double ratio = best.wall / b->second;
+      std::cout << ", " << ratio << " x baseline";
+      if(ratio > 1 + tolerance) {
+	std::cout << " REGRESSION";
+	regressed = true;
+      }
+    }
+    std::cout << std::endl;
+  }
+
+  std::ofstream ostream(outputFileName.c_str());
+  ostream << "{\"threads\":" << threads << ",\"repeat\":" << repeat << ",\"cases\":[" << std::endl;
+  for(std::vector<BenchmarkResult>::const_iterator it = results.begin(); it != results.end(); it++) {
+    ostream << " {\"name\":\"" << it->name << "\""
+	    << ",\"wall\":" << it->wall
+	    << ",\"cpu\":" << it->cpu
+	    << ",\"peakRssKB\":" << it->peakRssKB
+	    << ",\"nodes\":" << it->nodes
+	    << ",\"nodesPerSecond\":" << (it->wall > 0 ? it->nodes / it->wall : 0)
+	    << ",\"ok\":" << (it->ok ? "true" : "false") << "}"
+	    << (it+1 == results.end() ? "" : ",") << std::endl;
+  }
+  ostream << "]}" << std::endl;
+  std::cout << "Wrote " << outputFileName << std::endl;
+
+  if(!ok)
+    return 3;
+  if(regressed) {
+    std::cout << "Slower than the baseline by more than " << (tolerance * 100) << "%" << std::endl;
+    return 4;
+  }
+  return 0;
+}
+
+/*
+  H mode runs an R case (or a P case when MAX_DIST is given) at 1, 2, 4, ... threads up to --max-threads.
+  Each run is a case of B mode, so the wait statistics are those of a fresh process.
+ */
+int runScaling(int argc, char** argv) {
+  if(argc < 3) {
+    printUsage();
+    return 1;
+  }
+  Job job('R', get(argv[2]));
+  int maxThreads = std::thread::hardware_concurrency();
+  std::string directory("benchmark_work");
+  for(int i = 3; i < argc; i++) {
+    std::string arg(argv[i]);
+    if(arg == "--max-threads" && i+1 < argc)
+      maxThreads = (int)get(argv[++i]);
+    else if(arg == "--dir" && i+1 < argc)
+      directory = argv[++i];
+    else if(job.type == 'R' && arg[0] != '-') {
+      job.type = 'P';
+      job.maxDist = (int)get(argv[i]);
+    }
+    else {
+      printUsage();
+      return 1;
+    }
+  }
+  maxThreads = MAX(1, maxThreads);
+  if(job.type == 'P' && Combination(job.token).layerSizes[0] < 2) {
+    std::cerr << "Unsupported base of refinement: " << job.token << std::endl;
+    return 2;
+  }
+
+  if(mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+    std::cerr << "Unable to create folder " << directory << std::endl;
+    return 2;
+  }
+  if(chdir(directory.c_str()) != 0) {
+    std::cerr << "Unable to change to folder " << directory << std::endl;
+    return 2;
+  }
+
+  std::cout << "Scaling of " << benchmarkName(job) << " up to " << maxThreads << " threads. R and P modes use THREADS-1 worker threads" << std::endl;
+  std::cout << "Wait times are seconds summed over the threads. Lost is the wait time as a fraction of THREADS * wall time" << std::endl;
+  std::cout << "threads\twall\tcpu\tspeedup\tefficiency\tlockWait\tidle\tjoinWait\ttail\tlost" << std::endl;
+  double wall1 = 0;
+  bool ok = true;
+  for(int threads = 1; ; threads = MIN(2*threads, maxThreads)) {
+    BenchmarkResult result;
+    if(!runBenchmark(job, threads, result))
+      return 2;
+    ok = ok && result.ok;
+    if(threads == 1)
+      wall1 = result.wall;
+    const double speedup = result.wall > 0 ? wall1 / result.wall : 0;
+    const double lost = result.lockWait + result.idle + result.joinWait + result.tail;
+    std::cout << threads << "\t" << result.wall << "\t" << result.cpu << "\t" << speedup << "\t" << (speedup / threads)
+	      << "\t" << result.lockWait << "\t" << result.idle << "\t" << result.joinWait << "\t" << result.tail
+	      << "\t" << (result.wall > 0 ? lost / (threads * result.wall) : 0)
+	      << (result.ok ? "" : "\tFAILED") << std::endl;
+    if(threads == maxThreads)
+      break;
+  }
+  return ok ? 0 : 3;
+}
+
 int runPrecomputations(int argc, char** argv) {
   if(argc < 4) {
     printUsage();
@@ -259,23 +1303,145 @@ int runPrecomputations(int argc, char** argv) {
     return 2;
   }
   int maxDist = get(argv[3]);
-  int threads = argc > 4 ? get(argv[4]) : std::thread::hardware_concurrency();
+  int threads = std::thread::hardware_concurrency(), format = 2;
+  std::string statsFileName;
+  double statsInterval = 10;
+  for(int i = 4; i < argc; i++) {
+    std::string arg(argv[i]);
+    if(arg == "--stats" && i+1 < argc)
+      statsFileName = argv[++i];
+    else if(arg == "--stats-interval" && i+1 < argc)
+      statsInterval = atof(argv[++i]);
+    else if(arg == "--format" && i+1 < argc)
+      format = get(argv[++i]);
+    else if(arg[0] == '-') {
+      printUsage();
+      return 1;
+    }
+    else
+      threads = get(argv[i]);
+  }
+  if(format != 1 && format != 2) {
+    std::cerr << "Unsupported file format: " << format << std::endl;
+    return 2;
+  }
+  Telemetry *telemetry;
+  if(!startTelemetry(statsFileName, statsInterval, telemetry))
+    return 2;
 
   std::cout << "Precomputing refinement " << token << " up to distance of " << maxDist << " using " << threads << " threads" << std::endl;
 
   Lemma3 lemma3(base, threads, maxCombination);
+  lemma3.setFormat(format);
 #ifdef DEBUG
   std::cout << "Running debug mode: Files are overwritten!" << std::endl;
   lemma3.precompute(maxDist, true);
 #else
   lemma3.precompute(maxDist);
 #endif
+  delete telemetry; // Writes the final stats line
+  reportProfile();
 
   std::chrono::duration<double, std::ratio<1> > duration = std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > >(std::chrono::steady_clock::now() - timeStart);
   std::cout << "Total precomputation time: " << duration.count() << " seconds" << std::endl;
   return 0;
 }
 
+// True if the batches of a and b are equal:
+bool sameBatch(const Report *a, int cntA, const Report *b, int cntB) {
+  if(cntA != cntB)
+    return false;
+  for(int i = 0; i < cntA; i++) {
+    if(a[i].baseSymmetric180 != b[i].baseSymmetric180 || a[i].baseSymmetric90 != b[i].baseSymmetric90 ||
+       !(a[i].c == b[i].c) || a[i].counts != b[i].counts)
+      return false;
+    for(int j = 0; j < a[i].base-1; j++) {
+      if(a[i].colors[j] != b[i].colors[j])
+	return false;
+    }
+  }
+  return true;
+}
+
+/*
+  Converts a precomputation file to format 2 in place: The file is written to FILE.v2, which replaces FILE
+  once it has been read back batch by batch along with FILE.
+ */
+int convertPrecomputationFile(const Combination &maxCombination, int d) {
+  const std::string fileName = BitReader::getFileName(maxCombination, d, "");
+  const std::string convertedFileName = fileName + ".v2";
+  bool ok;
+  {
+    BitReader reader(fileName, maxCombination, d);
+    if(reader.getFormat() == 2) {
+      std::cout << "  Already in format 2" << std::endl;
+      return 0;
+    }
+    if(reader.getFormat() != 1) {
+      std::cerr << "Unable to read " << fileName << std::endl;
+      return 2;
+    }
+    VarintWriter writer(convertedFileName, maxCombination, d);
+    Report reports[MAX_BATCH_REPORTS];
+    int cnt;
+    while((cnt = reader.next(reports)) > 0)
+      writer.writeBatch(reports[0].c, reports[0].baseSymmetric180, reports[0].baseSymmetric90, reports, cnt);
+    ok = reader.isGood();
+  }
+  if(!ok) {
+    std::cerr << "Incomplete file " << fileName << " is not converted" << std::endl;
+    unlink(convertedFileName.c_str());
+    return 3;
+  }
+
+  // Read back:
+  {
+    BitReader reader1(fileName, maxCombination, d);
+    BitReader reader2(convertedFileName, maxCombination, d);
+    Report reports1[MAX_BATCH_REPORTS], reports2[MAX_BATCH_REPORTS];
+    int cnt1, cnt2;
+    do {
+      cnt1 = reader1.next(reports1);
+      cnt2 = reader2.next(reports2);
+      ok = sameBatch(reports1, cnt1, reports2, cnt2);
+    } while(ok && cnt1 > 0);
+    ok = ok && reader1.isGood() && reader2.isGood() && reader2.getFormat() == 2;
+  }
+  if(!ok) {
+    std::cerr << "Converted file " << convertedFileName << " does not match " << fileName << std::endl;
+    unlink(convertedFileName.c_str());
+    return 4;
+  }
+
+  struct stat before, after;
+  if(stat(fileName.c_str(), &before) != 0 || stat(convertedFileName.c_str(), &after) != 0 ||
+     rename(convertedFileName.c_str(), fileName.c_str()) != 0) {
+    std::cerr << "Unable to replace " << fileName << ": " << strerror(errno) << std::endl;
+    return 2;
+  }
+  std::cout << "  Converted " << before.st_size << " bytes to " << after.st_size << " bytes" << std::endl;
+  return 0;
+}
+
+int runConversion(int argc, char** argv) {
+  if(argc < 4) {
+    printUsage();
+    return 1;
+  }
+  const Combination maxCombination(get(argv[2]));
+  const int maxDist = get(argv[3]);
+  if(maxCombination.layerSizes[0] < 2) {
+    std::cerr << "Unsupported base of refinement: " << (int)maxCombination.layerSizes[0] << std::endl;
+    return 2;
+  }
+  for(int d = 2; d <= maxDist; d++) {
+    const int ret = convertPrecomputationFile(maxCombination, d);
+    if(ret != 0)
+      return ret;
+  }
+  return 0;
+}
+
 int runPrecomputationComparison(int argc, char** argv) {
   if(argc < 7) {
     printUsage();
@@ -299,12 +1465,19 @@ int runPrecomputationComparison(int argc, char** argv) {
       std::cout << " " << suffix << " read, now reading from other" << std::endl;
 #endif
       bool ok = reader2.next(r2);
+      if(ok && !(r2[0].c == r1[0].c)) {
+	// Bases are not in the same order in both files. Look up the base in the second file:
+	r2.clear();
+	ok = reader2.seek(r1[0].c) && reader2.next(r2);
+      }
 #ifdef DEBUG
       std::cout << " Other read" << std::endl;
 #endif
       cnt++;
-      if(!ok)
-	std::cerr << "Data missing from second stream!" << std::endl;
+      if(!ok) {
+	std::cerr << "Data missing from second stream! Base: " << r1[0].c << std::endl;
+	return 5;
+      }
       if(r1.size() != r2.size()) {
 	std::cerr << "Report size does not match!" << std::endl;
 	std::cerr << "Sizes: " << r1.size() << " / " << r2.size() << std::endl;
@@ -372,6 +1545,222 @@ int runPrecomputationComparison(int argc, char** argv) {
   return 0;
 }
 
+// Unranks all encodings of bases of size 1 to 4 and ranks them back:
+int testEncodingRanks() {
+  std::cout << "Testing ranks of encodings" << std::endl;
+  const int bell[5] = {1, 1, 2, 5, 15};
+  for(uint8_t baseSize = 1; baseSize <= 4; baseSize++) {
+    if(EncodingCounts::countEncodings(baseSize) != bell[baseSize]) {
+      std::cerr << "Encodings of base size " << (int)baseSize << ": " << EncodingCounts::countEncodings(baseSize) << " != " << bell[baseSize] << std::endl;
+      return 2;
+    }
+    uint8_t colors[4], prev[4];
+    for(int rank = 0; rank < bell[baseSize]; rank++) {
+      EncodingCounts::unrank(rank, baseSize, colors);
+      for(uint8_t i = 0; i < baseSize; i++) {
+	if(colors[i] < 1 || colors[i] > i+1 || colors[colors[i]-1] != colors[i]) {
+	  std::cerr << "Invalid encoding of rank " << rank << " for base size " << (int)baseSize << std::endl;
+	  return 2;
+	}
+      }
+      if(rank > 0 && !std::lexicographical_compare(prev, prev+baseSize, colors, colors+baseSize)) {
+	std::cerr << "Encoding of rank " << rank << " for base size " << (int)baseSize << " is not after rank " << rank-1 << std::endl;
+	return 2;
+      }
+      if(EncodingCounts::rank(colors, baseSize) != rank) {
+	std::cerr << "Encoding of rank " << rank << " for base size " << (int)baseSize << " ranks as " << EncodingCounts::rank(colors, baseSize) << std::endl;
+	return 2;
+      }
+      std::copy(colors, colors+baseSize, prev);
+    }
+  }
+  return 0;
+}
+
+// Compares PackedToken to computations on the decimal digits of all tokens of up to 5 layers of 1 to 9 bricks:
+int testPackedTokens() {
+  std::cout << "Testing packed tokens" << std::endl;
+  for(Token token = 1; token < 100000; token++) {
+    uint8_t digits[5], length = 0, sum = 0; // digits[0] is the last digit
+    Token reversed = 0;
+    bool ok = true;
+    for(Token t = token; t > 0; t /= 10) {
+      ok = ok && t % 10 != 0;
+      digits[length++] = t % 10;
+      sum += t % 10;
+      reversed = 10 * reversed + t % 10;
+    }
+    if(!ok)
+      continue; // Layers can not be empty
+    const PackedToken packed = PackedToken::fromDecimal(token);
+    bool same = packed.toDecimal() == token && packed.length() == length && packed.sum() == sum &&
+      packed.reverse().toDecimal() == reversed && Combination::reverseToken(token) == reversed &&
+      Combination::heightOfToken(token) == length && Combination::sizeOfToken(token) == sum &&
+      packed.concat(PackedToken::fromDecimal(21)).toDecimal() == 100 * token + 21;
+    uint8_t layerSizes[MAX_HEIGHT];
+    Combination::getLayerSizesFromToken(token, layerSizes);
+    for(uint8_t i = 0; i < length; i++)
+      same = same && packed.fromRight(i) == digits[i] && layerSizes[length-1-i] == digits[i];
+    if(!same) {
+      std::cerr << "Packed token mismatch for " << token << std::endl;
+      return 2;
+    }
+  }
+
+  // Tokens of encodings are the refinement followed by the colors:
+  for(uint8_t baseSize = 1; baseSize <= 4; baseSize++) {
+    EncodingCounts counts(221, baseSize);
+    for(int rank = 0; rank < counts.size(); rank++) {
+      uint8_t colors[4];
+      EncodingCounts::unrank(rank, baseSize, colors);
+      Token token = 221;
+      for(uint8_t i = 0; i < baseSize; i++)
+	token = 10 * token + colors[i];
+      if(counts.getToken(rank) != token || counts.getPackedToken(rank).toDecimal() != token) {
+	std::cerr << "Token of encoding of rank " << rank << " for base size " << (int)baseSize << ": " << counts.getToken(rank) << " != " << token << std::endl;
+	return 2;
+      }
+    }
+  }
+  return 0;
+}
+
+// Assembles a(3) to a(10) from results.txt:
+int testAssemble() {
+  std::cout << "Testing assembly of a(N) from results.txt" << std::endl;
+  const Counts expected[11] = {Counts(), Counts(1, 1, 0), Counts(24, 2, 0), Counts(1560, 44, 0), Counts(119580, 185, 0), Counts(10166403, 3276, 0),
+			       Counts(915103765, 15682, 0), Counts(85747377755ULL, 282377, 0), Counts(8274075616387ULL, 1480410, 0),
+			       Counts(816630819554486ULL, 26264942, 0), Counts(82052796578652749ULL, 145036229, 0)};
+  Lemma1 lemma1;
+  if(!lemma1.load("results.txt"))
+    return 2;
+  for(int N = 3; N <= 10; N++) {
+    Counts total;
+    if(assemble(lemma1, N, total) != 0 || total.all != expected[N].all || total.symmetric180 != expected[N].symmetric180) {
+      std::cerr << "Assembled a(" << N << ") = " << total.all << ", a180(" << N << ") = " << total.symmetric180 << ". Expected " << expected[N] << std::endl;
+      return 2;
+    }
+  }
+  return 0;
+}
+
+// Runs a mode as if from the command line. args are separated by spaces:
+int runWithArgs(int (*mode)(int, char**), const std::string &args) {
+  std::vector<std::string> words;
+  std::stringstream ss(args);
+  std::string word;
+  words.push_back("run.o");
+  while(ss >> word)
+    words.push_back(word);
+  std::vector<char*> argv;
+  for(size_t i = 0; i < words.size(); i++)
+    argv.push_back(&words[i][0]);
+  return mode((int)argv.size(), &argv[0]);
+}
+
+// Counts a refinement in 3 shards using R mode and merges them using M mode:
+int testShards(uint64_t token, const Counts &expected) {
+  std::cout << "Testing 3 shards of refinement " << token << std::endl;
+  for(int i = 0; i < 3; i++) {
+    std::stringstream args; args << "R " << token << " 3 --shard " << i << "/3";
+    if(runWithArgs(runRefinement, args.str()) != 0)
+      return 2;
+  }
+  std::stringstream args; args << "M " << token << " 3";
+  if(runWithArgs(runMergeShards, args.str()) != 0)
+    return 2;
+
+  std::stringstream ss; ss << "output_" << token << ".txt";
+  std::ifstream istream(ss.str().c_str());
+  std::string line;
+  std::getline(istream, line);
+  std::stringstream expectedLine; expectedLine << "<" << token << "> " << expected;
+  if(line != expectedLine.str()) {
+    std::cerr << "Merged shards mismatch: " << line << " != " << expectedLine.str() << std::endl;
+    return 2;
+  }
+  istream.close();
+  remove(ss.str().c_str());
+  for(int i = 0; i < 3; i++) {
+    std::stringstream shardFileName; shardFileName << "shard_" << token << "_" << i << "_of_3.txt";
+    remove(shardFileName.str().c_str());
+  }
+  return 0;
+}
+
+// Counts a refinement using a journal, cuts the journal in the middle of a line as if crashed, and resumes from it:
+int testJournalResume(uint64_t token, const Counts &expected, int depth) {
+  std::cout << "Testing resume from truncated journal of depth " << depth << " for refinement " << token << std::endl;
+  std::stringstream ss; ss << "journal_test_" << token << "_" << depth << ".txt";
+  const std::string fileName = ss.str();
+  remove(fileName.c_str());
+  Combination maxCombination(token);
+  for(int run = 0; run < 2; run++) {
+    Journal journal(fileName, token, 0, 1, depth, 1, 10);
+    if(!journal.ok())
+      return 2;
+    if(run == 1 && journal.size() == 0) {
+      std::cerr << "Nothing resumed from " << fileName << std::endl;
+      return 2;
+    }
+    Counts counts = NonEncodingCombinationBuilder::buildShard(3, maxCombination, 0, 1, &journal);
+    counts = NonEncodingCombinationBuilder::finalizeCounts(counts, maxCombination);
+    if(counts != expected) {
+      std::cerr << "Journal test " << (run == 0 ? "run" : "resume") << " mismatch: " << counts << " != " << expected << std::endl;
+      return 2;
+    }
+    if(run == 0) {
+      journal.flush();
+      struct stat st;
+      if(stat(fileName.c_str(), &st) != 0 || truncate(fileName.c_str(), st.st_size / 2) != 0) {
+	std::cerr << "Unable to truncate " << fileName << std::endl;
+	return 2;
+      }
+    }
+  }
+  remove(fileName.c_str());
+  return 0;
+}
+
+// Seeks to every base in the precomputation files of a refinement in reverse order and compares with sequential reads:
+int testSeek(const Combination &maxCombination, int maxDist) {
+  for(int D = 2; D <= maxDist; D++) {
+    std::vector<std::vector<Report> > batches;
+    BitReader sequential(maxCombination, D, "");
+    std::vector<Report> v;
+    while(sequential.next(v)) {
+      batches.push_back(v);
+      v.clear();
+    }
+    BitReader reader(maxCombination, D, "");
+    std::cout << "Testing seek in format " << reader.getFormat() << " file for D=" << D << " with " << batches.size() << " bases" << std::endl;
+    for(std::vector<std::vector<Report> >::const_reverse_iterator it = batches.rbegin(); it != batches.rend(); it++) {
+      const std::vector<Report> &expected = *it;
+      v.clear();
+      if(!reader.seek(expected[0].c) || !reader.next(v) || v.size() != expected.size()) {
+	std::cerr << "Seek failed for base " << expected[0].c << " at D=" << D << std::endl;
+	return 2;
+      }
+      for(size_t i = 0; i < v.size(); i++) {
+	const Report &a = v[i], &b = expected[i];
+	bool same = a.base == b.base && a.c == b.c && a.counts == b.counts &&
+	  a.baseSymmetric180 == b.baseSymmetric180 && a.baseSymmetric90 == b.baseSymmetric90;
+	for(int j = 0; same && j < a.base-1; j++)
+	  same = a.colors[j] == b.colors[j];
+	if(!same) {
+	  std::cerr << "Seek to base " << b.c << " at D=" << D << " reads " << a.counts << " != " << b.counts << std::endl;
+	  return 2;
+	}
+      }
+    }
+    if(reader.seek(Base())) {
+      std::cerr << "Seek to missing base succeeded at D=" << D << std::endl;
+      return 2;
+    }
+  }
+  return 0;
+}
+
 int runRegressionTests() {
 #ifndef DEBUG
   std::cerr << "Please compile with -DDEBUG for test suite to test properly!" << std::endl;
@@ -382,6 +1771,14 @@ int runRegressionTests() {
 
   std::chrono::time_point<std::chrono::steady_clock> timeStart { std::chrono::steady_clock::now() };
 
+  int exitCode = testEncodingRanks();
+  if(exitCode == 0)
+    exitCode = testPackedTokens();
+  if(exitCode == 0)
+    exitCode = testAssemble();
+  if(exitCode != 0)
+    return exitCode;
+
   // Build refinements:
   uint8_t layerSizes[MAX_HEIGHT];
 
@@ -409,6 +1806,21 @@ int runRegressionTests() {
       return 2;
     }
   }
+  // Test sharding:
+  uint64_t shardTokens[2] = {221, 321};
+  for(int i = 0; i < 2; i++) {
+    exitCode = testShards(shardTokens[i], m[shardTokens[i]]);
+    if(exitCode != 0)
+      return exitCode;
+  }
+
+  // Test resuming using journals:
+  for(int depth = 1; depth <= 2; depth++) {
+    exitCode = testJournalResume(321, m[321], depth);
+    if(exitCode != 0)
+      return exitCode;
+  }
+
   //return 0;
   // Test precomputations:
   int tokens[7] = {32, 23, 22, 21, 31, 221, 41};
@@ -419,7 +1831,17 @@ int runRegressionTests() {
     uint8_t base = maxCombination.layerSizes[0];
     int maxDist = base > 2 || maxCombination.height > 2 ? 16 : 8;
     Lemma3 lemma3(base, 3, maxCombination);
+    if(token == 21) {
+      // Also test seek in format 1, which scans the file from the start:
+      lemma3.setFormat(1);
+      lemma3.precompute(maxDist, true);
+      if(testSeek(maxCombination, maxDist) != 0)
+	return 2;
+      lemma3.setFormat(2);
+    }
     lemma3.precompute(maxDist, true);
+    if(base < 4 && testSeek(maxCombination, maxDist) != 0) // Files of base 4 have millions of bases
+      return 2;
 
     // Sum together to check results
     token = Combination::reverseToken(token);
@@ -444,17 +1866,34 @@ int main(int argc, char** argv) {
     return 1;
   }
   BinomialCoefficient::init();
+  EncodingCounts::init();
   char function = argv[1][0];
 
   switch(function) {
   case 'R':
     return runRefinement(argc, argv);
+  case 'M':
+    return runMergeShards(argc, argv);
+  case 'E':
+    return runEstimate(argc, argv);
+  case 'C':
+    return runCountEstimate(argc, argv);
+  case 'A':
+    return runAssemble(argc, argv);
+  case 'J':
+    return runJobs(argc, argv);
+  case 'B':
+    return runBenchmarks(argc, argv);
+  case 'H':
+    return runScaling(argc, argv);
   case 'P':
     return runPrecomputations(argc, argv);
   case 'S':
     return runSumPrecomputations(argc, argv);
   case 'T':
     return runPrecomputationComparison(argc, argv);
+  case 'V':
+    return runConversion(argc, argv);
   case 'X':
     return runRegressionTests();
   default:
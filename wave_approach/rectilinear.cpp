@@ -5,9 +5,22 @@
 #include <thread>
 #include <sstream>
 #include <iostream>
+#include <cmath>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <new>
+#include <sys/stat.h>
 
 #include "rectilinear.h"
 
+#if !defined(NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define X86_SIMD
+#include <immintrin.h>
+#endif
+
 namespace rectilinear {
 
   uint64_t BinomialCoefficient::cache[BINOMIAL_CACHE_SIZE][BINOMIAL_CACHE_SIZE];
@@ -39,6 +52,24 @@ namespace rectilinear {
     return ret;
   }
 
+  template <typename T>
+  static T fnv1a(const uint8_t *data, const uint64_t size, const T basis, const T prime) {
+    T ret = basis;
+    for(uint64_t i = 0; i < size; i++) {
+      ret ^= data[i];
+      ret *= prime;
+    }
+    return ret;
+  }
+
+  uint32_t FNV1a::hash32(const uint8_t *data, const uint64_t size) {
+    return fnv1a<uint32_t>(data, size, 2166136261U, 16777619U);
+  }
+
+  uint64_t FNV1a::hash64(const uint8_t *data, const uint64_t size) {
+    return fnv1a<uint64_t>(data, size, 14695981039346656037ULL, 1099511628211ULL);
+  }
+
   Counts::Counts() : all(0), symmetric180(0), symmetric90(0) {}
   Counts::Counts(uint64_t all, uint64_t symmetric180, uint64_t symmetric90) : all(all), symmetric180(symmetric180), symmetric90(symmetric90) {}
   Counts::Counts(const Counts& c) : all(c.all), symmetric180(c.symmetric180), symmetric90(c.symmetric90) {}
@@ -87,6 +118,108 @@ namespace rectilinear {
     return all == 0 && symmetric180 == 0 && symmetric90 == 0;
   }
 
+  uint32_t EncodingCounts::completions[MAX_LAYER_SIZE+1][MAX_LAYER_SIZE+2];
+
+  void EncodingCounts::init() {
+    for(int m = 0; m < MAX_LAYER_SIZE+2; m++)
+      completions[0][m] = 1;
+    for(int r = 1; r <= MAX_LAYER_SIZE; r++) {
+      // Next brick takes one of the m colors in use, or a new color:
+      for(int m = 0; m < MAX_LAYER_SIZE+1; m++)
+	completions[r][m] = m * completions[r-1][m] + completions[r-1][m+1];
+      completions[r][MAX_LAYER_SIZE+1] = 0; // Unused
+    }
+  }
+
+  int EncodingCounts::countEncodings(const uint8_t baseSize) {
+    assert(baseSize <= MAX_LAYER_SIZE);
+    if(baseSize == 0)
+      return 1;
+    return completions[baseSize-1][1]; // First brick always has color 1
+  }
+
+  int EncodingCounts::rank(const uint8_t *colors, const uint8_t baseSize) {
+    assert(baseSize <= MAX_LAYER_SIZE);
+    uint8_t blocks[MAX_LAYER_SIZE] = {0}; // 0-indexed colors in order of first appearance
+    uint8_t used = 0;
+    int ret = 0;
+    for(uint8_t i = 0; i < baseSize && i < MAX_LAYER_SIZE; i++) { // Both bounds, so the compiler can bound i
+      assert(colors[i] >= 1 && colors[i] <= i+1);
+      const uint8_t block = colors[i] == i+1 ? used : blocks[colors[i]-1];
+      blocks[i] = block;
+      ret += block * completions[baseSize-1-i][used];
+      if(block == used)
+	used++;
+    }
+    return ret;
+  }
+
+  void EncodingCounts::unrank(int rank, const uint8_t baseSize, uint8_t *colors) {
+    assert(rank >= 0 && rank < countEncodings(baseSize));
+    assert(baseSize <= MAX_LAYER_SIZE);
+    uint8_t firsts[MAX_LAYER_SIZE] = {0}; // Index of first brick of each block
+    uint8_t used = 0;
+    for(uint8_t i = 0; i < baseSize && i < MAX_LAYER_SIZE; i++) {
+      const int c = completions[baseSize-1-i][used];
+      const uint8_t block = (uint8_t)MIN(rank / c, (int)used);
+      rank -= block * c;
+      if(block == used)
+	firsts[used++] = i;
+      colors[i] = firsts[block] + 1;
+    }
+  }
+
+  EncodingCounts::EncodingCounts() : baseSize(0) {
+  }
+  EncodingCounts::EncodingCounts(const Token refinement, const uint8_t baseSize) : refinement(PackedToken::fromDecimal(refinement)), baseSize(baseSize), counts(countEncodings(baseSize)) {
+  }
+  EncodingCounts::EncodingCounts(const EncodingCounts &b) : refinement(b.refinement), baseSize(b.baseSize), counts(b.counts) {
+  }
+
+  int EncodingCounts::size() const {
+    return (int)counts.size();
+  }
+
+  Counts& EncodingCounts::operator [](const int rank) {
+    assert(rank >= 0 && rank < size());
+    return counts[rank];
+  }
+
+  const Counts& EncodingCounts::operator [](const int rank) const {
+    assert(rank >= 0 && rank < size());
+    return counts[rank];
+  }
+
+  Token EncodingCounts::getToken(const int rank) const {
+    return getPackedToken(rank).toDecimal();
+  }
+
+  PackedToken EncodingCounts::getPackedToken(const int rank) const {
+    uint8_t colors[MAX_LAYER_SIZE];
+    unrank(rank, baseSize, colors);
+    PackedToken ret = refinement;
+    for(uint8_t i = 0; i < baseSize; i++)
+      ret = ret.append(colors[i]);
+    return ret;
+  }
+
+  Counts& EncodingCounts::get(const Token token) {
+    return get(PackedToken::fromDecimal(token));
+  }
+
+  Counts& EncodingCounts::get(const PackedToken &token) {
+    uint8_t colors[MAX_LAYER_SIZE];
+    for(uint8_t i = 0; i < baseSize; i++)
+      colors[baseSize-1-i] = token.fromRight(i);
+    assert(PackedToken::fromBits(token.getBits() >> (4*baseSize)) == refinement);
+    return counts[rank(colors, baseSize)];
+  }
+
+  void EncodingCounts::add(const CountsMap &m) {
+    for(CountsMap::const_iterator it = m.begin(); it != m.end(); it++)
+      get(it->first) += it->second;
+  }
+
   Brick::Brick() : isVertical(true), x(PLANE_MID), y(PLANE_MID) {
   }
   Brick::Brick(bool iv, int16_t x, int16_t y) : isVertical(iv), x(x), y(y) {	
@@ -183,71 +316,316 @@ namespace rectilinear {
       canReach(Brick(false, a.x+MIN(2,dx)*signX, a.y+MIN(2,dy)*signY), b, toAdd-1);
   }
 
-  BrickPicker::BrickPicker(const std::vector<LayerBrick> &v,
-			   const int vIdx,
-			   const int numberOfBricksToPick): v(v), vIdx(vIdx-1), numberOfBricksToPick(numberOfBricksToPick), inner(NULL) {
+  /*
+    Intersection kernels for BrickBatch:
+    b intersects brick i if |dx| < 4-b.isVertical-isVertical_i and |dy| < 2+b.isVertical+isVertical_i
+    The vector kernels test against both orientations of brick i and use the 'vertical' bits to pick.
+    Lanes beyond 'size' are computed on whatever is in the arrays, so they are masked out.
+   */
+  static void intersectScalar(const int16_t *x, const int16_t *y, const uint64_t *vertical, const int size, const int16_t bx, const int16_t by, const bool bv, uint64_t *mask) {
+    for(int w = 0; w < (size+63)/64; w++)
+      mask[w] = 0;
+    for(int i = 0; i < size; i++) {
+      const int16_t v = (vertical[i >> 6] >> (i & 63)) & 1;
+      const int16_t dx = x[i]-bx;
+      const int16_t dy = y[i]-by;
+      if(ABS(dx) < 4-bv-v && ABS(dy) < 2+bv+v)
+	mask[i >> 6] |= ((uint64_t)1) << (i & 63);
+    }
+  }
+
+#ifdef X86_SIMD
+  __attribute__((target("sse4.1")))
+  static void intersectSSE4(const int16_t *x, const int16_t *y, const uint64_t *vertical, const int size, const int16_t bx, const int16_t by, const bool bv, uint64_t *mask) {
+    const __m128i BX = _mm_set1_epi16(bx), BY = _mm_set1_epi16(by);
+    const __m128i MXV = _mm_set1_epi16(3-bv), MYV = _mm_set1_epi16(3+bv); // Brick i vertical
+    const __m128i MXH = _mm_set1_epi16(4-bv), MYH = _mm_set1_epi16(2+bv); // Brick i horizontal
+    const int words = (size+63)/64;
+    for(int w = 0; w < words; w++)
+      mask[w] = 0;
+    for(int i = 0; i < size; i += 16) {
+      const __m128i dx0 = _mm_abs_epi16(_mm_sub_epi16(_mm_loadu_si128((const __m128i*)(x+i)), BX));
+      const __m128i dx1 = _mm_abs_epi16(_mm_sub_epi16(_mm_loadu_si128((const __m128i*)(x+i+8)), BX));
+      const __m128i dy0 = _mm_abs_epi16(_mm_sub_epi16(_mm_loadu_si128((const __m128i*)(y+i)), BY));
+      const __m128i dy1 = _mm_abs_epi16(_mm_sub_epi16(_mm_loadu_si128((const __m128i*)(y+i+8)), BY));
+      const __m128i v0 = _mm_and_si128(_mm_cmpgt_epi16(MXV, dx0), _mm_cmpgt_epi16(MYV, dy0));
+      const __m128i v1 = _mm_and_si128(_mm_cmpgt_epi16(MXV, dx1), _mm_cmpgt_epi16(MYV, dy1));
+      const __m128i h0 = _mm_and_si128(_mm_cmpgt_epi16(MXH, dx0), _mm_cmpgt_epi16(MYH, dy0));
+      const __m128i h1 = _mm_and_si128(_mm_cmpgt_epi16(MXH, dx1), _mm_cmpgt_epi16(MYH, dy1));
+      const uint32_t hitsV = (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(v0, v1));
+      const uint32_t hitsH = (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(h0, h1));
+      const uint32_t vert = (uint32_t)(vertical[i >> 6] >> (i & 63));
+      mask[i >> 6] |= ((uint64_t)(((hitsV & vert) | (hitsH & ~vert)) & 0xFFFF)) << (i & 63);
+    }
+    if((size & 63) != 0)
+      mask[words-1] &= (((uint64_t)1) << (size & 63)) - 1;
+  }
+
+  __attribute__((target("avx2")))
+  static void intersectAVX2(const int16_t *x, const int16_t *y, const uint64_t *vertical, const int size, const int16_t bx, const int16_t by, const bool bv, uint64_t *mask) {
+    const __m256i BX = _mm256_set1_epi16(bx), BY = _mm256_set1_epi16(by);
+    const __m256i MXV = _mm256_set1_epi16(3-bv), MYV = _mm256_set1_epi16(3+bv); // Brick i vertical
+    const __m256i MXH = _mm256_set1_epi16(4-bv), MYH = _mm256_set1_epi16(2+bv); // Brick i horizontal
+    const int words = (size+63)/64;
+    for(int w = 0; w < words; w++)
+      mask[w] = 0;
+    for(int i = 0; i < size; i += 32) {
+      const __m256i dx0 = _mm256_abs_epi16(_mm256_sub_epi16(_mm256_loadu_si256((const __m256i*)(x+i)), BX));
+      const __m256i dx1 = _mm256_abs_epi16(_mm256_sub_epi16(_mm256_loadu_si256((const __m256i*)(x+i+16)), BX));
+      const __m256i dy0 = _mm256_abs_epi16(_mm256_sub_epi16(_mm256_loadu_si256((const __m256i*)(y+i)), BY));
+      const __m256i dy1 = _mm256_abs_epi16(_mm256_sub_epi16(_mm256_loadu_si256((const __m256i*)(y+i+16)), BY));
+      const __m256i v0 = _mm256_and_si256(_mm256_cmpgt_epi16(MXV, dx0), _mm256_cmpgt_epi16(MYV, dy0));
+      const __m256i v1 = _mm256_and_si256(_mm256_cmpgt_epi16(MXV, dx1), _mm256_cmpgt_epi16(MYV, dy1));
+      const __m256i h0 = _mm256_and_si256(_mm256_cmpgt_epi16(MXH, dx0), _mm256_cmpgt_epi16(MYH, dy0));
+      const __m256i h1 = _mm256_and_si256(_mm256_cmpgt_epi16(MXH, dx1), _mm256_cmpgt_epi16(MYH, dy1));
+      // packs interleaves the 128 bit lanes. Permute to restore brick order:
+      const uint32_t hitsV = (uint32_t)_mm256_movemask_epi8(_mm256_permute4x64_epi64(_mm256_packs_epi16(v0, v1), 0xD8));
+      const uint32_t hitsH = (uint32_t)_mm256_movemask_epi8(_mm256_permute4x64_epi64(_mm256_packs_epi16(h0, h1), 0xD8));
+      const uint32_t vert = (uint32_t)(vertical[i >> 6] >> (i & 63));
+      mask[i >> 6] |= ((uint64_t)((hitsV & vert) | (hitsH & ~vert))) << (i & 63);
+    }
+    if((size & 63) != 0)
+      mask[words-1] &= (((uint64_t)1) << (size & 63)) - 1;
   }
+#endif
 
-  BrickPicker::~BrickPicker() {
-    if(inner != NULL) {
-      delete inner;
+  IntersectKernel BrickBatch::selectKernel() {
+#ifdef X86_SIMD
+    __builtin_cpu_init(); // Required as this is run before main()
+    if(__builtin_cpu_supports("avx2"))
+      return intersectAVX2;
+    if(__builtin_cpu_supports("sse4.1"))
+      return intersectSSE4;
+#endif
+    return intersectScalar;
+  }
+
+  IntersectKernel BrickBatch::kernel = BrickBatch::selectKernel();
+
+  const char* BrickBatch::kernelName() {
+#ifdef X86_SIMD
+    if(kernel == intersectAVX2)
+      return "AVX2";
+    if(kernel == intersectSSE4)
+      return "SSE4";
+#endif
+    return "scalar";
+  }
+
+  BrickBatch::BrickBatch() : size(0) {}
+
+  void BrickBatch::clear() {
+    size = 0;
+  }
+
+  void BrickBatch::push(const Brick &b) {
+    assert(size < BRICK_BATCH_CAPACITY);
+    x[size] = b.x;
+    y[size] = b.y;
+    const uint64_t bit = ((uint64_t)1) << (size & 63);
+    if(b.isVertical)
+      vertical[size >> 6] |= bit;
+    else
+      vertical[size >> 6] &= ~bit;
+    size++;
+  }
+
+  void BrickBatch::push(const LayerBrick &lb) {
+    push(Brick(lb.BRICK.isVertical, lb.BRICK.x, lb.BRICK.y + lb.LAYER * BATCH_LAYER_STRIDE));
+  }
+
+  void BrickBatch::pop() {
+    assert(size > 0);
+    size--;
+  }
+
+  Brick BrickBatch::get(const uint16_t i) const {
+    assert(i < size);
+    return Brick(((vertical[i >> 6] >> (i & 63)) & 1) == 1, x[i], y[i]);
+  }
+
+  uint16_t BrickBatch::words() const {
+    return (size+63)/64;
+  }
+
+  void BrickBatch::intersectMask(const Brick &b, uint64_t *mask) const {
+    kernel(x, y, vertical, size, b.x, b.y, b.isVertical, mask);
+  }
+
+  void BrickBatch::intersectMask(const LayerBrick &lb, uint64_t *mask) const {
+    kernel(x, y, vertical, size, lb.BRICK.x, lb.BRICK.y + lb.LAYER * BATCH_LAYER_STRIDE, lb.BRICK.isVertical, mask);
+  }
+
+  uint64_t BrickBatch::intersectMask(const Brick &b) const {
+    assert(size <= 64);
+    uint64_t mask = 0;
+    kernel(x, y, vertical, size, b.x, b.y, b.isVertical, &mask);
+    return mask;
+  }
+
+  uint64_t BrickBatch::intersectMask(const LayerBrick &lb) const {
+    assert(size <= 64);
+    uint64_t mask = 0;
+    kernel(x, y, vertical, size, lb.BRICK.x, lb.BRICK.y + lb.LAYER * BATCH_LAYER_STRIDE, lb.BRICK.isVertical, &mask);
+    return mask;
+  }
+
+  uint32_t BrickBatch::countBits(const uint64_t *mask, const uint32_t from, const uint32_t to) {
+    uint32_t ret = 0;
+    for(uint32_t i = from; i < to; ) {
+      const uint32_t w = i >> 6, s = i & 63;
+      const uint32_t n = MIN(64 - s, to - i); // Bits to count in word w
+      uint64_t bits = mask[w] >> s;
+      if(n < 64)
+	bits &= (((uint64_t)1) << n) - 1;
+      ret += __builtin_popcountll(bits);
+      i += n;
+    }
+    return ret;
+  }
+
+  ConflictGraph::ConflictGraph() : rows(NULL), capacity(0), size(0), words(0) {
+  }
+
+  ConflictGraph::~ConflictGraph() {
+    if(rows != NULL)
+      delete[] rows;
+  }
+
+  void ConflictGraph::build(const BrickBatch &batch) {
+    size = batch.size;
+    words = batch.words();
+    if((uint32_t)size * words > capacity) {
+      if(rows != NULL)
+	delete[] rows;
+      capacity = (uint32_t)size * words;
+      rows = new uint64_t[capacity];
+    }
+    for(uint16_t i = 0; i < size; i++)
+      batch.intersectMask(batch.get(i), &rows[i * words]);
+  }
+
+  uint64_t ConflictGraph::countIndependent(const uint32_t k) const {
+    const uint16_t start = 0, end = size;
+    return countIndependent(&start, &end, &k, 1);
+  }
+
+  uint64_t ConflictGraph::countIndependent(const uint16_t *starts, const uint16_t *ends, const uint32_t *sizes, const uint32_t numBuckets) const {
+    assert(numBuckets > 0);
+    uint64_t candidates[BRICK_BATCH_WORDS];
+    for(uint16_t w = 0; w < words; w++)
+      candidates[w] = ~(uint64_t)0;
+    return countIndependent(candidates, starts, ends, sizes, numBuckets, 0, starts[0], sizes[0]);
+  }
+
+  /*
+    Bit i of candidates is set if brick i does not intersect any brick picked so far.
+    'left' bricks remain to be picked from bucket bucketI, starting at brick idx.
+   */
+  uint64_t ConflictGraph::countIndependent(uint64_t const * const candidates, const uint16_t *starts, const uint16_t *ends, const uint32_t *sizes, const uint32_t numBuckets, uint32_t bucketI, uint32_t idx, uint32_t left) const {
+    if(left == 0) {
+      bucketI++;
+      if(bucketI == numBuckets)
+	return 1; // All picked
+      idx = starts[bucketI];
+      left = sizes[bucketI];
+    }
+    const uint32_t end = ends[bucketI];
+    if(idx + left > end)
+      return 0; // Not enough bricks left in bucket
+    if(left == 1 && bucketI+1 == numBuckets)
+      return BrickBatch::countBits(candidates, idx, end); // Last brick to pick
+
+    uint64_t ret = 0;
+    uint64_t next[BRICK_BATCH_WORDS];
+    const uint32_t last = end - left; // Last brick that leaves enough bricks in the bucket
+    for(uint32_t w = idx >> 6; w <= (last >> 6); w++) {
+      uint64_t bits = candidates[w];
+      if(w == (idx >> 6))
+	bits &= ~(uint64_t)0 << (idx & 63);
+      if(w == (last >> 6) && (last & 63) != 63)
+	bits &= (((uint64_t)1) << ((last & 63) + 1)) - 1;
+      while(bits != 0) {
+	const uint32_t i = (w << 6) + __builtin_ctzll(bits);
+	bits &= bits - 1;
+	// Pick brick i:
+	const uint64_t *row = &rows[i * words];
+	for(uint16_t w2 = w; w2 < words; w2++)
+	  next[w2] = candidates[w2] & ~row[w2];
+	ret += countIndependent(next, starts, ends, sizes, numBuckets, bucketI, i+1, left-1);
+      }
     }
+    return ret;
+  }
+
+  BrickPicker::BrickPicker(const std::vector<LayerBrick> &v,
+			   const int vIdx,
+			   const int numberOfBricksToPick): v(v), numberOfBricksToPick(numberOfBricksToPick), level(0), started(false) {
+    assert(numberOfBricksToPick >= 1 && numberOfBricksToPick <= MAX_BRICKS);
+    indices[0] = vIdx-1;
   }
 
-  bool BrickPicker::checkVIdx(const Combination &c, const Combination &maxCombination) const {
+  bool BrickPicker::checkVIdx(const int vIdx, const Combination &c, const Combination &maxCombination) const {
     // Check for collisions against placed bricks:
+    PROFILE_COUNT(c.size, pickerChecks, 1);
     uint8_t layer = v[vIdx].LAYER;
     assert(layer <= c.height);
     if(c.height == layer)
       return true; // Placed on top!
-    if(c.layerSizes[layer] == maxCombination.layerSizes[layer])
+    if(c.layerSizes[layer] == maxCombination.layerSizes[layer]) {
+      PROFILE_COUNT(c.size, rejectsFullLayer, 1);
       return false;
+    }
+    // Pairwise tests: A BrickBatch of the placed bricks is slower for the few bricks of a layer
     for(uint8_t i = 0; i < c.layerSizes[layer]; i++) {
-      if(c.bricks[layer][i].intersects(v[vIdx].BRICK))
+      if(c.bricks[layer][i].intersects(v[vIdx].BRICK)) {
+	PROFILE_COUNT(c.size, rejectsIntersection, 1);
 	return false;
+      }
     }
     return true;
   }
 
-  void BrickPicker::nextVIdx(const Combination &c, const Combination &maxCombination) {
-    do {
-      vIdx++;
-      if(vIdx >= (int)v.size())
-	return; // Out of bounds!
-    }
-    while(!checkVIdx(c, maxCombination));
-  }
-
+  /*
+    Adds the next pick to c. The caller removes the picked bricks before calling again.
+   */
   bool BrickPicker::next(Combination &c, const Combination &maxCombination) {
-    if(numberOfBricksToPick == 1) {
-      nextVIdx(c, maxCombination);
-      bool ok = vIdx < (int)v.size();
-      if(ok)
-	c.addBrick(v[vIdx]);
-      return ok;
-    }
-
-    // More than one brick to pick:
-    if(inner != NULL) {
-      c.addBrick(v[vIdx]);
-      if(inner->next(c, maxCombination))
-	return true; // inner placed remaining bricks
-      c.removeLastBrick(); // Could not complete
-      delete inner;
-      inner = NULL;
-    }
-
+    if(level < 0)
+      return false; // Done
+    const int last = numberOfBricksToPick-1;
+    if(started) {
+      // Restore the bricks below the last level and advance the last level:
+      for(int i = 0; i < last; i++)
+	c.addBrick(v[indices[i]]);
+      level = last;
+    }
+    started = true;
+
+    const int sizeV = (int)v.size();
     while(true) {
-      nextVIdx(c, maxCombination);
-      if(vIdx + numberOfBricksToPick - 1 >= (int)v.size())
-	return false;
-      c.addBrick(v[vIdx]);
-      inner = new BrickPicker(v, vIdx+1, numberOfBricksToPick-1);
-      if(inner->next(c, maxCombination))
-	return true;
-      c.removeLastBrick(); // Could not complete
-      delete inner;
-      inner = NULL;
+      // Advance the index at current level to the next brick that can be placed:
+      const int end = sizeV - (last - level); // Leave room for the bricks of the following levels
+      int &vIdx = indices[level];
+      do {
+	vIdx++;
+      }
+      while(vIdx < end && !checkVIdx(vIdx, c, maxCombination));
+
+      if(vIdx < end) {
+	c.addBrick(v[vIdx]);
+	if(level == last)
+	  return true;
+	level++;
+	indices[level] = vIdx;
+      }
+      else {
+	if(level == 0) {
+	  level = -1;
+	  return false; // All picks have been returned
+	}
+	level--;
+	c.removeLastBrick(); // Could not complete
+      }
     }
   }
 
@@ -256,13 +634,8 @@ namespace rectilinear {
     inner = new BrickPicker(v, 0, 1);
   }
 
-  NormalBuildingManager::NormalBuildingManager(const std::vector<LayerBrick> &v, const int maxPick) : v(v), maxPick(maxPick), toPick(1), sum(Counts()) {
-    assert(maxPick >= 1);
-    inner = new BrickPicker(v, 0, 1);
-  }
-
   uint8_t BaseBuildingManager::next(Combination &c, const Combination &maxCombination) {
-    std::lock_guard<std::mutex> guard(mutex);
+    TimedLock guard(mutex);
     if(inner == NULL)
       return 0; // Done. This is here in case multiple threads call next()
 
@@ -279,73 +652,47 @@ namespace rectilinear {
 	continue;
       }
 
-      Combination c2(c);
-      c2.normalize();
+      normalized.copy(c);
+      normalized.normalize();
 
-      if(countsMap.find(c2) != countsMap.end()) {
-	combinations.push_back(c2);
+      if(countsMap.find(normalized) != countsMap.end()) {
+	combinations.push_back(normalized);
 	for(uint8_t i = 0; i < toPick; i++)
 	  c.removeLastBrick();
 	continue;
       }
 
       // Check mirrored:
-      Combination mx(c2);
-      mx.mirrorX();
-      if(countsMap.find(mx) != countsMap.end()) {
-	combinations.push_back(mx);
+      mirrored.copy(normalized);
+      mirrored.mirrorX();
+      if(countsMap.find(mirrored) != countsMap.end()) {
+	combinations.push_back(mirrored);
 	for(uint8_t i = 0; i < toPick; i++)
 	  c.removeLastBrick();
 	continue; // Point to mirrored. Next!
       }
-      Combination my(c2);
-      my.mirrorY();
-      if(countsMap.find(my) != countsMap.end()) {
-	combinations.push_back(my);
+      mirrored.copy(normalized);
+      mirrored.mirrorY();
+      if(countsMap.find(mirrored) != countsMap.end()) {
+	combinations.push_back(mirrored);
 	for(uint8_t i = 0; i < toPick; i++)
 	  c.removeLastBrick();
 	continue; // Point to mirrored. Next!
       }
 
-      combinations.push_back(c2);
-      countsMap[c2] = Counts(); // Ensure checks for existing combination succeed even before fully computed
-      return toPick;
-    }
-  }
-
-  uint8_t NormalBuildingManager::next(Combination &c, const Combination &maxCombination) {
-    std::lock_guard<std::mutex> guard(mutex);
-    if(inner == NULL)
-      return 0; // Done. This is here in case multiple threads call next()
-
-    bool ret;
-    while(true) {
-      ret = inner->next(c, maxCombination);
-      if(!ret) {
-	delete inner;
-	if(toPick == maxPick) { // Done!
-	  inner = NULL;
-	  return 0; // Done
-	}
-	inner = new BrickPicker(v, 0, ++toPick);
-	continue;
-      }
+      combinations.push_back(normalized);
+      countsMap[normalized] = Counts(); // Ensure checks for existing combination succeed even before fully computed
       return toPick;
     }
   }
 
   void BaseBuildingManager::add(const Combination &c, const Counts &counts) {
-    std::lock_guard<std::mutex> guard(mutex);
+    TimedLock guard(mutex);
     Combination c2(c);
     c2.normalize();
     countsMap[c2] = counts;
   }
 
-  void NormalBuildingManager::add(const Counts &counts) {
-    std::lock_guard<std::mutex> guard(mutex);
-    sum += counts;
-  }
-
   Counts BaseBuildingManager::getCounts() const {
     Counts ret;
     for(std::vector<Combination>::const_iterator it = combinations.begin(); it != combinations.end(); it++) {
@@ -356,57 +703,221 @@ namespace rectilinear {
     return ret;
   }
 
-  Counts NormalBuildingManager::getCounts() const {
-    return sum;
+  int BaseBuildingManager::getMultiplicity(const Combination &c) const {
+    Combination c2(c);
+    c2.normalize();
+    int ret = 0;
+    for(std::vector<Combination>::const_iterator it = combinations.begin(); it != combinations.end(); it++) {
+      if(!(*it < c2) && !(c2 < *it)) // Same order as countsMap. Combination::operator== requires equal layer sizes
+	ret++;
+    }
+    return ret;
   }
 
+  const BrickStencil BrickPlane::crossing = {-2, -2, 5, 5};
+  const BrickStencil BrickPlane::parallel[2] = {{-3, -1, 7, 3}, {-1, -3, 3, 7}};
+
   void BrickPlane::reset() {
     for(int i = 0; i < 2; i++)
       for(int j = 0; j < PLANE_WIDTH; j++)
-	for(int k = 0; k < PLANE_WIDTH; k++)
-	  bricks[i][j][k] = 0;
-#ifdef DEBUG
-    sum = 0;
-#endif
+	for(int k = 0; k < PLANE_WORDS; k++)
+	  rows[i][j][k] = 0;
+    logSize = 0;
+    frameCount = 0;
+  }
+
+  uint64_t BrickPlane::window(const bool v, const int16_t x, const int16_t y) const {
+    assert(x >= 0 && x < PLANE_WIDTH);
+    assert(y >= 0 && y < PLANE_WIDTH);
+    const uint64_t *row = rows[v][x];
+    const int w = y >> 6, s = y & 63;
+    if(s == 0)
+      return row[w];
+    return (row[w] >> s) | (row[w+1] << (64-s));
+  }
+
+  void BrickPlane::setWindow(const bool v, const int16_t x, const int16_t y, const uint64_t bits) {
+    uint64_t *row = rows[v][x];
+    const int w = y >> 6, s = y & 63;
+    row[w] |= bits << s;
+    if(s != 0)
+      row[w+1] |= bits >> (64-s);
+  }
+
+  void BrickPlane::unsetWindow(const bool v, const int16_t x, const int16_t y, const uint64_t bits) {
+    uint64_t *row = rows[v][x];
+    const int w = y >> 6, s = y & 63;
+    row[w] &= ~(bits << s);
+    if(s != 0)
+      row[w+1] &= ~(bits >> (64-s));
   }
 
   void BrickPlane::set(const bool v, const int16_t x, const int16_t y) {
-    assert(!bricks[v][x][y]);
-    bricks[v][x][y]++;
-#ifdef DEBUG
-    sum++;
-#endif
+    assert(!contains(v, x, y));
+    setWindow(v, x, y, 1);
   }
 
   void BrickPlane::unset(const bool v, const int16_t x, const int16_t y) {
-    assert(bricks[v][x][y]);
-    bricks[v][x][y]--;
-#ifdef DEBUG
-    sum--;
-#endif
+    assert(contains(v, x, y));
+    unsetWindow(v, x, y, 1);
   }
 
-  void BrickPlane::set(const bool v, const int16_t x, const int16_t y, const int8_t add) {
-    // No assertions, as findPotentialBricks(...) can mark overlapping intersecting bricks
-    bricks[v][x][y] += add;
+  void BrickPlane::unset(const Brick &b) {
+    unset(b.isVertical, b.x, b.y);
   }
 
-  void BrickPlane::unset(const Brick &b) {
-    assert(bricks[b.isVertical][b.x][b.y] > 0);
-    bricks[b.isVertical][b.x][b.y]--;
-#ifdef DEBUG
-    sum--;
-#endif
+  bool BrickPlane::contains(const bool v, const int16_t x, const int16_t y) const {
+    return (window(v, x, y) & 1) != 0;
+  }
+
+  void BrickPlane::pushFrame() {
+    assert(frameCount <= MAX_LAYER_SIZE);
+    frames[frameCount++] = logSize;
+  }
+
+  void BrickPlane::popFrame() {
+    assert(frameCount > 0);
+    const uint16_t frameStart = frames[--frameCount];
+    while(logSize > frameStart) {
+      const Blocked &e = log[--logSize];
+      unsetWindow(e.v, e.x, e.y, e.bits);
+    }
+  }
+
+  void BrickPlane::block(const bool v, const Brick &b, const BrickStencil &s) {
+    const uint64_t mask = (((uint64_t)1) << s.bits) - 1;
+    const int16_t y = b.y + s.dy;
+    for(uint8_t r = 0; r < s.rows; r++) {
+      const int16_t x = b.x + s.dx + r;
+      const uint64_t bits = mask & ~window(v, x, y); // Only log what this brick blocks
+      if(bits == 0)
+	continue;
+      setWindow(v, x, y, bits);
+      assert(logSize < MAX_LAYER_SIZE * STENCIL_ROWS);
+      Blocked &e = log[logSize++];
+      e.v = v;
+      e.x = x;
+      e.y = y;
+      e.bits = bits;
+    }
   }
 
-  bool BrickPlane::contains(const bool v, const int16_t x, const int16_t y) {
-    return bricks[v][x][y] > 0;
+  void BrickPlane::addStencil(const Brick &b) {
+    assert(frameCount > 0);
+    block(!b.isVertical, b, crossing);
+    block(b.isVertical, b, parallel[b.isVertical]);
+  }
+
+  void BrickPlane::claim(const bool v, const Brick &b, const BrickStencil &s, BrickPlane const * const below, BrickPlane const * const above, uint64_t *free) {
+    const uint64_t mask = (((uint64_t)1) << s.bits) - 1;
+    const int16_t y = b.y + s.dy;
+    for(uint8_t r = 0; r < s.rows; r++) {
+      const int16_t x = b.x + s.dx + r;
+      uint64_t blocked = window(v, x, y);
+      if(below != NULL)
+	blocked |= below->window(v, x, y);
+      if(above != NULL)
+	blocked |= above->window(v, x, y);
+      free[r] = mask & ~blocked;
+      if(free[r] != 0)
+	setWindow(v, x, y, free[r]); // Duplicate check for remaining bricks of wave
+    }
+  }
+
+  /*
+    Wave bricks block the bricks intersecting them in their own layer.
+    Each layer touched by the wave gets its own frame, so add=-1 undoes add=1.
+   */
+  void BrickPlane::addWave(BrickPlane *neighbours, const Combination &c, const uint8_t waveStart, const uint8_t waveSize, const int8_t add) {
+    bool touched[MAX_HEIGHT];
+    for(uint8_t i = 0; i < MAX_HEIGHT; i++)
+      touched[i] = false;
+    for(uint8_t i = 0; i < waveSize; i++) {
+      const BrickIdentifier &bi = c.history[waveStart+i];
+      const uint8_t layer = bi.first;
+      if(!touched[layer]) {
+	touched[layer] = true;
+	if(add > 0)
+	  neighbours[layer].pushFrame();
+	else
+	  neighbours[layer].popFrame();
+      }
+      if(add > 0)
+	neighbours[layer].addStencil(c.bricks[layer][bi.second]);
+    }
+  }
+
+  /*
+    Find all potential neighbours above and below all in wave.
+    Candidates are listed in the same order as when checked position by position:
+    Crossing bricks by x, then y. Parallel bricks by y, then x.
+   */
+  void BrickPlane::findPotentialBricks(BrickPlane *neighbours, const Combination &c, const uint8_t waveStart, const uint8_t waveSize, const Combination &maxCombination, std::vector<LayerBrick> &v) {
+    uint64_t free[STENCIL_ROWS];
+    for(uint8_t i = 0; i < waveSize; i++) {
+      const BrickIdentifier &bi = c.history[waveStart+i];
+      const int8_t waveBrickLayer = bi.first; // Convert to signed
+      const Brick &brick = c.bricks[waveBrickLayer][bi.second];
+
+      for(int8_t layer2 = waveBrickLayer-1; layer2 <= waveBrickLayer+1; layer2+=2) {
+	if(layer2 < 0)
+	  continue; // Do not allow building below base layer
+	if(layer2 >= maxCombination.height)
+	  continue; // Out of range
+	if(layer2 < c.height && c.layerSizes[layer2] == maxCombination.layerSizes[layer2])
+	  continue; // Already at maximum allowed for layer
+
+	BrickPlane const * const below = layer2 == 0 ? NULL : &neighbours[layer2-1];
+	BrickPlane const * const above = layer2+1 >= c.height ? NULL : &neighbours[layer2+1];
+
+	// Add crossing bricks (one vertical, one horizontal):
+	const bool cv = !brick.isVertical;
+	neighbours[layer2].claim(cv, brick, crossing, below, above, free);
+	for(uint8_t r = 0; r < crossing.rows; r++) {
+	  const int16_t xx = brick.x + crossing.dx + r;
+	  for(uint64_t bits = free[r]; bits != 0; bits &= bits-1) {
+	    const int16_t yy = brick.y + crossing.dy + __builtin_ctzll(bits);
+	    v.push_back(LayerBrick(Brick(cv, xx, yy), layer2));
+	  }
+	}
+
+	// Add parallel bricks:
+	const BrickStencil &s = parallel[brick.isVertical];
+	neighbours[layer2].claim(brick.isVertical, brick, s, below, above, free);
+	for(uint8_t y = 0; y < s.bits; y++) {
+	  const int16_t yy = brick.y + s.dy + y;
+	  for(uint8_t r = 0; r < s.rows; r++) {
+	    if(((free[r] >> y) & 1) != 0)
+	      v.push_back(LayerBrick(Brick(brick.isVertical, brick.x + s.dx + r, yy), layer2));
+	  }
+	}
+      } // for layer2
+    }
+
+    // Cleanup, so that neighbours can be shared by all:
+    for(std::vector<LayerBrick>::const_iterator it = v.begin(); it != v.end(); it++) {
+      neighbours[it->LAYER].unset(it->BRICK);
+#ifdef DEBUG
+      // Verify that bricks from previous waves are not reached:
+      for(uint8_t i = 0; i < waveStart; i++) {
+	uint8_t layer = c.history[i].first;
+	const Brick &b = c.bricks[layer][c.history[i].second];
+	if(ABS(it->LAYER-layer) <= 1) {
+	  if(b.intersects(it->BRICK)) {
+	    std::cerr << "Brick intersection:" << std::endl << " New brick " << it->BRICK << " on layer " << (int)it->LAYER << std::endl << " Existing brick: " << b << " on layer " << (int)layer << std::endl << "Combination: " << c << std::endl;
+	    assert(false);
+	  }
+	}
+      }
+#endif
+    }
   }
 
   Combination::Combination() : height(1), size(1) {
     bricks[0][0] = FirstBrick;
     layerSizes[0] = 1;
     history[0] = BrickIdentifier(0,0);
+    resetConnectivity();
   }
   Combination::Combination(int token) : height(heightOfToken(token)), size(0) {
     if(height > MAX_HEIGHT) {
@@ -428,6 +939,7 @@ namespace rectilinear {
 	}
       }
     }
+    resetConnectivity();
   }
   Combination::Combination(const Combination &b) {
     copy(b);
@@ -438,6 +950,7 @@ namespace rectilinear {
       bricks[0][i] = b.bricks[i];
       history[i] = BrickIdentifier(0, i);
     }
+    resetConnectivity();
   }
 
   Base::Base() : layerSize(1) {
@@ -574,8 +1087,20 @@ namespace rectilinear {
       for(uint8_t j = 0; j < layerSizes[i]; j++)
 	bricks[i][j] = b.bricks[i][j];
     }
-    for(uint8_t i = 0; i < size; i++)
+    for(uint8_t i = 0; i < size; i++) {
       history[i] = b.history[i];
+      const BrickIdentifier &bi = history[i];
+      ids[bi.first][bi.second] = i;
+    }
+    connectedSize = b.connectedSize;
+    for(uint8_t i = 0; i < connectedSize; i++) {
+      parents[i] = b.parents[i];
+      componentSizes[i] = b.componentSizes[i];
+      unionCounts[i] = b.unionCounts[i];
+    }
+    unionLogSize = b.unionLogSize;
+    for(uint8_t i = 0; i < unionLogSize; i++)
+      unionLog[i] = b.unionLog[i];
   }
 
   void Base::copy(const Base &b) {
@@ -595,6 +1120,7 @@ namespace rectilinear {
       if(layerSize > 1)
 	std::sort(bricks[layer], &bricks[layer][layerSize]);
     }
+    resetConnectivity();
   }
   void Base::sortBricks() {
     std::sort(bricks, &bricks[layerSize]);
@@ -973,8 +1499,9 @@ namespace rectilinear {
       layerSizes[layer] = 0;
     }
     const int8_t layerSize = layerSizes[layer];
-    history[size++] = BrickIdentifier(layer, layerSize);
+    history[size] = BrickIdentifier(layer, layerSize);
     bricks[layer][layerSize] = b;
+    ids[layer][layerSize] = size++;
     layerSizes[layer]++;
   }
 
@@ -986,109 +1513,133 @@ namespace rectilinear {
     size--;
     const uint8_t layer = history[size].first;
 
+    if(size < connectedSize) {
+      // Undo unions in reverse order:
+      for(uint8_t i = 0; i < unionCounts[size]; i++) {
+	const uint8_t child = unionLog[--unionLogSize];
+	componentSizes[parents[child]] -= componentSizes[child];
+	parents[child] = child;
+      }
+      connectedSize = size;
+    }
+
     layerSizes[layer]--;
     if(layerSizes[layer] == 0)
       height--;
   }
 
-  void Combination::colorConnected(uint8_t layer, uint8_t idx, uint8_t color) {
-    assert(layer < height);
-    assert(idx < layerSizes[layer]);
-    assert(color > 0);
-    colors[layer][idx] = color;
-    const Brick &b = bricks[layer][idx];
-    // Color layers below and above:
-    if(layer > 0) {
-      const uint8_t layer2 = layer-1;
+  uint8_t Combination::findComponent(uint8_t id) const {
+    while(parents[id] != id)
+      id = parents[id];
+    return id;
+  }
+
+  void Combination::connect(const uint8_t id) {
+    const uint8_t layer = history[id].first;
+    const Brick &b = bricks[layer][history[id].second];
+    parents[id] = id;
+    componentSizes[id] = 1;
+    unionCounts[id] = 0;
+    // Unite with bricks in layers below and above which have been added before this.
+    // Pairwise tests, as in BrickPicker::checkVIdx():
+    for(int8_t layer2 = -1+(int8_t)layer; layer2 <= layer+1; layer2 += 2) {
+      if(layer2 < 0 || layer2 >= height)
+	continue;
       const uint8_t s = layerSizes[layer2];
       for(uint8_t i = 0; i < s; i++) {
-	if(colors[layer2][i] == 0 && b.intersects(bricks[layer2][i]))
-	  colorConnected(layer2, i, color);
-      }
-    }
-    if(layer < height-1) {
-      const int8_t layer2 = layer+1;
-      const uint8_t s = layerSizes[layer2];
-      for(uint8_t i = 0; i < s; i++) {
-	if(colors[layer2][i] == 0 && b.intersects(bricks[layer2][i]))
-	  colorConnected(layer2, i, color);
+	const uint8_t id2 = ids[layer2][i];
+	if(id2 >= id || !b.intersects(bricks[layer2][i]))
+	  continue;
+	uint8_t root = findComponent(id), root2 = findComponent(id2);
+	if(root == root2)
+	  continue;
+	if(componentSizes[root] < componentSizes[root2])
+	  std::swap(root, root2);
+	parents[root2] = root;
+	componentSizes[root] += componentSizes[root2];
+	unionLog[unionLogSize++] = root2;
+	unionCounts[id]++;
       }
     }
   }
 
-  uint8_t Combination::countConnected(uint8_t layer, uint8_t idx) {
-    assert(layer < height);
-    assert(idx < layerSizes[layer]);
-    if(colors[layer][idx] != 0)
-      return 0; // Already counted
-    colors[layer][idx] = 1;
-    uint8_t ret = 1;
-    const Brick &b = bricks[layer][idx];
-    // Add for layers below and above:
-    for(int8_t layer2 = -1+(int8_t)layer; layer2 <= layer+1; layer2 += 2) {
-      if(layer2 < 0 || layer2 >= height)
-	continue;
+  void Combination::connectAll() {
+    while(connectedSize < size)
+      connect(connectedSize++);
+  }
 
-      uint8_t s = layerSizes[layer2];
-      for(uint8_t i = 0; i < s; i++) {
-	if(colors[layer2][i] != 0)
-	  continue; // Already counted
-	const Brick &b2 = bricks[layer2][i];
-	if(b.intersects(b2))
-	  ret += countConnected(layer2, i);
-      }
-    }
-    return ret;
+  void Combination::resetConnectivity() {
+    unionLogSize = 0;
+    connectedSize = 0;
+    for(uint8_t i = 0; i < size; i++)
+      ids[history[i].first][history[i].second] = i;
   }
 
   bool Combination::isConnected() {
-    // Reset state:
-    for(uint8_t i = 0; i < height; i++) {
-      uint8_t s = layerSizes[i];
-      for(uint8_t j = 0; j < s; j++)
-	colors[i][j] = 0;
-    }
-    // Count:
-    return size == countConnected(0, 0);
+    connectAll();
+    return componentSizes[findComponent(0)] == size;
   }
 
   void Combination::colorFull() {
-    // Reset colors (state):
+    // Each component touching the base is colored by 1 + index of its first base brick:
+    connectAll();
+    uint8_t roots[MAX_LAYER_SIZE];
+    const uint8_t s0 = layerSizes[0];
+    for(uint8_t i = 0; i < s0; i++)
+      roots[i] = findComponent(ids[0][i]);
     for(uint8_t i = 0; i < height; i++) {
       uint8_t s = layerSizes[i];
-      for(uint8_t j = 0; j < s; j++)
+      for(uint8_t j = 0; j < s; j++) {
+	const uint8_t root = findComponent(ids[i][j]);
 	colors[i][j] = 0;
+	for(uint8_t k = 0; k < s0; k++) {
+	  if(roots[k] == root) {
+	    colors[i][j] = k+1;
+	    break;
+	  }
+	}
+      }
     }
-    for(uint8_t i = 0; i < layerSizes[0]; i++) {
-      if(colors[0][i] == 0) // Check here in case another connected to base brick
-	colorConnected(0, i, i+1);
+  }
+
+  void Combination::colorBase() {
+    // Color base bricks by 1 + index of first base brick in same component:
+    connectAll();
+    uint8_t roots[MAX_LAYER_SIZE];
+    const uint8_t s0 = layerSizes[0];
+    for(uint8_t i = 0; i < s0; i++) {
+      roots[i] = findComponent(ids[0][i]);
+      colors[0][i] = i+1;
+      for(uint8_t k = 0; k < i; k++) {
+	if(roots[k] == roots[i]) {
+	  colors[0][i] = k+1;
+	  break;
+	}
+      }
     }
   }
 
+  uint8_t Combination::sizeOfBase() const {
+    uint8_t ret = 0;
+    while(ret < size && history[ret].first == 0)
+      ret++;
+    return ret;
+  }
+
   Token Combination::encodeConnectivity(Token baseToken) {
     assert(layerSizes[0] >= 2);
-
-    // Reset colors (state):
-    for(uint8_t i = 0; i < height; i++) {
-      uint8_t s = layerSizes[i];
-      for(uint8_t j = 0; j < s; j++)
-	colors[i][j] = 0;
-    }
-
-    // Run DFS:
-    uint8_t s0 = layerSizes[0];
-    for(uint8_t i = 0; i < s0-1; i++) {
-      if(colors[0][i] == 0) // Check here in case another connected to base brick
-	colorConnected(0, i, i+1);
-    }
-    if(colors[0][s0-1] == 0)
-      colors[0][s0-1] = s0; // No need to run DFS on last, as it should have been hit if connected
+    colorBase();
 
     // Encode:
     for(uint8_t i = 0; history[i].first == 0; i++)
       baseToken = 10 * baseToken + colors[0][i];
     return baseToken;
   }
+
+  int Combination::rankConnectivity() {
+    colorBase();
+    return EncodingCounts::rank(colors[0], sizeOfBase());
+  }
   
   Token Combination::getTokenFromLayerSizes() const {
     Token ret = 0;
@@ -1199,44 +1750,28 @@ namespace rectilinear {
     }
   }
 
+  static_assert(PackedToken::fromDecimal(2213).reverse().toDecimal() == 3122, "PackedToken::reverse()");
+  static_assert(PackedToken::fromDecimal(22).concat(PackedToken::fromDecimal(113)).toDecimal() == 22113, "PackedToken::concat()");
+  static_assert(PackedToken::fromDecimal(2213).length() == 4 && PackedToken::fromDecimal(2213).sum() == 8, "PackedToken::length() and sum()");
+
   Token Combination::reverseToken(Token token) {
-    Token ret = 0;
-    while(token > 0) {
-      ret = (ret * 10) + (token % 10);
-      token /= 10;
-    }
-    return ret;
+    return PackedToken::fromDecimal(token).reverse().toDecimal();
   }
 
   uint8_t Combination::heightOfToken(Token token) {
-    uint8_t ret = 0;
-    while(token > 0) {
-      ret++;
-      token = token/10;
-    }
-    return ret;
+    return PackedToken::fromDecimal(token).length();
   }
 
   uint8_t Combination::sizeOfToken(Token token) {
-    uint8_t ret = 0;
-    while(token > 0) {
-      ret += token % 10;
-      token = token/10;
-    }
-    return ret;
+    return PackedToken::fromDecimal(token).sum();
   }
 
   void Combination::getLayerSizesFromToken(Token token, uint8_t *layerSizes) {
-    uint8_t layers = 0;
-    while(token > 0) {
-      uint8_t size_add = token % 10;
-      layerSizes[layers++] = size_add;
-      token /= 10;
-    }
-    // Flip the layer sizes:
-    for(uint8_t i = 0; i < layers/2; i++) {
-      std::swap(layerSizes[i], layerSizes[layers-i-1]);
-    }
+    const PackedToken packed = PackedToken::fromDecimal(token);
+    const uint8_t layers = packed.length();
+    assert(layers <= MAX_HEIGHT); // layerSizes holds MAX_HEIGHT layers
+    for(uint8_t i = 0; i < layers && i < MAX_HEIGHT; i++)
+      layerSizes[i] = packed.fromRight(layers-1-i);
   }
 
   int Combination::countBricksToBridge(const Combination &maxCombination) {
@@ -1483,9 +2018,11 @@ namespace rectilinear {
     baseCombination(c),
     waveStart(waveStart),
     waveSize(waveSize),
+    depth(0),
     neighbours(neighbours),
     maxCombination(maxCombination),
-    encodingLocked(encodingLocked) {
+    encodingLocked(encodingLocked),
+    counts(maxCombination.getTokenFromLayerSizes(), c.sizeOfBase()) {
     assert(c.layerSizes[0] >= 1);
     assert(c.bricks[0][0] == FirstBrick);
   }
@@ -1494,8 +2031,26 @@ namespace rectilinear {
     baseCombination(c),
     waveStart(waveStart),
     waveSize(waveSize),
+    depth(0),
+    neighbours(neighbours),
+    maxCombination(maxCombination),
+    worker(NULL),
+    slot(0),
+    unit(NULL) {
+    assert(c.layerSizes[0] >= 1);
+    assert(c.bricks[0][0] == FirstBrick);
+  }
+
+  NonEncodingCombinationBuilder::NonEncodingCombinationBuilder(const Combination &c, const uint8_t waveStart, const uint8_t waveSize, BrickPlane *neighbours, Combination const * maxCombination, SplitWorker *worker, const int slot, SplitUnit *unit) :
+    baseCombination(c),
+    waveStart(waveStart),
+    waveSize(waveSize),
+    depth(0),
     neighbours(neighbours),
-    maxCombination(maxCombination) {
+    maxCombination(maxCombination),
+    worker(worker),
+    slot(slot),
+    unit(unit) {
     assert(c.layerSizes[0] >= 1);
     assert(c.bricks[0][0] == FirstBrick);
   }
@@ -1506,126 +2061,68 @@ namespace rectilinear {
     baseCombination(c),
     waveStart(0),
     waveSize(c.layerSize),
+    depth(0),
     neighbours(neighbours),
     maxCombination(maxCombination),
-    encodingLocked(false) {
+    encodingLocked(false),
+    counts(maxCombination.getTokenFromLayerSizes(), c.layerSize) {
   }
 
   CombinationBuilder::CombinationBuilder(const CombinationBuilder& b) :
     baseCombination(b.baseCombination),
     waveStart(b.waveStart),
     waveSize(b.waveSize),
+    depth(0),
     neighbours(b.neighbours),
     maxCombination(b.maxCombination),
-    encodingLocked(b.encodingLocked) {
+    encodingLocked(b.encodingLocked),
+    graph(), // Scratch space is not shared
+    counts(b.counts) {
   }
 
   NonEncodingCombinationBuilder::NonEncodingCombinationBuilder(const NonEncodingCombinationBuilder& b) :
     baseCombination(b.baseCombination),
     waveStart(b.waveStart),
     waveSize(b.waveSize),
+    depth(0),
     neighbours(b.neighbours),
-    maxCombination(b.maxCombination) {
+    maxCombination(b.maxCombination),
+    graph(), // Scratch space is not shared
+    worker(b.worker),
+    slot(b.slot),
+    unit(b.unit) {
   }
 
   NonEncodingCombinationBuilder::NonEncodingCombinationBuilder() : waveStart(0),
 								   waveSize(0),
-								   neighbours(NULL), maxCombination(NULL) {}
+								   depth(0),
+								   neighbours(NULL), maxCombination(NULL), worker(NULL), slot(0), unit(NULL) {}
 
   void CombinationBuilder::addWaveToNeighbours(int8_t add) {
-    for(uint8_t i = 0; i < waveSize; i++) {
-      const BrickIdentifier &bi = baseCombination.history[waveStart+i];
-      const int8_t layer = bi.first; // Convert to signed
-      const Brick &brick = baseCombination.bricks[layer][bi.second];
-
-      // Add crossing bricks (one vertical, one horizontal):
-      for(int16_t x = -2; x <= 2; x++) {
-	int16_t xx = brick.x+x;
-	for(int16_t y = -2; y <= 2; y++)
-	  neighbours[layer].set(!brick.isVertical, xx, brick.y+y, add);
-      }
-
-      // Add parallel bricks:
-      int16_t w = 4, h = 2;
-      if(brick.isVertical) {
-	w = 2;
-	h = 4;
-      }
-      for(int16_t y = -h+1; y < h; y++) {
-	int16_t yy = brick.y+y;
-	for(int16_t x = -w+1; x < w; x++)
-	  neighbours[layer].set(brick.isVertical, brick.x+x, yy, add);
-      }
-    }
+    BrickPlane::addWave(neighbours, baseCombination, waveStart, waveSize, add);
   }
 
   void CombinationBuilder::findPotentialBricksForNextWave(std::vector<LayerBrick> &v) {
-    // Find all potential neighbours above and below all in wave:
-    for(uint8_t i = 0; i < waveSize; i++) {
-      const BrickIdentifier &bi = baseCombination.history[waveStart+i];
-      const int8_t waveBrickLayer = bi.first; // Convert to signed
-      const Brick &brick = baseCombination.bricks[waveBrickLayer][bi.second];
-
-      for(int8_t layer2 = waveBrickLayer-1; layer2 <= waveBrickLayer+1; layer2+=2) {
-	if(layer2 < 0)
-	  continue; // Do not allow building below base layer
-	if(layer2 >= maxCombination.height)
-	  continue; // Out of range
-	if(layer2 < baseCombination.height && baseCombination.layerSizes[layer2] == maxCombination.layerSizes[layer2])
-	  continue; // Already at maximum allowed for layer
-
-	// Add crossing bricks (one vertical, one horizontal):
-	for(int16_t x = -2; x < 3; x++) {
-	  int16_t xx = brick.x+x;
-	  for(int16_t y = -2; y < 3; y++) {
-	    int16_t yy = brick.y+y;
-	    if(!neighbours[layer2].contains(!brick.isVertical, xx, yy) &&
-	       (layer2 == 0 || !neighbours[layer2-1].contains(!brick.isVertical, xx, yy)) &&
-	       (layer2+1 >= baseCombination.height || !neighbours[layer2+1].contains(!brick.isVertical, xx, yy))) {
-	      neighbours[layer2].set(!brick.isVertical, xx, yy);
-	      v.push_back(LayerBrick(Brick(!brick.isVertical, xx, yy), layer2));
-	    }
-	  }
-	}
+    BrickPlane::findPotentialBricks(neighbours, baseCombination, waveStart, waveSize, maxCombination, v);
+  }
 
-	// Add parallel bricks:
-	int16_t w = 4, h = 2;
-	if(brick.isVertical) {
-	  w = 2;
-	  h = 4;
-	}
-	for(int16_t y = -h+1; y < h; y++) {
-	  int16_t yy = brick.y+y;
-	  for(int16_t x = -w+1; x < w; x++) {
-	    int16_t xx = brick.x+x;
-	    if(!neighbours[layer2].contains(brick.isVertical, xx, yy) &&
-	       (layer2 == 0 || !neighbours[layer2-1].contains(brick.isVertical, xx, yy)) &&
-	       (layer2+1 >= baseCombination.height || !neighbours[layer2+1].contains(brick.isVertical, xx, yy))) {
-	      neighbours[layer2].set(brick.isVertical, xx, yy);
-	      v.push_back(LayerBrick(Brick(brick.isVertical, xx, yy), layer2));
-	    }
-	  }
-	}
-      } // for layer2
-    }
+  CombinationBuilder::WaveState CombinationBuilder::pushWave(const uint8_t toPick) {
+    WaveState s = {waveStart, waveSize, encodingLocked};
+    // Encoding can only take on a single value if bricks being picked belong to same base bricks.
+    // TODO: Improve this by checking the encoding
+    encodingLocked = encodingLocked || toPick == 1;
+    waveStart += waveSize;
+    waveSize = toPick;
+    depth++;
+    assert(depth < MAX_BRICKS);
+    return s;
+  }
 
-    // Cleanup, so that neighbours can be shared by all:
-    for(std::vector<LayerBrick>::const_iterator it = v.begin(); it != v.end(); it++) {
-      neighbours[it->LAYER].unset(it->BRICK);
-#ifdef DEBUG
-      // Verify that bricks from previous waves are not reached:
-      for(uint8_t i = 0; i < waveStart; i++) {
-	uint8_t layer = baseCombination.history[i].first;
-	const Brick &b = baseCombination.bricks[layer][baseCombination.history[i].second];
-	if(ABS(it->LAYER-layer) <= 1) {
-	  if(b.intersects(it->BRICK)) {
-	    std::cerr << "Brick intersection:" << std::endl << " New brick " << it->BRICK << " on layer " << (int)it->LAYER << std::endl << " Existing brick: " << b << " on layer " << (int)layer << std::endl << "Combination: " << baseCombination << std::endl;
-	    assert(false);
-	  }
-	}
-      }
-#endif
-    }
+  void CombinationBuilder::popWave(const WaveState &s) {
+    depth--;
+    waveStart = s.waveStart;
+    waveSize = s.waveSize;
+    encodingLocked = s.encodingLocked;
   }
 
   /*
@@ -1731,185 +2228,109 @@ namespace rectilinear {
   }
 
   void NonEncodingCombinationBuilder::addWaveToNeighbours(int8_t add) {
-    for(uint8_t i = 0; i < waveSize; i++) {
-      const BrickIdentifier &bi = baseCombination.history[waveStart+i];
-      const int8_t layer = bi.first; // Convert to signed
-      const Brick &brick = baseCombination.bricks[layer][bi.second];
-
-      // Add crossing bricks (one vertical, one horizontal):
-      for(int16_t x = -2; x <= 2; x++) {
-	int16_t xx = brick.x+x;
-	for(int16_t y = -2; y <= 2; y++)
-	  neighbours[layer].set(!brick.isVertical, xx, brick.y+y, add);
-      }
-
-      // Add parallel bricks:
-      int16_t w = 4, h = 2;
-      if(brick.isVertical) {
-	w = 2;
-	h = 4;
-      }
-      for(int16_t y = -h+1; y < h; y++) {
-	int16_t yy = brick.y+y;
-	for(int16_t x = -w+1; x < w; x++)
-	  neighbours[layer].set(brick.isVertical, brick.x+x, yy, add);
-      }
-    }
+    BrickPlane::addWave(neighbours, baseCombination, waveStart, waveSize, add);
   }
 
   void NonEncodingCombinationBuilder::findPotentialBricksForNextWave(std::vector<LayerBrick> &v) {
-    // Find all potential neighbours above and below all in wave:
-    for(uint8_t i = 0; i < waveSize; i++) {
-      const BrickIdentifier &bi = baseCombination.history[waveStart+i];
-      const int8_t waveBrickLayer = bi.first; // Convert to signed
-      const Brick &brick = baseCombination.bricks[waveBrickLayer][bi.second];
-
-      for(int8_t layer2 = waveBrickLayer-1; layer2 <= waveBrickLayer+1; layer2+=2) {
-	if(layer2 < 0)
-	  continue; // Do not allow building below base layer
-	if(layer2 >= maxCombination->height)
-	  continue; // Out of range
-	if(layer2 < baseCombination.height && baseCombination.layerSizes[layer2] == maxCombination->layerSizes[layer2])
-	  continue; // Already at maximum allowed for layer
-
-	// Add crossing bricks (one vertical, one horizontal):
-	for(int16_t x = -2; x < 3; x++) {
-	  int16_t xx = brick.x+x;
-	  for(int16_t y = -2; y < 3; y++) {
-	    int16_t yy = brick.y+y;
-	    if(!neighbours[layer2].contains(!brick.isVertical, xx, yy) && // Duplicate check
-	       (layer2 == 0 || !neighbours[layer2-1].contains(!brick.isVertical, xx, yy)) && // TODO: Why check below?
-	       (layer2+1 >= baseCombination.height || !neighbours[layer2+1].contains(!brick.isVertical, xx, yy))) {
-	      neighbours[layer2].set(!brick.isVertical, xx, yy);
-	      v.push_back(LayerBrick(Brick(!brick.isVertical, xx, yy), layer2));
-	    }
-	  }
-	}
-
-	// Add parallel bricks:
-	int16_t w = 4, h = 2;
-	if(brick.isVertical) {
-	  w = 2;
-	  h = 4;
-	}
-	for(int16_t y = -h+1; y < h; y++) {
-	  int16_t yy = brick.y+y;
-	  for(int16_t x = -w+1; x < w; x++) {
-	    int16_t xx = brick.x+x;
-	    if(!neighbours[layer2].contains(brick.isVertical, xx, yy) &&
-	       (layer2 == 0 || !neighbours[layer2-1].contains(brick.isVertical, xx, yy)) &&
-	       (layer2+1 >= baseCombination.height || !neighbours[layer2+1].contains(brick.isVertical, xx, yy))) {
-	      neighbours[layer2].set(brick.isVertical, xx, yy);
-	      v.push_back(LayerBrick(Brick(brick.isVertical, xx, yy), layer2));
-	    }
-	  }
-	}
-      } // for layer2
-    }
-
-    // Cleanup, so that neighbours can be shared by all:
-    for(std::vector<LayerBrick>::const_iterator it = v.begin(); it != v.end(); it++) {
-      neighbours[it->LAYER].unset(it->BRICK);
-#ifdef DEBUG
-      // Verify that bricks from previous waves are not reached:
-      for(uint8_t i = 0; i < waveStart; i++) {
-	uint8_t layer = baseCombination.history[i].first;
-	const Brick &b = baseCombination.bricks[layer][baseCombination.history[i].second];
-	if(ABS(it->LAYER-layer) <= 1) {
-	  if(b.intersects(it->BRICK)) {
-	    std::cerr << "Brick intersection:" << std::endl << " New brick " << it->BRICK << " on layer " << (int)it->LAYER << std::endl << " Existing brick: " << b << " on layer " << (int)layer << std::endl << "Combination: " << baseCombination << std::endl;
-	    assert(false);
-	  }
-	}
-      }
-#endif
-    }
+    BrickPlane::findPotentialBricks(neighbours, baseCombination, waveStart, waveSize, *maxCombination, v);
   }
 
-  uint64_t CombinationBuilder::simonWithBuckets(std::vector<std::vector<LayerBrick> > &buckets, uint32_t *bucketIndices, uint32_t numBuckets, uint32_t *bucketSizes) {
+  uint64_t CombinationBuilder::simonWithBuckets(const ConflictGraph &graph, const uint16_t *bucketOffsets, std::vector<std::vector<LayerBrick> > &buckets, uint32_t *bucketIndices, uint32_t numBuckets, uint32_t *bucketSizes) {
+    Telemetry::countSimon();
+    PROFILE_COUNT(baseCombination.size, simonCalls, 1);
     // Common case: 1 brick being placed:
-    if(numBuckets == 1) {
-      if(bucketSizes[0] == 1) {
-	const uint32_t bucketI = bucketIndices[0];
-	return buckets[bucketI].size();
-      }
-      // For 2 bricks from 1 bucket, simply running O(n^2) comparisons might be faster:
-      if(bucketSizes[0] == 2) {
-	const std::vector<LayerBrick>& bucket = buckets[bucketIndices[0]];
-	uint64_t ret = 0;
-	for(uint32_t i = 0; i < bucket.size(); i++) {
-	  const LayerBrick& b1 = bucket[i];
-	  for(uint32_t j = i+1; j < bucket.size(); j++) {
-	    const LayerBrick& b2 = bucket[j];
-	    if(b1.LAYER != b2.LAYER || !b1.BRICK.intersects(b2.BRICK))
-	      ret++;
-	  }
-	}
-	return ret;
-      }
+    if(numBuckets == 1 && bucketSizes[0] == 1) {
+      const uint32_t bucketI = bucketIndices[0];
+      PROFILE_COUNT(baseCombination.size, simonAll, (double)buckets[bucketI].size());
+      PROFILE_COUNT(baseCombination.size, simonValid, (double)buckets[bucketI].size());
+      return buckets[bucketI].size();
     }
-    
-    // First count all possible+impossible picks:
-    uint64_t all = 1;
-    for(uint64_t j = 0; j < numBuckets; j++) {
-      const uint32_t bucketI = bucketIndices[j];
-      all *= BinomialCoefficient::nChooseK(buckets[bucketI].size(), bucketSizes[j]);
-    }
-
-    // Then remove all impossible picks:
-    // overlap(N):
-    uint64_t overlap = countInvalid(buckets, bucketIndices, numBuckets, bucketSizes, 0, 0, 0, 0);
 
-    // Count up:
-    assert(all >= overlap);
-    return all - overlap;
+    // Count the picks without intersections directly in the conflict graph:
+    uint16_t starts[MAX_BRICKS], ends[MAX_BRICKS];
+#ifdef PROFILE
+    double all = 1; // Picks with and without overlaps
+#endif
+    for(uint32_t j = 0; j < numBuckets; j++) {
+      starts[j] = bucketOffsets[bucketIndices[j]];
+      ends[j] = bucketOffsets[bucketIndices[j]+1];
+#ifdef PROFILE
+      all *= (double)BinomialCoefficient::nChooseK(ends[j] - starts[j], bucketSizes[j]);
+#endif
+    }
+#ifdef PROFILE
+    const uint64_t valid = graph.countIndependent(starts, ends, bucketSizes, numBuckets);
+    PROFILE_COUNT(baseCombination.size, simonAll, all);
+    PROFILE_COUNT(baseCombination.size, simonValid, (double)valid);
+    return valid;
+#else
+    return graph.countIndependent(starts, ends, bucketSizes, numBuckets);
+#endif
   }
 
-  uint64_t CombinationBuilder::placeAllSizedBuckets(std::vector<std::vector<LayerBrick> > &buckets, uint32_t *bucketIndices, uint32_t numBuckets, uint32_t leftToPlace, uint32_t *bucketSizes, uint32_t bucketSizesI) {
+  uint64_t CombinationBuilder::placeAllSizedBuckets(const ConflictGraph &graph, const uint16_t *bucketOffsets, std::vector<std::vector<LayerBrick> > &buckets, uint32_t *bucketIndices, uint32_t numBuckets, uint32_t leftToPlace, uint32_t *bucketSizes, uint32_t bucketSizesI) {
     const uint32_t remainingBuckets = numBuckets - bucketSizesI;
     if(remainingBuckets == 1) {
       bucketSizes[bucketSizesI] = leftToPlace;
-      return simonWithBuckets(buckets, bucketIndices, numBuckets, bucketSizes);
+      return simonWithBuckets(graph, bucketOffsets, buckets, bucketIndices, numBuckets, bucketSizes);
     }
 
     uint64_t ret = 0;
     for(uint32_t bucketSize = 1; bucketSize + remainingBuckets <= leftToPlace + 1; bucketSize++) {
       bucketSizes[bucketSizesI] = bucketSize;
-      ret += placeAllSizedBuckets(buckets, bucketIndices, numBuckets, leftToPlace-bucketSize, bucketSizes, bucketSizesI+1);
+      ret += placeAllSizedBuckets(graph, bucketOffsets, buckets, bucketIndices, numBuckets, leftToPlace-bucketSize, bucketSizes, bucketSizesI+1);
     }
     return ret;
   }
 
-  void CombinationBuilder::placeAllInBuckets(std::vector<std::vector<LayerBrick> > &buckets, uint32_t *bucketIndices, uint32_t bucketI, uint32_t bucketIndicesI, uint32_t numBuckets, uint32_t leftToPlace) {
+  void CombinationBuilder::placeAllInBuckets(const ConflictGraph &graph, const uint16_t *bucketOffsets, std::vector<std::vector<LayerBrick> > &buckets, uint32_t *bucketIndices, uint32_t bucketI, uint32_t bucketIndicesI, uint32_t numBuckets, uint32_t leftToPlace) {
     const uint32_t remaining = numBuckets - bucketI;
 
     if(remaining == 0) {
       // Call into all bucket size combinations:
       uint32_t *bucketSizes = new uint32_t[numBuckets];
 
-      // Compute token (same for all combinations):
+      // Compute encoding (same for all combinations):
       for(uint32_t i = 0; i < numBuckets; i++)
 	baseCombination.addBrick(buckets[bucketIndices[i]][0]);
-      Token token = maxCombination.getTokenFromLayerSizes();
-      token = baseCombination.encodeConnectivity(token);
+      const int rank = baseCombination.rankConnectivity();
       for(uint32_t i = 0; i < numBuckets; i++)
 	baseCombination.removeLastBrick();
 
       // Perform computation:
-      uint64_t toAdd = placeAllSizedBuckets(buckets, bucketIndices, numBuckets, leftToPlace, bucketSizes, 0);
-      CountsMap::iterator it = counts.find(token);
-      if(it == counts.end())
-	counts[token] = Counts(toAdd, 0, 0);
-      else
-	it->second.all += toAdd;
+      uint64_t toAdd = placeAllSizedBuckets(graph, bucketOffsets, buckets, bucketIndices, numBuckets, leftToPlace, bucketSizes, 0);
+      counts[rank].all += toAdd;
       delete[] bucketSizes;
       return; // Done!
     }
 
     for(uint32_t i = bucketIndicesI; i + remaining <= buckets.size(); i++) {
       bucketIndices[bucketI] = i;
-      placeAllInBuckets(buckets, bucketIndices, bucketI+1, i+1, numBuckets, leftToPlace);
+      placeAllInBuckets(graph, bucketOffsets, buckets, bucketIndices, bucketI+1, i+1, numBuckets, leftToPlace);
+    }
+  }
+
+  void CombinationBuilder::placeAllInAllBuckets(std::vector<std::vector<LayerBrick> > &buckets, const uint8_t leftToPlace) {
+    // Build the conflict graph once for all buckets, concatenated:
+    BrickBatch batch;
+    uint16_t *bucketOffsets = new uint16_t[buckets.size()+1];
+    for(uint32_t i = 0; i < buckets.size(); i++) {
+      bucketOffsets[i] = batch.size;
+      for(std::vector<LayerBrick>::const_iterator it = buckets[i].begin(); it != buckets[i].end(); it++)
+	batch.push(*it);
+    }
+    bucketOffsets[buckets.size()] = batch.size;
+    graph.build(batch);
+
+    // Try all combinations:
+    uint32_t *bucketIndices = new uint32_t[leftToPlace];
+    for(uint32_t numBuckets = 1; numBuckets <= leftToPlace && numBuckets <= buckets.size(); numBuckets++) {
+      // Pick 'leftToPlace' from the numBuckets number of buckets:
+      // First iterate over all ways of picking the buckets:
+      placeAllInBuckets(graph, bucketOffsets, buckets, bucketIndices, 0, 0, numBuckets, leftToPlace);
     }
+    delete[] bucketIndices;
+    delete[] bucketOffsets;
   }
 
   void CombinationBuilder::setUpBucketsForSimon(std::vector<std::vector<LayerBrick> > &buckets, const std::vector<LayerBrick> &v) {
@@ -1924,36 +2345,41 @@ namespace rectilinear {
     baseCombination.colorFull();
 
     // Categorize each brick in baseCombination by its color:
-    std::vector<LayerBrick> colorToBricks[4]; // Max 4 bricks in base
+    BrickBatch colored;
+    uint64_t colorMasks[MAX_LAYER_SIZE] = {0}; // Bits of 'colored' for each color
     for(uint8_t layer = 0; layer < baseCombination.height; layer++) {
       for(uint8_t i = 0; i < baseCombination.layerSizes[layer]; i++) {
 	uint8_t color = baseCombination.colors[layer][i];
 	assert(color > 0);
-	colorToBricks[color-1].push_back(LayerBrick(baseCombination.bricks[layer][i], layer));
+	colorMasks[color-1] |= ((uint64_t)1) << colored.size;
+	colored.push(LayerBrick(baseCombination.bricks[layer][i], layer));
       }
     }
 
     // Categorize each brick in v by the colors they touch:
     const uint8_t base = baseCombination.layerSizes[0];
-    std::map<int32_t,int> encodingToBucketIndex;
+    int encodingToBucketIndex[1 << MAX_LAYER_SIZE];
+    for(int i = 0; i < (1 << base); i++)
+      encodingToBucketIndex[i] = -1;
     for(std::vector<LayerBrick>::const_iterator it = v.begin(); it != v.end(); it++) {
       const LayerBrick &b = *it;
+      // Bricks of baseCombination touched in the layers above and below b:
+      uint64_t touched = colored.intersectMask(LayerBrick(b.BRICK, b.LAYER+1));
+      if(b.LAYER > 0)
+	touched |= colored.intersectMask(LayerBrick(b.BRICK, b.LAYER-1));
       int32_t encoding = 0;
       int countColors = 0;
       for(uint8_t i = 0; i < base; i++) {
-	for(std::vector<LayerBrick>::const_iterator it = colorToBricks[i].begin(); it != colorToBricks[i].end(); it++) {
-	  if((b.LAYER == it->LAYER+1 || b.LAYER+1 == it->LAYER) && it->BRICK.intersects(b.BRICK)) {
-	    encoding += (1 << i);
-	    countColors++;
-	    break;
-	  }
+	if((touched & colorMasks[i]) != 0) {
+	  encoding += (1 << i);
+	  countColors++;
 	}
       }
       assert(countColors > 0); // All bricks should touch something... that is how they we chosen.
       if(countColors == 1)
 	encoding = 1; // If only touching one, they cannot be used to change an encoding, so bundle them all.
 
-      if(encodingToBucketIndex.find(encoding) == encodingToBucketIndex.end()) {
+      if(encodingToBucketIndex[encoding] == -1) {
 	buckets.push_back(std::vector<LayerBrick>());
 	encodingToBucketIndex[encoding] = (int)buckets.size()-1;
       }
@@ -1987,29 +2413,16 @@ namespace rectilinear {
       return false; // Can't possibly fill!
 
     BrickPicker picker(v, 0, leftToPlace);
-    Token token = 0, prevToken = 0;
-    CountsMap::iterator it;
+    int rank = -1;
     while(picker.next(baseCombination, maxCombination)) {
       if(baseCombination.is180Symmetric()) {
-	if(!encodingLocked || token == 0) {
-	  token = baseCombination.getTokenFromLayerSizes();
-	  token = baseCombination.encodeConnectivity(token);
-
-	  if(token != prevToken) {
-	    it = counts.find(token);
-	    if(it == counts.end()) {
-	      std::pair<CountsMap::iterator,bool> pp = counts.insert(std::pair<Token,Counts>(token, Counts()));
-	      assert(pp.second);
-	      it = pp.first;
-	    }
-	    prevToken = token;
-	  }
-	}
-	assert(it != counts.end());
+	if(!encodingLocked || rank == -1)
+	  rank = baseCombination.rankConnectivity();
+	Counts &c = counts[rank];
 
-	it->second.symmetric180++;
+	c.symmetric180++;
 	if(baseCombination.is90Symmetric())
-	  it->second.symmetric90++;
+	  c.symmetric90++;
       }
 
       for(uint8_t i = 0; i < leftToPlace; i++)
@@ -2046,50 +2459,31 @@ namespace rectilinear {
 
 
     const bool canBeSymmetric180 = baseCombination.canBecomeSymmetric(maxCombination);
+    PROFILE_COUNT(baseCombination.size, symmetricChecks, 1);
+    PROFILE_COUNT(baseCombination.size, symmetricPasses, canBeSymmetric180 ? 1 : 0);
 
     // Simon with buckets optimization:
     if(!canBeSymmetric180) {
       // Use optimization from Simon for each isolated connectivity:
       std::vector<std::vector<LayerBrick> > buckets;
       setUpBucketsForSimon(buckets, v);
-
-      // Try all combinations:
-      uint32_t *bucketIndices = new uint32_t[leftToPlace];
-      for(uint32_t numBuckets = 1; numBuckets <= leftToPlace && numBuckets <= buckets.size(); numBuckets++) {
-	// Pick 'leftToPlace' from the numBuckets number of buckets:
-	// First iterate over all ways of picking the buckets:
-	placeAllInBuckets(buckets, bucketIndices, 0, 0, numBuckets, leftToPlace);
-      }
-      delete[] bucketIndices;
+      placeAllInAllBuckets(buckets, leftToPlace);
       return true; // Done by Simon ... with buckets!
     }
 
     // Can be symmetric, so slow algorithm OK here:
     BrickPicker picker(v, 0, leftToPlace);
-    Token token = 0, prevToken = 0;
-    CountsMap::iterator it;
+    int rank = -1;
     while(picker.next(baseCombination, maxCombination)) {
-      if(!encodingLocked || token == 0) {
-	token = baseCombination.getTokenFromLayerSizes();
-	token = baseCombination.encodeConnectivity(token);
-
-	if(token != prevToken) {
-	  it = counts.find(token);
-	  if(it == counts.end()) {
-	    std::pair<CountsMap::iterator,bool> pp = counts.insert(std::pair<Token,Counts>(token, Counts()));
-	    assert(pp.second);
-	    it = pp.first;
-	  }
-	  prevToken = token;
-	}
-      }
-      assert(it != counts.end());
+      if(!encodingLocked || rank == -1)
+	rank = baseCombination.rankConnectivity();
+      Counts &c = counts[rank];
 
-      it->second.all++;
+      c.all++;
       if(canBeSymmetric180 && baseCombination.is180Symmetric()) {
-	it->second.symmetric180++;
+	c.symmetric180++;
 	if(baseCombination.is90Symmetric())
-	  it->second.symmetric90++;
+	  c.symmetric90++;
       }
 
       for(uint8_t i = 0; i < leftToPlace; i++)
@@ -2129,112 +2523,10 @@ namespace rectilinear {
     // Use optimization from Simon for each isolated connectivity:
     std::vector<std::vector<LayerBrick> > buckets;
     setUpBucketsForSimon(buckets, v);
-
-    // Try all combinations:
-    uint32_t *bucketIndices = new uint32_t[leftToPlace];
-    for(uint32_t numBuckets = 1; numBuckets <= leftToPlace && numBuckets <= buckets.size(); numBuckets++) {
-      // Pick 'leftToPlace' from the numBuckets number of buckets:
-      // First iterate over all ways of picking the buckets:
-      placeAllInBuckets(buckets, bucketIndices, 0, 0, numBuckets, leftToPlace);
-    }
-    delete[] bucketIndices;
+    placeAllInAllBuckets(buckets, leftToPlace);
     return true; // Done by Simon ... with buckets!
   }
 
-  uint64_t CombinationBuilder::countInvalid(std::vector<std::vector<LayerBrick> > &buckets, uint32_t *bucketIndices, uint32_t numBuckets, uint32_t *bucketSizes, uint32_t bucketI, uint32_t bucketII, uint32_t pickedFromCurrentBucket, uint32_t pickedTotal) {
-    assert(bucketI <= numBuckets);
-    if(bucketI == numBuckets)
-      return 0; // Bucket unavailable
-
-    // Pick next:
-    // Check if end of current bucket:
-    const std::vector<LayerBrick> &currentBucket = buckets[bucketIndices[bucketI]];
-    const uint64_t currentBucketSize = (int)currentBucket.size();
-    assert(currentBucketSize >= bucketII);
-    assert(pickedFromCurrentBucket <= bucketSizes[bucketI]);
-    if(pickedFromCurrentBucket == bucketSizes[bucketI])
-      return countInvalid(buckets, bucketIndices, numBuckets, bucketSizes, bucketI+1, 0, 0, pickedTotal);
-
-    uint64_t ret = 0;
-
-    // Try to add each brick of current bucket and then recurse for future bricks:
-    const uint64_t leftToPick = bucketSizes[bucketI] - (pickedFromCurrentBucket+1);
-    uint64_t leftInBucket = currentBucketSize - (uint64_t)bucketII;
-    for(; bucketII < currentBucketSize; bucketII++) {
-      --leftInBucket;
-      const LayerBrick &b = currentBucket[bucketII];
-
-      bool hasIntersection = false;
-      for(uint32_t i = 0; i < pickedTotal; i++) {
-	const BrickIdentifier &h = baseCombination.history[baseCombination.size - i - 1];
-	if(h.first == b.LAYER && baseCombination.bricks[h.first][i].intersects(b.BRICK)) {
-	  hasIntersection = true;
-	  break;
-	}
-      }
-
-      if(bucketI+1 == numBuckets && leftToPick == 0) {
-	ret += hasIntersection;
-	continue; // Small optimization: Last brick has been placed
-      }
-
-      if(hasIntersection) {
-	// Count all with this intersection:
-	// From current bucket:
-	uint64_t toAdd = BinomialCoefficient::nChooseK(leftInBucket, leftToPick);
-	// From remaining buckets:
-	for(uint32_t j = bucketI+1; j < numBuckets; j++)
-	  toAdd *= BinomialCoefficient::nChooseK(buckets[bucketIndices[j]].size(), bucketSizes[j]);
-	ret += toAdd;
-      }
-      else {
-	baseCombination.addBrick(b);
-	ret += countInvalid(buckets, bucketIndices, numBuckets, bucketSizes, bucketI, bucketII+1, pickedFromCurrentBucket+1, pickedTotal+1);
-	baseCombination.removeLastBrick();
-      }
-    }
-
-    return ret;
-  }
-  
-  /*
-    Number of ways to place N bricks from v with intersections
-   */
-  uint64_t NonEncodingCombinationBuilder::countInvalid(Brick *combination, int combinationSize, int N, Brick const * const v, const int sizeV, int vIndex) const {
-    if(vIndex == sizeV || N == 0)
-      return 0;
-
-    uint64_t ret = 0;
-
-    for(; vIndex < sizeV-N+1; vIndex++) {
-      const Brick &b = v[vIndex];
-
-      bool hasIntersection = false;
-      for(int i = 0; i < combinationSize; i++) {
-	if(combination[i].intersects(b)) {
-	  hasIntersection = true;
-	  break;
-	}
-      }
-
-      if(hasIntersection) {
-	uint64_t toAdd = 1;
-	uint64_t sizeVRemaining = sizeV - vIndex - 1;
-	for(int i = 0; i < N-1; i++)
-	  toAdd *= sizeVRemaining - i;
-	for(int i = 2; i < N; i++)
-	  toAdd /= i;
-	ret += toAdd;
-      }
-      else {
-	combination[combinationSize] = b;
-	ret += countInvalid(combination, combinationSize+1, N-1, v, sizeV, vIndex+1);
-      }
-    }
-
-    return ret;
-  }
-
   /*
     The last time A112389 was improved, it was by Simon (2018) who used the
     following formula:
@@ -2246,34 +2538,42 @@ namespace rectilinear {
     - all(N) is the binomial coefficient, which can be computed quickly.
     - overlap(N) has to iterate through all combinations with intersections, but
       iteration stops when the first overlap is encountered.
+    The conflict graph visits the same non-intersecting partial picks as overlap(N)
+    would, so the valid picks are counted directly, and only using bit operations.
    */
-  uint64_t NonEncodingCombinationBuilder::simon(const uint8_t &N, const std::vector<LayerBrick> &v) const {
+  uint64_t NonEncodingCombinationBuilder::simon(const std::vector<LayerBrick> &v) {
+    Telemetry::countSimon();
+    PROFILE_COUNT(baseCombination.size, simonCalls, 1);
     uint64_t ret = 1;
+#ifdef PROFILE
+    double all = 1; // Picks with and without overlaps
+#endif
 
     // Handle all layers to be filled:
-    Brick *c = new Brick[N], *v2 = new Brick[v.size()];
+    BrickBatch v2;
     for(uint8_t layer = 0; layer < maxCombination->height; layer++) {
       uint64_t N2 = layer >= baseCombination.height ? maxCombination->layerSizes[layer] : maxCombination->layerSizes[layer] - baseCombination.layerSizes[layer];
       if(N2 == 0)
 	continue; // Skip full layer
 
-      int v2Size = 0;
+      v2.clear();
       for(std::vector<LayerBrick>::const_iterator it = v.begin(); it != v.end(); it++) {
 	if(it->LAYER == layer)
-	  v2[v2Size++] = it->BRICK;
+	  v2.push(it->BRICK);
       }
+      if(v2.size < N2)
+	return 0;
 
-      // all(N) is just the binomial coefficient:
-      uint64_t all = BinomialCoefficient::nChooseK(v2Size, N2);
-
-      // overlap(N):
-      uint64_t overlap = countInvalid(c, 0, N2, v2, v2Size, 0);
-
-      assert(all >= overlap);
-      ret *= all-overlap;
+      graph.build(v2);
+      ret *= graph.countIndependent(N2);
+#ifdef PROFILE
+      all *= (double)BinomialCoefficient::nChooseK(v2.size, N2);
+#endif
+      if(ret == 0)
+	break;
     }
-    delete[] c;
-    delete[] v2;
+    PROFILE_COUNT(baseCombination.size, simonAll, all);
+    PROFILE_COUNT(baseCombination.size, simonValid, (double)ret);
 
     return ret;
   }
@@ -2281,6 +2581,8 @@ namespace rectilinear {
   Counts NonEncodingCombinationBuilder::placeAllLeftToPlace(const uint8_t &leftToPlace, const std::vector<LayerBrick> &v) {
     assert(leftToPlace > 0);
     const bool canBeSymmetric180 = baseCombination.canBecomeSymmetric(*maxCombination);
+    PROFILE_COUNT(baseCombination.size, symmetricChecks, 1);
+    PROFILE_COUNT(baseCombination.size, symmetricPasses, canBeSymmetric180 ? 1 : 0);
 
     // Special case: 1 left to place, and can not be symmetric:
     if(!canBeSymmetric180 && leftToPlace == 1)
@@ -2313,7 +2615,7 @@ namespace rectilinear {
 
     // Optimization: Check if algorithm by Simon (2018) can be used:
     if(!canBeSymmetric180) {
-      uint64_t nonSymmetric = simon(leftToPlace, v);
+      uint64_t nonSymmetric = simon(v);
       if(nonSymmetric > 0)
 	return Counts(nonSymmetric, 0, 0);
     }
@@ -2335,19 +2637,6 @@ namespace rectilinear {
     return ret;
   }
 
-  void CombinationBuilder::addCountsFrom(const CountsMap &countsFrom) {
-    for(CountsMap::const_iterator it = countsFrom.begin(); it != countsFrom.end(); it++) {
-      Token token = it->first;
-      Counts toAdd = it->second;
-
-      CountsMap::iterator it2;
-      if((it2 = counts.find(token)) == counts.end())
-	counts[token] = toAdd;
-      else
-	it2->second += toAdd;
-    }
-  }
-
   /*
     Wave construction of models:
     Assume a non-empty wave:
@@ -2355,21 +2644,46 @@ namespace rectilinear {
     Find next wave and recurse until model contains n bricks.
   */
   Counts NonEncodingCombinationBuilder::build() {
-    std::vector<LayerBrick> v;
+    Telemetry::countNode();
+    std::vector<LayerBrick> &v = candidates[depth];
+    v.clear();
     findPotentialBricksForNextWave(v);
+    PROFILE_COUNT(baseCombination.size, nodes, 1);
+    PROFILE_CANDIDATES(baseCombination.size, v.size());
 
     const uint8_t leftToPlace = maxCombination->size - baseCombination.size;
     Counts ret = placeAllLeftToPlace(leftToPlace, v);
-    if(ret.all != 0)
+    if(ret.all != 0) {
+      PROFILE_COUNT(baseCombination.size, resolved, 1);
+      Telemetry::countLeaf();
       return ret;
+    }
 
     addWaveToNeighbours(1);
+    PROFILE_COUNT(baseCombination.size, recursed, 1);
     for(uint8_t toPick = 1; toPick < leftToPlace; toPick++) {
       BrickPicker picker(v, 0, toPick);
 
       while(picker.next(baseCombination, *maxCombination)) {
-	NonEncodingCombinationBuilder builder(baseCombination, waveStart+waveSize, toPick, neighbours, maxCombination);
- 	ret += builder.build();
+	PROFILE_COUNT(baseCombination.size - toPick, picks[toPick], 1);
+	if(worker != NULL && worker->pool->shouldSplit(baseCombination.size)) {
+	  // Let an idle worker build this subtree:
+	  if(unit != NULL)
+	    unit->outstanding++;
+	  worker->pool->publish(SplitTask(baseCombination, waveStart+waveSize, toPick, slot, unit), worker);
+	}
+	else {
+	  // Build the next wave in place:
+	  const uint8_t prevWaveStart = waveStart, prevWaveSize = waveSize;
+	  waveStart += waveSize;
+	  waveSize = toPick;
+	  depth++;
+	  assert(depth < MAX_BRICKS);
+	  ret += build();
+	  depth--;
+	  waveStart = prevWaveStart;
+	  waveSize = prevWaveSize;
+	}
 	for(uint8_t i = 0; i < toPick; i++)
 	  baseCombination.removeLastBrick();
       }
@@ -2380,27 +2694,32 @@ namespace rectilinear {
   }
 
   void CombinationBuilder::build() {
-    std::vector<LayerBrick> v;
+    Telemetry::countNode();
+    std::vector<LayerBrick> &v = candidates[depth];
+    v.clear();
     findPotentialBricksForNextWave(v);
+    PROFILE_COUNT(baseCombination.size, nodes, 1);
+    PROFILE_CANDIDATES(baseCombination.size, v.size());
 
     const uint8_t leftToPlace = maxCombination.size - baseCombination.size;
-    if(placeAllLeftToPlace(leftToPlace, v))
+    if(placeAllLeftToPlace(leftToPlace, v)) {
+      PROFILE_COUNT(baseCombination.size, resolved, 1);
+      Telemetry::countLeaf();
       return; // Done in placeAllLeftToPlace()
+    }
 
     addWaveToNeighbours(1);
+    PROFILE_COUNT(baseCombination.size, recursed, 1);
     for(uint8_t toPick = 1; toPick < leftToPlace; toPick++) {
       // Pick toPick from neighbours:
       BrickPicker picker(v, 0, toPick);
 
       while(picker.next(baseCombination, maxCombination)) {
-	// Encoding can only take on a single value if bricks being picked belong to same base bricks.
-	// TODO: Improve this by checking the encoding
-	bool nextEncodingLocked = encodingLocked || toPick == 1;
-	CombinationBuilder builder(baseCombination, waveStart+waveSize, toPick, neighbours, maxCombination, nextEncodingLocked);
-
- 	builder.build();
-
- 	addCountsFrom(builder.counts);
+	PROFILE_COUNT(baseCombination.size - toPick, picks[toPick], 1);
+	// Build the next wave in place. Counts are added directly to 'counts':
+	const WaveState s = pushWave(toPick);
+	build();
+	popWave(s);
 
 	for(uint8_t i = 0; i < toPick; i++)
 	  baseCombination.removeLastBrick();
@@ -2410,24 +2729,31 @@ namespace rectilinear {
   }
 
   void CombinationBuilder::buildWithoutSymmetriesSeparately() {
-    std::vector<LayerBrick> v;
+    Telemetry::countNode();
+    std::vector<LayerBrick> &v = candidates[depth];
+    v.clear();
     findPotentialBricksForNextWave(v);
+    PROFILE_COUNT(baseCombination.size, nodes, 1);
+    PROFILE_CANDIDATES(baseCombination.size, v.size());
 
     const uint8_t leftToPlace = maxCombination.size - baseCombination.size;
-    if(placeAllLeftToPlaceWithoutSymmetries(leftToPlace, v))
+    if(placeAllLeftToPlaceWithoutSymmetries(leftToPlace, v)) {
+      PROFILE_COUNT(baseCombination.size, resolved, 1);
+      Telemetry::countLeaf();
       return;
+    }
 
     addWaveToNeighbours(1);
+    PROFILE_COUNT(baseCombination.size, recursed, 1);
     for(uint8_t toPick = 1; toPick < leftToPlace; toPick++) {
       // Pick toPick from neighbours:
       BrickPicker picker(v, 0, toPick);
 
       while(picker.next(baseCombination, maxCombination)) {
-	bool nextEncodingLocked = encodingLocked || toPick == 1;
-	CombinationBuilder builder(baseCombination, waveStart+waveSize, toPick, neighbours, maxCombination, nextEncodingLocked);
-
- 	builder.buildWithoutSymmetriesSeparately();
- 	addCountsFrom(builder.counts);
+	PROFILE_COUNT(baseCombination.size - toPick, picks[toPick], 1);
+	const WaveState s = pushWave(toPick);
+	buildWithoutSymmetriesSeparately();
+	popWave(s);
 
 	for(uint8_t i = 0; i < toPick; i++)
 	  baseCombination.removeLastBrick();
@@ -2460,12 +2786,12 @@ namespace rectilinear {
     cb.build();
     delete[] neighbours;
     assert(cb.counts.size() == 1);
-    Counts xCheck = cb.counts.begin()->second;
+    Counts xCheck = cb.counts[0];
     assert(xCheck == fromAll);
 #endif
   }
 
-  bool Lemma4Cache::get(const Base &b, CountsMap &m) {
+  bool Lemma4Cache::get(const Base &b, EncodingCounts &m) {
     assert(b.layerSize != 1);
     BaseResultsMap::const_iterator it = cache.find(b);
     if(it != cache.end()) {
@@ -2475,7 +2801,7 @@ namespace rectilinear {
     return false;
   }
 
-  void Lemma4Cache::set(const Base &b, const CountsMap &m) {
+  void Lemma4Cache::set(const Base &b, const EncodingCounts &m) {
     cache[b] = m;
   }
 
@@ -2483,7 +2809,7 @@ namespace rectilinear {
     return base1Counts;
   }
 
-  void Lemma4CacheManager::computeOrGet(const Base &b, CountsMap &m, BrickPlane *neighbours) {
+  void Lemma4CacheManager::computeOrGet(const Base &b, EncodingCounts &m, BrickPlane *neighbours) {
     const uint8_t &baseSize = b.layerSize;
     assert(baseSize != 1);
     // Cache becomes too big if largest base size is included:
@@ -2494,22 +2820,9 @@ namespace rectilinear {
 
     CombinationBuilder cb(b, neighbours, maxCombination);
     cb.build();
-    CountsMap toCache;
-    for(CountsMap::const_iterator it = cb.counts.begin(); it != cb.counts.end(); it++) {
-      // Keep only color encoding from counts map:
-      Token token = it->first;
-      Token rToken = 0;
-      for(uint8_t i = 0; i < b.layerSize; i++) {
-	rToken = rToken * 10 + (token%10);
-	token/=10;
-      }
-      token = 0;
-      for(uint8_t i = 0; i < b.layerSize; i++) {
-	token = token * 10 + (rToken%10);
-	rToken/=10;
-      }
-      toCache[token] = it->second;
-    }
+    EncodingCounts toCache(0, b.layerSize); // Keep only color encoding in tokens
+    for(int i = 0; i < toCache.size(); i++)
+      toCache[i] = cb.counts[i];
 
     if(baseSize <= 2 || baseSize < maxCombination.layerSizes[0]) {
       caches[baseSize].set(b, toCache); // set
@@ -2525,10 +2838,10 @@ namespace rectilinear {
     - baseToken from maxCombination.getTokenFromLayerSizes()
     Take care when computing token here: cacheToken only tells about normalized base!
   */
-  Token Lemma4CacheManager::computeToken(const Combination &baseCombination,
-					 const CBase &secondLayer,
-					 Token cacheToken,
-					 const Token baseToken) const {
+  PackedToken Lemma4CacheManager::computeToken(const Combination &baseCombination,
+					       const CBase &secondLayer,
+					       const PackedToken &cacheToken,
+					       const PackedToken &baseToken) const {
     const uint8_t &s1 = baseCombination.layerSizes[0], &s2 = baseCombination.layerSizes[1];
     uint8_t colorsA[2][MAX_LAYER_SIZE], colorsB[MAX_LAYER_SIZE]; // A from baseCombination, B from cache
     for(uint8_t i = 0; i < s1; i++)
@@ -2536,10 +2849,8 @@ namespace rectilinear {
     for(uint8_t i = 0; i < s2; i++)
       colorsA[1][i] = baseCombination.colors[1][i];
 
-    for(int8_t i = s2-1; i >= 0; i--) {
-      colorsB[secondLayer.bricks[i].second] = cacheToken%10; // secondLayer.bricks[i].second is original position
-      cacheToken /= 10;
-    }
+    for(int8_t i = s2-1; i >= 0; i--)
+      colorsB[secondLayer.bricks[i].second] = cacheToken.fromRight(s2-1-i); // secondLayer.bricks[i].second is original position
     // Connect colors of A:
     bool improved = true;
     while(improved) {
@@ -2564,9 +2875,9 @@ namespace rectilinear {
       }
     }
     // Colors of A are now minimized: Re-encode:
-    Token token = baseToken*10+1;
+    PackedToken token = baseToken.append(1);
     for(uint8_t i = 1; i < s1; i++)
-      token = token * 10 + colorsA[0][i];
+      token = token.append(colorsA[0][i]);
     return token;
   }
 
@@ -2582,8 +2893,8 @@ namespace rectilinear {
     - base_T = Transformation from picked bricks to those used for token T
     - t_to_T = Transformation from t to T
   */
-  bool Lemma4CacheManager::didSmallerBaseContribute(Token t,
-						    Token T,
+  bool Lemma4CacheManager::didSmallerBaseContribute(const PackedToken &t,
+						    const PackedToken &T,
 						    const CBase &base_t,
 						    const CBase &base_T,
 						    const CBase &t_to_T) const {
@@ -2594,10 +2905,9 @@ namespace rectilinear {
 
     // Use colors_T as temporary buffer for computing colors_t
     for(int8_t i = size_t-1; i >= 0; i--) {
-      uint8_t color = t%10;
+      uint8_t color = t.fromRight(size_t-1-i);
       uint8_t ofBase_t = base_t.bricks[i].second;
       colors_T[ofBase_t] = color;
-      t/=10;
     }
     for(int8_t i = size_t; i < size_T; i++)
       colors_T[i] = 99;
@@ -2607,9 +2917,8 @@ namespace rectilinear {
     }
     // Done for colors_t. Now colors_T can be seat up (only one transformation step):
     for(int8_t i = size_T-1; i >= 0; i--) {
-      uint8_t color = T%10;
+      uint8_t color = T.fromRight(size_T-1-i);
       colors_T[base_T.bricks[i].second] = color;
-      T/=10;
     }
 
     // Check each color in T:
@@ -2645,24 +2954,32 @@ namespace rectilinear {
   }
 
   void CombinationBuilder::buildSymmetricOnly() {
-    std::vector<LayerBrick> v;
+    Telemetry::countNode();
+    std::vector<LayerBrick> &v = candidates[depth];
+    v.clear();
     findPotentialBricksForNextWave(v);
+    PROFILE_COUNT(baseCombination.size, nodes, 1);
+    PROFILE_CANDIDATES(baseCombination.size, v.size());
 
     const uint8_t leftToPlace = maxCombination.size - baseCombination.size;
-    if(placeAllSymmetricLeftToPlace(leftToPlace, v))
+    if(placeAllSymmetricLeftToPlace(leftToPlace, v)) {
+      PROFILE_COUNT(baseCombination.size, resolved, 1);
+      Telemetry::countLeaf();
       return; // Done in placeAllLeftToPlace()
+    }
 
     addWaveToNeighbours(1);
+    PROFILE_COUNT(baseCombination.size, recursed, 1);
     for(uint8_t toPick = 1; toPick < leftToPlace; toPick++) {
       // Pick toPick from neighbours:
       BrickPicker picker(v, 0, toPick);
 
       while(picker.next(baseCombination, maxCombination)) {
+	PROFILE_COUNT(baseCombination.size - toPick, picks[toPick], 1);
 	if(baseCombination.is180Symmetric()) {
-	  bool nextEncodingLocked = encodingLocked || toPick == 1;
-	  CombinationBuilder builder(baseCombination, waveStart+waveSize, toPick, neighbours, maxCombination, nextEncodingLocked);
-	  builder.buildSymmetricOnly();
-	  addCountsFrom(builder.counts);
+	  const WaveState s = pushWave(toPick);
+	  buildSymmetricOnly();
+	  popWave(s);
 	}
 
 	for(uint8_t i = 0; i < toPick; i++)
@@ -2672,9 +2989,9 @@ namespace rectilinear {
     addWaveToNeighbours(-1);
   }
 
-  Lemma4Info::Lemma4Info() : cacheToken(0), computedToken(0), count(0) {}
+  Lemma4Info::Lemma4Info() : count(0) {}
   Lemma4Info::Lemma4Info(const Lemma4Info &x) : cacheToken(x.cacheToken), computedToken(x.computedToken), count(x.count){}
-  Lemma4Info::Lemma4Info(Token cacheToken, Token computedToken, uint64_t count) : cacheToken(cacheToken), computedToken(computedToken), count(count) {}
+  Lemma4Info::Lemma4Info(const PackedToken &cacheToken, const PackedToken &computedToken, uint64_t count) : cacheToken(cacheToken), computedToken(computedToken), count(count) {}
 
   /*
     Overview of Lemma 4 approach:
@@ -2687,7 +3004,7 @@ namespace rectilinear {
     std::vector<LayerBrick> v;
     findPotentialBricksForNextWave(v);
     std::sort(v.begin(), v.end());
-    const Token baseToken = maxCombination.getTokenFromLayerSizes();
+    const PackedToken baseToken = PackedToken::fromDecimal(maxCombination.getTokenFromLayerSizes());
     uint8_t base = baseCombination.layerSizes[0];
 
     // Perform computations:
@@ -2703,14 +3020,14 @@ namespace rectilinear {
       waveSize = toPick;
       buildUsingLemma4ForSize2Plus(Q, v, baseToken, m, toPick);
     }
-    buildUsingLemma4ForSize1(Q, v, baseToken, m);
+    buildUsingLemma4ForSize1(Q, v, m);
 
     // Reset:
     waveStart = 0;
     waveSize = base;
   }
 
-  void CombinationBuilder::buildUsingLemma4ForSizeMax(const std::vector<LayerBrick> &v, const Token baseToken, Lemma4CacheMap &m, const uint8_t toPick) {
+  void CombinationBuilder::buildUsingLemma4ForSizeMax(const std::vector<LayerBrick> &v, const PackedToken &baseToken, Lemma4CacheMap &m, const uint8_t toPick) {
     // Pick toPick from v:
     BrickPicker picker(v, 0, toPick);
     uint8_t baseSize = baseCombination.size;
@@ -2727,22 +3044,22 @@ namespace rectilinear {
 #ifdef TRACE
       std::cout << "  Build for size max " << (int)toPick << " of base " << baseCombination << " normalized: " << Base(normalizedSecondLayer) << std::endl;
 #endif
-      for(CountsMap::const_iterator it = b.counts.begin(); it != b.counts.end(); it++) {
-	Token cacheToken = it->first;
-	for(uint8_t i = 0; i < toPick; i++) {
-	  colors[toPick-1-i] = cacheToken%10;
-	  cacheToken/=10;
-	}
-	cacheToken = 0;
+      for(int rank = 0; rank < b.counts.size(); rank++) {
+	const Counts &c = b.counts[rank];
+	if(c.all == 0)
+	  continue;
+	const PackedToken computedToken = b.counts.getPackedToken(rank);
+	for(uint8_t i = 0; i < toPick; i++)
+	  colors[toPick-1-i] = computedToken.fromRight(i);
+	PackedToken cacheToken;
 	for(uint8_t i = 0; i < toPick; i++) {
 	  uint8_t color = colors[normalizedSecondLayer.bricks[i].second];
-	  cacheToken = 10*cacheToken + color;
+	  cacheToken = cacheToken.append(color);
 	}
-	Token computedToken = it->first;
-	counts[computedToken] += it->second;
-	m[secondLayer].push_back(Lemma4Info(cacheToken, computedToken, it->second.all));
+	counts.get(computedToken) += c;
+	m[secondLayer].push_back(Lemma4Info(cacheToken, computedToken, c.all));
 #ifdef TRACE
-	std::cout << "   computed " << computedToken << " -> cache " << cacheToken << " : " << it->second << std::endl; 
+	std::cout << "   computed " << computedToken.toDecimal() << " -> cache " << cacheToken.toDecimal() << " : " << c << std::endl; 
 #endif
       }
 
@@ -2752,7 +3069,7 @@ namespace rectilinear {
     addWaveToNeighbours(-1);
   }
 
-  void CombinationBuilder::buildUsingLemma4ForSize2Plus(Lemma4CacheManager &Q, const std::vector<LayerBrick> &v, const Token baseToken, Lemma4CacheMap &m, const uint8_t toPick) {
+  void CombinationBuilder::buildUsingLemma4ForSize2Plus(Lemma4CacheManager &Q, const std::vector<LayerBrick> &v, const PackedToken &baseToken, Lemma4CacheMap &m, const uint8_t toPick) {
     // Pick toPick from v:
     BrickPicker picker(v, 0, toPick);
     while(picker.next(baseCombination, maxCombination)) {
@@ -2762,15 +3079,17 @@ namespace rectilinear {
       Base secondLayer(baseCombination, 1);
       CBase normalizedSecondLayer(secondLayer);
       normalizedSecondLayer.normalize();
-      CountsMap X; // Contains counts built from secondLayer as base
+      EncodingCounts X; // Contains counts built from secondLayer as base
       Q.computeOrGet(Base(normalizedSecondLayer), X, neighbours);
 
       // Add X to counts and cache for later:
-      for(CountsMap::const_iterator it = X.begin(); it != X.end(); it++) {
-	const Token &cacheToken = it->first;
-	const uint64_t &count = it->second.all;
-	const Token computedToken = Q.computeToken(baseCombination, normalizedSecondLayer, cacheToken, baseToken);
-	counts[computedToken].all += count; // Adding
+      for(int rank = 0; rank < X.size(); rank++) {
+	const uint64_t &count = X[rank].all;
+	if(count == 0)
+	  continue;
+	const PackedToken cacheToken = X.getPackedToken(rank);
+	const PackedToken computedToken = Q.computeToken(baseCombination, normalizedSecondLayer, cacheToken, baseToken);
+	counts.get(computedToken).all += count; // Adding
 	m[secondLayer].push_back(Lemma4Info(cacheToken, computedToken, count)); // Caching
       }
 
@@ -2809,11 +3128,11 @@ namespace rectilinear {
 
 	  for(InfoVector::const_iterator it = iv.begin(); it != iv.end(); it++) {
 	    const Lemma4Info &info = *it;
-	    const Token &T = info.cacheToken;
+	    const PackedToken &T = info.cacheToken;
 	    InfoVector &iv2 = m[secondLayer];
 	    bool anyZero = false;
 	    for(InfoVector::iterator it2 = iv2.begin(); it2 != iv2.end(); it2++) {
-	      const Token &t = it2->cacheToken; // Check if big T from X had over-counting:
+	      const PackedToken &t = it2->cacheToken; // Check if big T from X had over-counting:
 	      if(Q.didSmallerBaseContribute(t,
 					    T,
 					    normalizedSecondLayer,
@@ -2824,8 +3143,8 @@ namespace rectilinear {
 		it2->count -= info.count;
 		if(it2->count == 0)
 		  anyZero = true;
-		assert(counts[it2->computedToken].all >= info.count);
-		counts[it2->computedToken].all -= info.count;
+		assert(counts.get(it2->computedToken).all >= info.count);
+		counts.get(it2->computedToken).all -= info.count;
 	      }
 	    } // for InfoVector iv2
 
@@ -2856,9 +3175,9 @@ namespace rectilinear {
     - The normalized base consists of FirstBrick.
     - Cache X can be reused for all.
    */
-  void CombinationBuilder::buildUsingLemma4ForSize1(Lemma4CacheManager &Q, const std::vector<LayerBrick> &v, const Token baseToken, Lemma4CacheMap &m) {
+  void CombinationBuilder::buildUsingLemma4ForSize1(Lemma4CacheManager &Q, const std::vector<LayerBrick> &v, Lemma4CacheMap &m) {
     uint64_t XCount = Q.getBase1Counts().all;
-    std::map<Brick,Token> brickToToken; // Used to count "down" later
+    std::map<Brick,int> brickToRank; // Rank of encoding in counts. Used to count "down" later
 
     // Count up:
     for(std::vector<LayerBrick>::const_iterator it = v.begin(); it != v.end(); it++) {
@@ -2869,19 +3188,19 @@ namespace rectilinear {
       secondLayer.bricks[0] = it->first;
 
       // Add X to counts:
-      const Token computedToken = baseCombination.encodeConnectivity(baseToken);
-      brickToToken[it->first] = computedToken;
-      counts[computedToken].all += XCount;
+      const int computedRank = baseCombination.rankConnectivity();
+      brickToRank[it->first] = computedRank;
+      counts[computedRank].all += XCount;
 
       // Clean up base combination:
       baseCombination.removeLastBrick();
     }
 
     // Quick lookup for all ones:
-    Token allOnes[MAX_LAYER_SIZE];
-    allOnes[0] = 11;
+    PackedToken allOnes[MAX_LAYER_SIZE];
+    allOnes[0] = PackedToken::fromDecimal(11);
     for(int i = 1; i < MAX_LAYER_SIZE; i++)
-      allOnes[i] = 10*allOnes[i-1]+1;
+      allOnes[i] = allOnes[i-1].append(1);
 
     // Count down:
     for(Lemma4CacheMap::const_iterator it = m.begin(); it != m.end(); it++) {
@@ -2892,7 +3211,7 @@ namespace rectilinear {
 	const Lemma4Info &info = *it2;
 	if(info.cacheToken == allOnes[biggerBase.layerSize-2]) {
 	  for(uint8_t i = 0; i < biggerBase.layerSize; i++) {
-	    counts[brickToToken[biggerBase.bricks[i]]].all -= info.count;
+	    counts[brickToRank[biggerBase.bricks[i]]].all -= info.count;
 	  }
 	  break; // Token with all ones handled
 	}
@@ -2900,62 +3219,488 @@ namespace rectilinear {
     }
   }
 
-  SplitBuildingBuilder::SplitBuildingBuilder() : neighbours(NULL), baseCombination(NULL), maxCombination(NULL), manager(NULL), threadName("") {}
+  Journal::Journal(const std::string &fileName, const Token token, const int shardIndex, const int shardCount, const int depth, const int batchSize, const double syncSeconds) : fd(-1), valid(false), depth(depth), batchSize(batchSize), syncSeconds(syncSeconds), buffered(0), timePrevSync(std::chrono::steady_clock::now()) {
+    assert(depth == 1 || depth == 2);
+    std::stringstream header;
+    header << "J " << token << " " << shardIndex << " " << shardCount << " " << depth;
+
+    // Load completed units line by line:
+    std::ifstream istream(fileName.c_str());
+    const bool exists = istream.good();
+    std::string line;
+    bool first = true;
+    int dropped = 0; // Lines torn, corrupt or obsolete
+    while(std::getline(istream, line)) {
+      if(istream.eof())
+	dropped++; // Line torn by crash is rewritten below if it is valid
+      if(first) {
+	first = false;
+	if(line != header.str()) {
+	  std::cerr << "Journal " << fileName << " is for another run: " << line << std::endl;
+	  return;
+	}
+	continue;
+      }
+      int base, unit;
+      unsigned long long all, symmetric180, symmetric90, sum;
+      if(sscanf(line.c_str(), "U %d %d %llu %llu %llu %llu", &base, &unit, &all, &symmetric180, &symmetric90, &sum) != 6) {
+	dropped++;
+	continue;
+      }
+      Counts c(all, symmetric180, symmetric90);
+      char fields[96];
+      formatFields(base, unit, c, fields);
+      if(FNV1a::hash64((const uint8_t*)fields, strlen(fields)) != sum) {
+	dropped++; // Corrupt
+	continue;
+      }
+      completed[std::make_pair(base, unit)] = c;
+    }
+    istream.close();
+
+    // Units of completed bases are obsolete:
+    std::map<std::pair<int,int>,Counts>::iterator it = completed.begin();
+    while(it != completed.end()) {
+      std::map<std::pair<int,int>,Counts>::iterator next = it;
+      next++;
+      if(it->first.second >= 0 && completed.find(std::make_pair(it->first.first, -1)) != completed.end()) {
+	completed.erase(it);
+	dropped++;
+      }
+      it = next;
+    }
+
+    if(dropped > 0) {
+      // Compact: Write the records kept to a new file and replace the journal by it:
+      const std::string compactedFileName = fileName + ".compact";
+      fd = open(compactedFileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if(fd < 0) {
+	std::cerr << "Unable to compact journal " << fileName << std::endl;
+	return;
+      }
+      buffer += header.str() + "\n";
+      for(it = completed.begin(); it != completed.end(); it++)
+	formatLine(it->first.first, it->first.second, it->second, buffer);
+      writeBuffer(true);
+      close(fd);
+      fd = -1;
+      if(rename(compactedFileName.c_str(), fileName.c_str()) != 0) {
+	std::cerr << "Unable to replace journal " << fileName << " by " << compactedFileName << std::endl;
+	return;
+      }
+    }
+
+    fd = open(fileName.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if(fd < 0) {
+      std::cerr << "Unable to open journal " << fileName << std::endl;
+      return;
+    }
+    if(!exists || first) {
+      buffer += header.str() + "\n"; // New journal
+      writeBuffer(true);
+    }
+    valid = true;
+  }
+
+  Journal::~Journal() {
+    if(fd < 0)
+      return;
+    flush();
+    close(fd);
+  }
+
+  void Journal::writeBuffer(bool sync) {
+    const char *data = buffer.data();
+    size_t left = buffer.size();
+    while(left > 0) {
+      ssize_t written = write(fd, data, left);
+      if(written < 0) {
+	std::cerr << "Error writing to journal" << std::endl;
+	break;
+      }
+      data += written;
+      left -= written;
+    }
+    buffer.clear();
+    buffered = 0;
+    if(sync) {
+      fsync(fd);
+      timePrevSync = std::chrono::steady_clock::now();
+    }
+  }
+
+  bool Journal::ok() const {
+    return valid;
+  }
+
+  int Journal::getDepth() const {
+    return depth;
+  }
+
+  int Journal::size() const {
+    return (int)completed.size();
+  }
+
+  bool Journal::get(const int base, const int unit, Counts &c) const {
+    std::map<std::pair<int,int>,Counts>::const_iterator it = completed.find(std::make_pair(base, unit));
+    if(it == completed.end())
+      return false;
+    c = it->second;
+    return true;
+  }
+
+  // snprintf rather than streams, as this is called for each completed unit:
+  void Journal::formatFields(const int base, const int unit, const Counts &c, char *fields) {
+    snprintf(fields, 96, "%d %d %llu %llu %llu", base, unit, (unsigned long long)c.all, (unsigned long long)c.symmetric180, (unsigned long long)c.symmetric90);
+  }
+
+  void Journal::formatLine(const int base, const int unit, const Counts &c, std::string &out) {
+    char fields[96], line[128];
+    formatFields(base, unit, c, fields);
+    snprintf(line, sizeof(line), "U %s %llu\n", fields, (unsigned long long)FNV1a::hash64((const uint8_t*)fields, strlen(fields)));
+    out += line;
+  }
+
+  void Journal::add(const int base, const int unit, const Counts &c) {
+    if(unit >= 0 && c.all < JOURNAL_MIN_UNIT_COUNT)
+      return; // Recounting is cheaper. Journaled as part of the base
+    TimedLock guard(mutex);
+    formatLine(base, unit, c, buffer);
+    buffered++;
+    std::chrono::duration<double, std::ratio<1> > sinceSync(std::chrono::steady_clock::now() - timePrevSync);
+    const bool sync = sinceSync.count() >= syncSeconds;
+    if(sync || buffered >= batchSize)
+      writeBuffer(sync);
+  }
+
+  void Journal::flush() {
+    std::lock_guard<std::mutex> guard(mutex);
+    writeBuffer(true);
+  }
+
+  SplitUnit::SplitUnit(const int base, const int index) : base(base), index(index), outstanding(1) {}
+
+  SplitTask::SplitTask() : waveStart(0), waveSize(0), slot(0), unit(NULL) {}
+
+  SplitTask::SplitTask(const Combination &c, const uint8_t waveStart, const uint8_t waveSize, const int slot, SplitUnit *unit) : c(c), waveStart(waveStart), waveSize(waveSize), slot(slot), unit(unit) {}
+
+  SplitWorker::SplitWorker() : pool(NULL), threadName(""), blockersSize(0), thread(NULL) {
+    for(uint8_t i = 0; i < MAX_HEIGHT; i++)
+      neighbours[i].reset();
+  }
+
+  void SplitWorker::run() {
+    SplitTask t;
+    while(true) {
+      if(pool->take(t, this)) {
+	runTask(t);
+	pool->complete(t.slot);
+      }
+      else if(!pool->waitForWork()) {
+	setBlockers(blockers, 0); // Clean up
+	return; // Pool is stopping
+      }
+    }
+  }
+
+  /*
+    Mark the first 'size' bricks of c in neighbours unless they are already marked.
+   */
+  void SplitWorker::setBlockers(const Combination &c, const uint8_t size) {
+    bool same = size == blockersSize;
+    for(uint8_t i = 0; same && i < size; i++) {
+      const BrickIdentifier &h = c.history[i];
+      same = h == blockers.history[i] && c.bricks[h.first][h.second] == blockers.bricks[h.first][h.second];
+    }
+    if(same)
+      return;
+    if(blockersSize > 0) {
+      NonEncodingCombinationBuilder old(blockers, 0, blockersSize, neighbours, pool->maxCombination);
+      old.addWaveToNeighbours(-1);
+    }
+    blockers.copy(c);
+    blockersSize = size;
+    if(blockersSize > 0) {
+      NonEncodingCombinationBuilder b0(blockers, 0, blockersSize, neighbours, pool->maxCombination);
+      b0.addWaveToNeighbours(1);
+    }
+  }
+
+  void SplitWorker::runTask(const SplitTask &t) {
+    Combination const * maxCombination = pool->maxCombination;
+    setBlockers(t.c, t.waveStart);
+    NonEncodingCombinationBuilder b(t.c, t.waveStart, t.waveSize, neighbours, maxCombination, this, t.slot, t.unit);
 
-  SplitBuildingBuilder::SplitBuildingBuilder(const SplitBuildingBuilder &b) : neighbours(b.neighbours), baseCombination(b.baseCombination), maxCombination(b.maxCombination), manager(b.manager), threadName(b.threadName) {}
+    if(maxCombination->size >= 9 &&
+       t.c.size >= 4 &&
+       t.c.size <= 6 &&
+       threadName[0] == 'A')
+      std::cout << " " << threadName << " builds on " << t.c << " up to " << (int)maxCombination->size << std::endl;
+    // Behold! The beautiful C++ 11 types for elapsed time...
+    std::chrono::duration<double, std::ratio<60> > duration(std::chrono::steady_clock::now() - timePrev);
+    if(duration > std::chrono::duration<double, std::ratio<60> >(1)) {
+      std::chrono::duration<double, std::ratio<60> > fullDuration(std::chrono::steady_clock::now() - timeStart);
+      std::cout << "Time elapsed: " << fullDuration.count() << " minutes for " << t.c << std::endl;
+      timePrev = std::chrono::steady_clock::now();
+    }
+
+    std::chrono::time_point<std::chrono::steady_clock> taskStart = std::chrono::steady_clock::now();
+    Counts c = b.build();
+    std::chrono::duration<double, std::micro> taskDuration(std::chrono::steady_clock::now() - taskStart);
+    pool->addCost(t.c.size, (uint64_t)taskDuration.count());
+    counts[t.slot] += c;
+    if(t.unit != NULL)
+      pool->completeUnit(t.unit, c);
+  }
+
+  bool SplitWorker::pop(SplitTask &t) {
+    TimedLock guard(mutex);
+    if(tasks.empty())
+      return false;
+    t = tasks.back();
+    tasks.pop_back();
+    return true;
+  }
 
-  SplitBuildingBuilder::SplitBuildingBuilder(BrickPlane *neighbours,
-					     Combination *baseCombination,
-					     Combination const * maxCombination,
-					     NormalBuildingManager *manager,
-					     int threadIndex) : neighbours(neighbours), baseCombination(baseCombination), maxCombination(maxCombination), manager(manager) {
+  bool SplitWorker::steal(SplitTask &t) {
+    TimedLock guard(mutex);
+    if(tasks.empty())
+      return false;
+    t = tasks.front();
+    tasks.pop_front();
+    return true;
+  }
+
+  SplitWorkerPool::SplitWorkerPool(const int workerCount, Combination const * maxCombination, Journal *journal) : workerCount(workerCount), queued(0), idle(0), nextWorker(0), shardIndex(0), shardCount(1), unitBase(0), unitIndex(0), stopping(false), maxCombination(maxCombination), journal(journal) {
+    assert(workerCount >= 1);
+    for(int i = 0; i <= MAX_BRICKS; i++) {
+      costMicros[i] = 0;
+      costSamples[i] = 0;
+    }
+    for(int i = 0; i < MAX_ACTIVE_BASES; i++) {
+      outstanding[i] = 0;
+      inUse[i] = false;
+    }
     std::string names[26] = {
       "Alma", "Bent", "Coco", "Dolf", "Edna", "Finn", "Gaya", "Hans", "Inge", "Jens",
       "Kiki", "Liam", "Mona", "Nils", "Olga", "Pino", "Qing", "Rene", "Sara", "Thor",
       "Ulla", "Vlad", "Wini", "Xiao", "Yrsa", "Zorg"};
-    threadName = names[threadIndex % 26];
-    if(threadIndex >= 26) {
-      std::stringstream ss; ss << threadName << (threadIndex/26);
-      threadName = ss.str();
+    workers = new SplitWorker[workerCount];
+    for(int i = 0; i < workerCount; i++) {
+      workers[i].pool = this;
+      workers[i].threadName = names[i % 26];
+      if(i >= 26) {
+	std::stringstream ss; ss << workers[i].threadName << (i/26);
+	workers[i].threadName = ss.str();
+      }
     }
+    for(int i = 0; i < workerCount; i++)
+      workers[i].thread = new std::thread(&SplitWorker::run, &workers[i]);
   }
 
-  int NonEncodingCombinationBuilder::addFrom(NormalBuildingManager *manager, const std::string &threadName) {
-    waveSize = manager->next(baseCombination, *maxCombination);
-    if(waveSize > 0 &&
-       maxCombination->size >= 9 &&
-       baseCombination.size >= 4 &&
-       baseCombination.size <= 6 &&
-       threadName[0] == 'A')
-      std::cout << " " << threadName << " builds on " << baseCombination << " up to " << (int)maxCombination->size << std::endl;
-    return waveSize;
+  SplitWorkerPool::~SplitWorkerPool() {
+    {
+      std::lock_guard<std::mutex> guard(mutex);
+      stopping = true;
+    }
+    workAvailable.notify_all();
+    for(int i = 0; i < workerCount; i++) {
+      workers[i].thread->join();
+      delete workers[i].thread;
+    }
+    delete[] workers;
   }
 
-  void NonEncodingCombinationBuilder::countAndRemoveFrom(NormalBuildingManager *manager, const Counts &counts, int toRemove) {
-    manager->add(counts); // Mutex protected
-    for(int i = 0; i < toRemove; i++)
-      baseCombination.removeLastBrick();
+  void SplitWorkerPool::setShard(const int shardIndex, const int shardCount) {
+    assert(shardIndex >= 0 && shardIndex < shardCount);
+    this->shardIndex = shardIndex;
+    this->shardCount = shardCount;
   }
 
-  void SplitBuildingBuilder::build() {
-    NonEncodingCombinationBuilder b0(*baseCombination, 0, baseCombination->size, neighbours, maxCombination); // Just used to mark initial bricks
-    b0.addWaveToNeighbours(1); // Adds blockers to neighbours for baseCombination
-    NonEncodingCombinationBuilder b(*baseCombination, baseCombination->size, 0, neighbours, maxCombination);
+  void SplitWorkerPool::beginBase(const int baseIndex) {
+    unitBase = baseIndex;
+    unitIndex = 0;
+  }
+
+  /*
+    Work units are the direct count and the tasks pushed by the producer for each base.
+    Unit j of base i belongs to shard (i+j) % shardCount. As bases are enumerated in the same
+    order by all shards, this does not depend on which bases have partials files.
+   */
+  bool SplitWorkerPool::nextUnit(int &unit) {
+    unit = unitIndex++;
+    return (unitBase + unit) % shardCount == shardIndex;
+  }
+
+  bool SplitWorkerPool::getJournaled(const int unit, Counts &c) const {
+    return journal != NULL && journal->getDepth() == 2 && journal->get(unitBase, unit, c);
+  }
+
+  void SplitWorkerPool::journalUnit(const int unit, const Counts &c) {
+    if(journal != NULL && journal->getDepth() == 2)
+      journal->add(unitBase, unit, c);
+  }
 
-    int picked;
-    while((picked = b.addFrom(manager, threadName)) > 0) {
-      // Behold! The beautiful C++ 11 types for elapsed time...
-      std::chrono::duration<double, std::ratio<60> > duration(std::chrono::steady_clock::now() - timePrev);
-      if(duration > std::chrono::duration<double, std::ratio<60> >(1)) {
-	std::chrono::duration<double, std::ratio<60> > fullDuration(std::chrono::steady_clock::now() - timeStart);
-	std::cout << "Time elapsed: " << fullDuration.count() << " minutes for " << b.baseCombination << std::endl;
-	timePrev = std::chrono::steady_clock::now();
+  void SplitWorkerPool::pushUnit(const SplitTask &t, Counts &journaled) {
+    int unit;
+    if(!nextUnit(unit))
+      return; // Another shard
+    if(journal == NULL || journal->getDepth() != 2) {
+      push(t);
+      return;
+    }
+    Counts c;
+    if(getJournaled(unit, c)) {
+      journaled += c; // Completed before restart
+      return;
+    }
+    SplitTask t2(t);
+    t2.unit = new SplitUnit(unitBase, unit);
+    push(t2);
+  }
+
+  void SplitWorkerPool::completeUnit(SplitUnit *unit, const Counts &c) {
+    {
+      TimedLock guard(unit->mutex);
+      unit->counts += c;
+    }
+    if(--unit->outstanding == 0) {
+      journal->add(unit->base, unit->index, unit->counts);
+      delete unit;
+    }
+  }
+
+  int SplitWorkerPool::acquireSlot() {
+    for(int i = 0; i < MAX_ACTIVE_BASES; i++) {
+      if(!inUse[i]) {
+	inUse[i] = true;
+	outstanding[i] = 1; // Held until release()
+	return i;
       }
-      Counts c = b.build();
-      b.countAndRemoveFrom(manager, c, picked);
     }
+    return -1;
+  }
+
+  void SplitWorkerPool::push(const SplitTask &t) {
+    assert(inUse[t.slot]);
+    const int limit = workerCount * SPLIT_TASKS_PER_WORKER;
+    if(queued >= limit) {
+      // Wait for the queues to be half empty, so the producer is not woken for each task:
+      std::unique_lock<std::mutex> lock(mutex);
+      spaceAvailable.wait(lock, [this, limit]{ return queued <= limit/2; });
+    }
+    pushTo(t, workers[nextWorker]);
+    nextWorker = (nextWorker + 1) % workerCount;
+  }
 
-    b0.addWaveToNeighbours(-1); // Clean up
+  void SplitWorkerPool::publish(const SplitTask &t, SplitWorker *w) {
+    pushTo(t, *w);
+  }
+
+  void SplitWorkerPool::pushTo(const SplitTask &t, SplitWorker &w) {
+    outstanding[t.slot]++;
+    {
+      TimedLock guard(w.mutex);
+      w.tasks.push_back(t);
+    }
+    queued++;
+    {
+      std::lock_guard<std::mutex> guard(mutex); // Ensure a worker about to wait sees the task
+    }
+    workAvailable.notify_one();
+  }
+
+  /*
+    Split when workers are idle, unless tasks of this size have been observed to be too small to be worth it.
+    The deepest split is leaving 2 bricks to place, as placing the last brick is done directly by Simon.
+   */
+  bool SplitWorkerPool::shouldSplit(const uint8_t size) const {
+    if(idle.load(std::memory_order_relaxed) <= queued.load(std::memory_order_relaxed))
+      return false; // No worker would be left idle
+    if(size + 2 > maxCombination->size)
+      return false;
+    const uint64_t samples = costSamples[size].load(std::memory_order_relaxed);
+    if(samples < SPLIT_MIN_SAMPLES)
+      return true; // Explore
+    return costMicros[size].load(std::memory_order_relaxed) >= SPLIT_MIN_MICROS * samples;
+  }
+
+  void SplitWorkerPool::addCost(const uint8_t size, const uint64_t micros) {
+    costMicros[size].fetch_add(micros, std::memory_order_relaxed);
+    costSamples[size].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void SplitWorkerPool::release(const int slot) {
+    complete(slot);
+  }
+
+  void SplitWorkerPool::complete(const int slot) {
+    if(--outstanding[slot] == 0) {
+      std::lock_guard<std::mutex> guard(mutex);
+      slotDone.notify_all();
+    }
+  }
+
+  Counts SplitWorkerPool::collect(const int slot) {
+    assert(inUse[slot]);
+    {
+      std::chrono::time_point<std::chrono::steady_clock> timeStart { std::chrono::steady_clock::now() };
+      std::unique_lock<std::mutex> lock(mutex);
+      slotDone.wait(lock, [this, slot]{ return outstanding[slot] == 0; });
+      WaitStatistics::joinWait += WaitStatistics::nanosSince(timeStart);
+    }
+    Counts ret;
+    for(int i = 0; i < workerCount; i++) {
+      ret += workers[i].counts[slot];
+      workers[i].counts[slot].reset();
+    }
+    inUse[slot] = false;
+    return ret;
+  }
+
+  bool SplitWorkerPool::take(SplitTask &t, SplitWorker *w) {
+    bool ok = w->pop(t);
+    const int idx = (int)(w - workers);
+    for(int i = 1; !ok && i < workerCount; i++)
+      ok = workers[(idx + i) % workerCount].steal(t);
+    if(!ok)
+      return false;
+    if(queued-- == workerCount * SPLIT_TASKS_PER_WORKER / 2 + 1) {
+      std::lock_guard<std::mutex> guard(mutex);
+      spaceAvailable.notify_one();
+    }
+    return true;
+  }
+
+  bool SplitWorkerPool::waitForWork() {
+    std::chrono::time_point<std::chrono::steady_clock> timeStart { std::chrono::steady_clock::now() };
+    std::unique_lock<std::mutex> lock(mutex);
+    idle++;
+    workAvailable.wait(lock, [this]{ return queued > 0 || stopping; });
+    idle--;
+    WaitStatistics::idle += WaitStatistics::nanosSince(timeStart);
+    return queued > 0 || !stopping;
+  }
+
+  /*
+    Counts of a base in the pool: Write partials file if big enough and add to manager.
+   */
+  static void finishBase(SplitWorkerPool &pool, const int slot, const int baseIndex, const Combination &base, const Counts &direct, const std::string &partialFileName, BaseBuildingManager &manager) {
+    Counts countsSplit = pool.collect(slot);
+    countsSplit += direct;
+    if(pool.journal != NULL)
+      pool.journal->add(baseIndex, -1, countsSplit);
+    if(countsSplit.all > 10000000) {
+      std::ofstream oStream(partialFileName.c_str());
+      oStream << countsSplit.all << std::endl;
+      oStream << countsSplit.symmetric180 << std::endl;
+      oStream << countsSplit.symmetric90 << std::endl;
+      oStream.flush();
+      oStream.close();
+      std::cout << "Wrote " << partialFileName << std::endl;
+    }
+    manager.add(base, countsSplit);
+    Telemetry::countUnit();
   }
 
   /*
@@ -2965,6 +3710,17 @@ namespace rectilinear {
   Counts NonEncodingCombinationBuilder::buildWithPartials(int threadCount, const Combination &maxCombination) {
     if(maxCombination.size == 1)
       return Counts(1,1,0);
+    return finalizeCounts(buildShard(threadCount, maxCombination, 0, 1, NULL), maxCombination);
+  }
+
+  /*
+    Shards partition the work units (see SplitWorkerPool::nextUnit()).
+    All shards run the same BaseBuildingManager, so bases deduplicated by mirroring are weighted
+    the same in all shards, and the sum of the shards is the count of buildWithPartials() before finalizeCounts().
+   */
+  Counts NonEncodingCombinationBuilder::buildShard(int threadCount, const Combination &maxCombination, const int shardIndex, const int shardCount, Journal *journal) {
+    if(maxCombination.size == 1)
+      return shardIndex == 0 ? Counts(1,1,0) : Counts(); // (1,1,0) is unchanged by finalizeCounts()
     Combination baseCombination; // Has only FirstBrick
     int token = (int)maxCombination.getTokenFromLayerSizes();
 
@@ -2976,14 +3732,42 @@ namespace rectilinear {
     std::vector<LayerBrick> v;
     b1.findPotentialBricksForNextWave(v);
     b1.addWaveToNeighbours(1);
+    PROFILE_COUNT(1, nodes, 1);
+    PROFILE_CANDIDATES(1, v.size());
 
     const uint16_t leftToPlace = maxCombination.size - 1;
     Counts ret = b1.placeAllLeftToPlace(leftToPlace, v);
-
-    if(ret.all == 0) { // If ret > 0, then all remaining bricks could be placed on second layer
+    const bool placedAll = ret.all != 0; // If ret > 0, then all remaining bricks could be placed on second layer
+    PROFILE_COUNT(1, resolved, placedAll ? 1 : 0);
+    PROFILE_COUNT(1, recursed, placedAll ? 0 : 1);
+    if(shardIndex != 0)
+      ret.reset(); // Counted by first shard
+
+    if(!placedAll) {
+      if(Telemetry::isActive()) {
+	// Units of the ETA are the bases served by the manager:
+	BaseBuildingManager counter(v, maxCombination.layerSizes[1]);
+	uint64_t bases = 0;
+	uint8_t toPick;
+	while((toPick = counter.next(baseCombination, maxCombination)) != 0) {
+	  bases++;
+	  for(uint8_t i = 0; i < toPick; i++)
+	    baseCombination.removeLastBrick();
+	}
+	Telemetry::addUnitsTotal(bases);
+      }
       BaseBuildingManager manager(v, maxCombination.layerSizes[1]);
+      SplitWorkerPool pool(MAX(1, threadCount-1), &maxCombination, journal); // Run with at least 1 worker thread
+      pool.setShard(shardIndex, shardCount);
+      int baseIndex = -1;
+      int baseIndices[MAX_ACTIVE_BASES];
+      Combination bases[MAX_ACTIVE_BASES];
+      Counts direct[MAX_ACTIVE_BASES]; // Counts computed by the producer
+      std::string partialFileNames[MAX_ACTIVE_BASES];
+      std::deque<int> activeSlots; // Oldest first
       uint8_t picked;
       while((picked = manager.next(baseCombination, maxCombination)) != 0) {
+	PROFILE_COUNT(1, picks[picked], 1);
 	Counts countsSplit;
 
 	// Check if partial already exists:
@@ -3000,38 +3784,59 @@ namespace rectilinear {
 	    ss << (int)(b.x-FirstBrick.x) << "x" << (int)(b.y-FirstBrick.y);
 	  }
 	}
+	if(shardCount > 1)
+	  ss << "_shard_" << shardIndex << "_" << shardCount;
 	ss << ".txt";
 	std::string partialFileName = ss.str();
+	pool.beginBase(++baseIndex);
 	std::ifstream istream(partialFileName.c_str());
 
-	if(istream.good()) {
+	if(journal != NULL && journal->get(baseIndex, -1, countsSplit)) {
+	  // Base completed before restart:
+	  manager.add(baseCombination, countsSplit);
+	  Telemetry::countUnit();
+	}
+	else if(istream.good()) {
 	  // Partial file exists: Use it!
 	  istream >> countsSplit.all >> countsSplit.symmetric180 >> countsSplit.symmetric90;
 	  istream.close();
+	  manager.add(baseCombination, countsSplit);
+	  Telemetry::countUnit();
 	}
 	else {
-	  NonEncodingCombinationBuilder b2(baseCombination, 1, picked, neighbours, &maxCombination);
-	  countsSplit = b2.buildSplit(threadCount);
-	  // Write partials file if big enough:
-	  if(countsSplit.all > 10000000) {
-	    std::ofstream oStream(partialFileName.c_str());
-	    oStream << countsSplit.all << std::endl;
-	    oStream << countsSplit.symmetric180 << std::endl;
-	    oStream << countsSplit.symmetric90 << std::endl;
-	    oStream.flush();
-	    oStream.close();
-	    std::cout << "Wrote " << partialFileName << std::endl;
+	  int slot;
+	  while((slot = pool.acquireSlot()) < 0) {
+	    // All slots in use: Wait for the oldest base:
+	    const int oldest = activeSlots.front();
+	    activeSlots.pop_front();
+	    finishBase(pool, oldest, baseIndices[oldest], bases[oldest], direct[oldest], partialFileNames[oldest], manager);
 	  }
+	  baseIndices[slot] = baseIndex;
+	  bases[slot].copy(baseCombination);
+	  partialFileNames[slot] = partialFileName;
+	  NonEncodingCombinationBuilder b2(baseCombination, 1, picked, neighbours, &maxCombination);
+	  direct[slot] = b2.buildSplit(pool, slot);
+	  pool.release(slot);
+	  activeSlots.push_back(slot);
 	}
 
-	manager.add(baseCombination, countsSplit);
 	for(uint8_t i = 0; i < picked; i++)
 	  baseCombination.removeLastBrick();
       }
+      while(!activeSlots.empty()) {
+	const int oldest = activeSlots.front();
+	activeSlots.pop_front();
+	finishBase(pool, oldest, baseIndices[oldest], bases[oldest], direct[oldest], partialFileNames[oldest], manager);
+      }
       ret += manager.getCounts();
     }
     b1.addWaveToNeighbours(-1); // Clean up
 
+    return ret;
+  }
+
+  Counts NonEncodingCombinationBuilder::finalizeCounts(const Counts &shardSum, const Combination &maxCombination) {
+    Counts ret(shardSum);
     // Fix final counts (see also CombinationBuilder::report()):
     const uint8_t ls0 = maxCombination.layerSizes[0];
     ret.symmetric180 += ret.symmetric90;
@@ -3051,43 +3856,455 @@ namespace rectilinear {
   }
 
   /*
-    Split building only from base <1>
+    Split building from a base on top of <1>:
+    Counts directly if all bricks can be placed in the next wave. Otherwise
+    each pick of the next wave is pushed as a task to the pool.
    */
-  Counts NonEncodingCombinationBuilder::buildSplit(int threadCount) {
+  Counts NonEncodingCombinationBuilder::buildSplit(SplitWorkerPool &pool, const int slot) {
     std::vector<LayerBrick> v;
     findPotentialBricksForNextWave(v);
     if(v.empty())
       return Counts();
 
+    Telemetry::countNode();
     const uint16_t leftToPlace = maxCombination->size - baseCombination.size;
-    Counts ret = placeAllLeftToPlace(leftToPlace, v);
-    if(ret.all != 0)
+    int unit;
+    const bool ownsDirect = pool.nextUnit(unit);
+    Counts ret;
+    if(ownsDirect && pool.getJournaled(unit, ret))
+      return ret; // Counted directly before restart
+    PROFILE_COUNT(baseCombination.size, nodes, 1);
+    PROFILE_CANDIDATES(baseCombination.size, v.size());
+    ret = placeAllLeftToPlace(leftToPlace, v);
+    if(ret.all != 0) {
+      PROFILE_COUNT(baseCombination.size, resolved, 1);
+      if(!ownsDirect)
+	return Counts(); // Counted by another shard
+      pool.journalUnit(unit, ret);
       return ret;
+    }
 
-    int workerCount = MAX(1, threadCount-1); // Run with at least 1 worker thread
-    NormalBuildingManager manager(v, leftToPlace-1); // Shared picker
-    BrickPlane *neighbourCache = new BrickPlane[workerCount * MAX_HEIGHT];
-    for(int i = 0; i < workerCount * MAX_HEIGHT; i++)
-      neighbourCache[i].reset();
-    SplitBuildingBuilder *threadBuilders = new SplitBuildingBuilder[workerCount];
-    std::thread **threads = new std::thread*[workerCount];
+    // Counts of units completed before a restart are added to ret:
+    PROFILE_COUNT(baseCombination.size, recursed, 1);
+    for(uint8_t toPick = 1; toPick < leftToPlace; toPick++) {
+      BrickPicker picker(v, 0, toPick);
+      while(picker.next(baseCombination, *maxCombination)) {
+	PROFILE_COUNT(baseCombination.size - toPick, picks[toPick], 1);
+	pool.pushUnit(SplitTask(baseCombination, baseCombination.size - toPick, toPick, slot, NULL), ret);
+	for(uint8_t i = 0; i < toPick; i++)
+	  baseCombination.removeLastBrick();
+      }
+    }
+    return ret;
+  }
 
-    for(int i = 0; i < workerCount; i++) {
-      threadBuilders[i] = SplitBuildingBuilder(&neighbourCache[i*MAX_HEIGHT],
-					       &baseCombination,
-					       maxCombination,
-					       &manager,
-					       i);
-      threads[i] = new std::thread(&SplitBuildingBuilder::build, std::ref(threadBuilders[i]));
+  TreeProbe::TreeProbe() : nodes(0), leaves(0), seconds(0), all(0), symmetric180(0), symmetric90(0) {
+  }
+
+  TreeProbe& TreeProbe::operator +=(const TreeProbe &p) {
+    nodes += p.nodes;
+    leaves += p.leaves;
+    seconds += p.seconds;
+    all += p.all;
+    symmetric180 += p.symmetric180;
+    symmetric90 += p.symmetric90;
+    return *this;
+  }
+
+  SampleStatistics::SampleStatistics() : n(0), mean(0), m2(0) {
+  }
+
+  void SampleStatistics::add(const double x) {
+    n++;
+    const double delta = x - mean;
+    mean += delta / n;
+    m2 += delta * (x - mean);
+  }
+
+  uint64_t SampleStatistics::size() const {
+    return n;
+  }
+
+  double SampleStatistics::getMean() const {
+    return mean;
+  }
+
+  double SampleStatistics::standardError() const {
+    if(n < 2)
+      return 0;
+    return sqrt(m2 / (n-1) / n);
+  }
+
+  double SampleStatistics::halfWidth95() const {
+    return 1.96 * standardError();
+  }
+
+  std::ostream& operator<<(std::ostream &os, const SampleStatistics &s) {
+    os << s.getMean() << " +- " << s.halfWidth95();
+    return os;
+  }
+
+  ThreadCounters::ThreadCounters() : nodes(0), leaves(0), simonCalls(0), unitsCompleted(0) {
+  }
+
+  std::mutex Telemetry::registryMutex;
+  std::vector<ThreadCounters*> Telemetry::registry;
+  std::atomic<uint64_t> Telemetry::unitsTotal(0);
+  std::atomic<int> Telemetry::reporters(0);
+  thread_local ThreadCounters *Telemetry::local = NULL;
+
+  ThreadCounters *Telemetry::registerThread() {
+    void *memory; // new does not align beyond alignof(std::max_align_t) before C++17
+    if(posix_memalign(&memory, alignof(ThreadCounters), sizeof(ThreadCounters)) != 0)
+      throw std::bad_alloc();
+    ThreadCounters *c = new(memory) ThreadCounters();
+    std::lock_guard<std::mutex> guard(registryMutex);
+    registry.push_back(c);
+    return c;
+  }
+
+  Telemetry::Telemetry(const std::string &fileName, const double intervalSeconds) :
+    stream(fileName.c_str(), std::ios::app),
+    intervalSeconds(intervalSeconds),
+    stopping(false),
+    reporter(NULL),
+    timeStart(std::chrono::steady_clock::now()),
+    previousSeconds(0),
+    previousNodes(0) {
+    if(!stream.good()) {
+      std::cerr << "Failed to open stats file " << fileName << std::endl;
+      return;
     }
-    for(int i = 0; i < workerCount; i++) {
-      threads[i]->join();
-      delete threads[i];
+    reporters++;
+    reporter = new std::thread(&Telemetry::run, this);
+  }
+
+  Telemetry::~Telemetry() {
+    if(reporter == NULL)
+      return;
+    {
+      std::lock_guard<std::mutex> guard(mutex);
+      stopping = true;
     }
-    delete[] threads;
-    delete[] threadBuilders;
-    delete[] neighbourCache;
-    ret = manager.getCounts();
+    stopRequested.notify_one();
+    reporter->join();
+    delete reporter;
+    reporters--;
+  }
+
+  bool Telemetry::ok() const {
+    return reporter != NULL;
+  }
+
+  void Telemetry::addUnitsTotal(const uint64_t units) {
+    unitsTotal += units;
+  }
+
+  bool Telemetry::isActive() {
+    return reporters > 0;
+  }
+
+  std::atomic<uint64_t> WaitStatistics::lockWait(0);
+  std::atomic<uint64_t> WaitStatistics::idle(0);
+  std::atomic<uint64_t> WaitStatistics::joinWait(0);
+  std::atomic<uint64_t> WaitStatistics::tail(0);
+
+  void WaitStatistics::reset() {
+    lockWait = idle = joinWait = tail = 0;
+  }
+
+  uint64_t WaitStatistics::nanosSince(const std::chrono::time_point<std::chrono::steady_clock> &t) {
+    std::chrono::duration<double, std::nano> duration(std::chrono::steady_clock::now() - t);
+    return (uint64_t)duration.count();
+  }
+
+  int Telemetry::sum(uint64_t &nodes, uint64_t &leaves, uint64_t &simonCalls, uint64_t &units) {
+    nodes = leaves = simonCalls = units = 0;
+    std::lock_guard<std::mutex> guard(registryMutex);
+    for(std::vector<ThreadCounters*>::const_iterator it = registry.begin(); it != registry.end(); it++) {
+      nodes += (*it)->nodes.load(std::memory_order_relaxed);
+      leaves += (*it)->leaves.load(std::memory_order_relaxed);
+      simonCalls += (*it)->simonCalls.load(std::memory_order_relaxed);
+      units += (*it)->unitsCompleted.load(std::memory_order_relaxed);
+    }
+    return (int)registry.size();
+  }
+
+  void Telemetry::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while(!stopRequested.wait_for(lock, std::chrono::duration<double>(intervalSeconds), [this]{ return stopping; }))
+      report(false);
+    report(true);
+  }
+
+  /*
+    One JSON line. Rates of nodes are for the last interval, while the rate of units is for the whole run,
+    as units vary too much in size for short intervals.
+   */
+  void Telemetry::report(const bool final) {
+    uint64_t nodes, leaves, simonCalls, units;
+    const int threads = sum(nodes, leaves, simonCalls, units);
+    std::chrono::duration<double, std::ratio<1> > duration(std::chrono::steady_clock::now() - timeStart);
+    const double seconds = duration.count();
+    const double interval = seconds - previousSeconds;
+    const uint64_t total = unitsTotal;
+
+    stream << "{\"seconds\":" << seconds
+	   << ",\"final\":" << (final ? "true" : "false")
+	   << ",\"threads\":" << threads
+	   << ",\"nodes\":" << nodes
+	   << ",\"leaves\":" << leaves
+	   << ",\"simonCalls\":" << simonCalls
+	   << ",\"unitsCompleted\":" << units
+	   << ",\"unitsRemaining\":";
+    if(total > 0)
+      stream << (total > units ? total - units : 0);
+    else
+      stream << "null";
+    stream << ",\"nodesPerSecond\":" << (interval > 0 ? (nodes - previousNodes) / interval : 0)
+	   << ",\"unitsPerSecond\":" << (seconds > 0 ? units / seconds : 0)
+	   << ",\"etaSeconds\":";
+    if(total > 0 && units > 0)
+      stream << (total > units ? (total - units) * seconds / units : 0);
+    else
+      stream << "null";
+    stream << "}" << std::endl;
+
+    previousSeconds = seconds;
+    previousNodes = nodes;
+  }
+
+#ifdef PROFILE
+  DepthProfile::DepthProfile() : nodes(0), resolved(0), recursed(0), candidates(0), maxCandidates(0), simonCalls(0), simonAll(0), simonValid(0), symmetricChecks(0), symmetricPasses(0), pickerChecks(0), rejectsFullLayer(0), rejectsIntersection(0) {
+    for(int i = 0; i < PROFILE_BUCKETS; i++)
+      candidateBuckets[i] = 0;
+    for(int i = 0; i < MAX_BRICKS; i++)
+      picks[i] = 0;
+  }
+
+  DepthProfile& DepthProfile::operator +=(const DepthProfile &p) {
+    nodes += p.nodes;
+    resolved += p.resolved;
+    recursed += p.recursed;
+    candidates += p.candidates;
+    maxCandidates = MAX(maxCandidates, p.maxCandidates);
+    for(int i = 0; i < PROFILE_BUCKETS; i++)
+      candidateBuckets[i] += p.candidateBuckets[i];
+    for(int i = 0; i < MAX_BRICKS; i++)
+      picks[i] += p.picks[i];
+    simonCalls += p.simonCalls;
+    simonAll += p.simonAll;
+    simonValid += p.simonValid;
+    symmetricChecks += p.symmetricChecks;
+    symmetricPasses += p.symmetricPasses;
+    pickerChecks += p.pickerChecks;
+    rejectsFullLayer += p.rejectsFullLayer;
+    rejectsIntersection += p.rejectsIntersection;
+    return *this;
+  }
+
+  std::mutex Profile::mutex;
+  std::vector<DepthProfile*> Profile::registry;
+  thread_local DepthProfile *Profile::local = NULL;
+
+  DepthProfile *Profile::registerThread() {
+    DepthProfile *p = new DepthProfile[MAX_BRICKS+1];
+    std::lock_guard<std::mutex> guard(mutex);
+    registry.push_back(p);
+    return p;
+  }
+
+  void Profile::countCandidates(const int depth, const size_t size) {
+    DepthProfile &p = at(depth);
+    p.candidates += size;
+    if(size > p.maxCandidates)
+      p.maxCandidates = size;
+    const int bucket = size == 0 ? 0 : MIN(PROFILE_BUCKETS-1, 64 - __builtin_clzll(size));
+    p.candidateBuckets[bucket]++;
+  }
+
+  static double ratio(const double a, const double b) {
+    return b == 0 ? 0 : a / b;
+  }
+
+  void Profile::report(std::ostream &os) {
+    DepthProfile sum[MAX_BRICKS+1];
+    int threads;
+    {
+      std::lock_guard<std::mutex> guard(mutex);
+      for(std::vector<DepthProfile*>::const_iterator it = registry.begin(); it != registry.end(); it++) {
+	for(int d = 0; d <= MAX_BRICKS; d++)
+	  sum[d] += (*it)[d];
+      }
+      threads = (int)registry.size();
+    }
+    os << "Profile by depth (bricks placed) from " << threads << " threads:" << std::endl;
+    os << "depth\tnodes\tresolved\trecursed\tavg|v|\tmax|v|\tsimon\toverlap\tsymmetric\tpicker\tfull\tintersect" << std::endl;
+    for(int d = 0; d <= MAX_BRICKS; d++) {
+      const DepthProfile &p = sum[d];
+      if(p.nodes == 0 && p.simonCalls == 0 && p.pickerChecks == 0)
+	continue;
+      os << d << "\t" << p.nodes
+	 << "\t" << ratio((double)p.resolved, (double)p.nodes)
+	 << "\t" << ratio((double)p.recursed, (double)p.nodes)
+	 << "\t" << ratio((double)p.candidates, (double)p.nodes)
+	 << "\t" << p.maxCandidates
+	 << "\t" << p.simonCalls
+	 << "\t" << ratio(p.simonAll - p.simonValid, p.simonAll) // Overlapping picks / all picks
+	 << "\t" << ratio((double)p.symmetricPasses, (double)p.symmetricChecks) << "/" << p.symmetricChecks
+	 << "\t" << p.pickerChecks
+	 << "\t" << ratio((double)p.rejectsFullLayer, (double)p.pickerChecks)
+	 << "\t" << ratio((double)p.rejectsIntersection, (double)p.pickerChecks) << std::endl;
+    }
+    os << "Histograms of |v| (buckets [2^(b-1),2^b)) and toPick by depth:" << std::endl;
+    for(int d = 0; d <= MAX_BRICKS; d++) {
+      const DepthProfile &p = sum[d];
+      if(p.nodes == 0)
+	continue;
+      os << d << " |v|:";
+      for(int i = 0; i < PROFILE_BUCKETS; i++)
+	os << " " << p.candidateBuckets[i];
+      os << " toPick:";
+      for(int i = 1; i < MAX_BRICKS; i++)
+	os << " " << p.picks[i];
+      os << std::endl;
+    }
+  }
+#endif
+
+  /*
+    Follows build(), but only recurses into one child drawn uniformly while enumerating the children (reservoir sampling).
+   */
+  void NonEncodingCombinationBuilder::probe(std::mt19937_64 &rng, const double weight, TreeProbe &p) {
+    std::chrono::time_point<std::chrono::steady_clock> timeStart { std::chrono::steady_clock::now() };
+    std::vector<LayerBrick> &v = candidates[depth];
+    v.clear();
+    findPotentialBricksForNextWave(v);
+
+    const uint8_t leftToPlace = maxCombination->size - baseCombination.size;
+    p.nodes += weight;
+    const Counts leafCounts = placeAllLeftToPlace(leftToPlace, v);
+    if(leafCounts.all != 0) {
+      p.leaves += weight;
+      p.all += weight * leafCounts.all;
+      p.symmetric180 += weight * leafCounts.symmetric180;
+      p.symmetric90 += weight * leafCounts.symmetric90;
+      std::chrono::duration<double, std::ratio<1> > duration(std::chrono::steady_clock::now() - timeStart);
+      p.seconds += weight * duration.count();
+      return;
+    }
+
+    addWaveToNeighbours(1);
+    uint64_t children = 0;
+    uint8_t toPickChosen = 0;
+    LayerBrick chosen[MAX_BRICKS];
+    for(uint8_t toPick = 1; toPick < leftToPlace; toPick++) {
+      BrickPicker picker(v, 0, toPick);
+
+      while(picker.next(baseCombination, *maxCombination)) {
+	children++;
+	if(std::uniform_int_distribution<uint64_t>(0, children-1)(rng) == 0) {
+	  toPickChosen = toPick;
+	  for(uint8_t i = 0; i < toPick; i++) {
+	    const BrickIdentifier &bi = baseCombination.history[baseCombination.size - toPick + i];
+	    chosen[i] = LayerBrick(baseCombination.bricks[bi.first][bi.second], bi.first);
+	  }
+	}
+	for(uint8_t i = 0; i < toPick; i++)
+	  baseCombination.removeLastBrick();
+      }
+    } // for toPick
+    std::chrono::duration<double, std::ratio<1> > duration(std::chrono::steady_clock::now() - timeStart);
+    p.seconds += weight * duration.count();
+
+    if(children == 0) {
+      p.leaves += weight;
+    }
+    else {
+      for(uint8_t i = 0; i < toPickChosen; i++)
+	baseCombination.addBrick(chosen[i]);
+      const uint8_t prevWaveStart = waveStart, prevWaveSize = waveSize;
+      waveStart += waveSize;
+      waveSize = toPickChosen;
+      depth++;
+      assert(depth < MAX_BRICKS);
+      probe(rng, weight * children, p);
+      depth--;
+      waveStart = prevWaveStart;
+      waveSize = prevWaveSize;
+      for(uint8_t i = 0; i < toPickChosen; i++)
+	baseCombination.removeLastBrick();
+    }
+    addWaveToNeighbours(-1);
+  }
+
+  TreeEstimator::TreeEstimator(const Combination &maxCombination, const uint64_t seed) :
+    maxCombination(maxCombination),
+    root(Combination(), 0, 1, neighbours, &maxCombination),
+    rng(seed) {
+    std::chrono::time_point<std::chrono::steady_clock> timeStart { std::chrono::steady_clock::now() };
+    for(uint8_t i = 0; i < MAX_HEIGHT; i++)
+      neighbours[i].reset();
+    rootProbe.nodes = 1;
+    if(maxCombination.size == 1) {
+      rootProbe.leaves = 1;
+      return;
+    }
+
+    std::vector<LayerBrick> v;
+    root.findPotentialBricksForNextWave(v);
+    root.addWaveToNeighbours(1); // Kept until destruction, as bases are built on top of the first brick
+
+    const uint16_t leftToPlace = maxCombination.size - 1;
+    const Counts rootCounts = root.placeAllLeftToPlace(leftToPlace, v);
+    if(rootCounts.all != 0) {
+      rootProbe.leaves = 1;
+      rootProbe.all = (double)rootCounts.all;
+      rootProbe.symmetric180 = (double)rootCounts.symmetric180;
+      rootProbe.symmetric90 = (double)rootCounts.symmetric90;
+    }
+    else {
+      // Bases as served to buildShard():
+      BaseBuildingManager manager(v, maxCombination.layerSizes[1]);
+      Combination baseCombination;
+      uint8_t toPick;
+      while((toPick = manager.next(baseCombination, maxCombination)) != 0) {
+	bases.push_back(baseCombination);
+	picked.push_back(toPick);
+	for(uint8_t i = 0; i < toPick; i++)
+	  baseCombination.removeLastBrick();
+      }
+      for(std::vector<Combination>::const_iterator it = bases.begin(); it != bases.end(); it++)
+	multiplicities.push_back(manager.getMultiplicity(*it));
+      if(bases.empty())
+	rootProbe.leaves = 1;
+    }
+    std::chrono::duration<double, std::ratio<1> > duration(std::chrono::steady_clock::now() - timeStart);
+    rootProbe.seconds = duration.count();
+  }
+
+  TreeEstimator::~TreeEstimator() {
+    if(maxCombination.size > 1)
+      root.addWaveToNeighbours(-1);
+  }
+
+  size_t TreeEstimator::numberOfBases() const {
+    return bases.size();
+  }
+
+  TreeProbe TreeEstimator::probe() {
+    TreeProbe ret(rootProbe);
+    if(bases.empty())
+      return ret;
+    const size_t i = std::uniform_int_distribution<size_t>(0, bases.size()-1)(rng);
+    NonEncodingCombinationBuilder b(bases[i], 1, picked[i], neighbours, &maxCombination);
+    TreeProbe p;
+    b.probe(rng, (double)bases.size(), p);
+    // The counts of the base are added for each first wave mirroring to it (see BaseBuildingManager::getCounts()):
+    p.all *= multiplicities[i];
+    p.symmetric180 *= multiplicities[i];
+    p.symmetric90 *= multiplicities[i];
+    ret += p;
     return ret;
   }
 
@@ -3097,12 +4314,14 @@ namespace rectilinear {
   Counts CombinationBuilder::report(Token returnToken) {
     Counts ret;
     uint8_t layerSizes[MAX_HEIGHT];
-    for(CountsMap::const_iterator it = counts.begin(); it != counts.end(); it++) {
-      Token token = it->first;
+    for(int rank = 0; rank < counts.size(); rank++) {
+      if(counts[rank].empty())
+	continue;
+      Token token = counts.getToken(rank);
       if(token == 1)
 	continue; // Ignore token 1...
       Combination::getLayerSizesFromToken(token, layerSizes);
-      Counts countsForToken(it->second);
+      Counts countsForToken(counts[rank]);
 
       countsForToken.symmetric180 += countsForToken.symmetric90;
       countsForToken.all += countsForToken.symmetric90;
@@ -3120,18 +4339,20 @@ namespace rectilinear {
     return ret;
   }
 
-  BitWriter::BitWriter() : ostream(NULL), base(0), bits(0), cntBits(0), sumTotal(0), sumSymmetric180(0), sumSymmetric90(0), lines(0), largeCountsRequired(false) {}
-  BitWriter::BitWriter(const BitWriter &w) : ostream(w.ostream), base(w.base), bits(w.bits), cntBits(w.cntBits), sumTotal(w.sumTotal), sumSymmetric180(w.sumSymmetric180), sumSymmetric90(w.sumSymmetric90), lines(w.lines), largeCountsRequired(w.largeCountsRequired) {}
+  BitWriter::BitWriter() : ostream(NULL), base(0), cntBits(0), bits(0), buffer(NULL), buffered(0), sumTotal(0), sumSymmetric180(0), sumSymmetric90(0), lines(0), largeCountsRequired(false) {}
+  BitWriter::BitWriter(const BitWriter &w) : ostream(w.ostream), base(w.base), cntBits(w.cntBits), bits(w.bits), buffer(w.buffer), buffered(w.buffered), sumTotal(w.sumTotal), sumSymmetric180(w.sumSymmetric180), sumSymmetric90(w.sumSymmetric90), lines(w.lines), largeCountsRequired(w.largeCountsRequired) {}
   BitWriter::BitWriter(const std::string &fileName, const Combination &maxCombination) :
     base(maxCombination.layerSizes[0]),
-    bits(0),
     cntBits(0),
+    bits(0),
+    buffered(0),
     sumTotal(0),
     sumSymmetric180(0),
     sumSymmetric90(0),
     lines(0),
     largeCountsRequired(areLargeCountsRequired(maxCombination)) {
     ostream = new std::ofstream(fileName.c_str(), std::ios::binary);
+    buffer = new char[BIT_WRITER_BUFFER_SIZE];
   }
   BitWriter::~BitWriter() {
     // End indicator:
@@ -3165,9 +4386,11 @@ namespace rectilinear {
     writeUInt64(lines);
     // Close and delete stream:
     flushBits();
+    flushBuffer();
     ostream->flush();
     ostream->close();
     delete ostream;
+    delete[] buffer;
   }
   bool BitWriter::areLargeCountsRequired(const Combination &maxCombination) {
     uint8_t base = maxCombination.layerSizes[0];
@@ -3179,25 +4402,44 @@ namespace rectilinear {
   }
   void BitWriter::writeColor(uint8_t toWrite) {
     assert(toWrite < 8);
-    for(int j = 0; j < 3; j++) {
-      writeBit(toWrite & 1);
-      toWrite >>= 1;
-    }
-    assert(toWrite == 0);
+    writeBits(toWrite, 3);
   }
   void BitWriter::writeBrick(const Brick &b) {
-    writeBit(b.isVertical);
-    writeUInt16(b.x);
-    writeUInt16(b.y);
+    writeBits((b.isVertical ? 1 : 0) | ((uint64_t)(uint16_t)b.x << 1) | ((uint64_t)(uint16_t)b.y << 17), 33);
   }
   void BitWriter::writeBit(bool bit) {
-    bits = (bits << 1) + (bit ? 1 : 0);
-    cntBits++;
-    if(cntBits == 8) {
-      ostream->write((char*)&bits, 1);
-      cntBits = 0;
+    writeBits(bit ? 1 : 0, 1);
+  }
+  void BitWriter::writeBits(uint64_t toWrite, uint8_t cnt) {
+    assert(cnt > 0 && cnt <= 64);
+    assert(cnt == 64 || (toWrite >> cnt) == 0);
+    bits |= toWrite << cntBits;
+    if(cntBits + cnt < 64) {
+      cntBits += cnt;
+      return;
+    }
+    writeBytes(bits, 8);
+    const uint8_t remaining = cntBits + cnt - 64;
+    bits = remaining == 0 ? 0 : toWrite >> (cnt - remaining);
+    cntBits = remaining;
+  }
+  void BitWriter::writeBytes(uint64_t word, uint8_t cnt) {
+    // Reverse the bits of each byte, so that the first bit written is the most significant:
+    word = ((word >> 1) & 0x5555555555555555ULL) | ((word & 0x5555555555555555ULL) << 1);
+    word = ((word >> 2) & 0x3333333333333333ULL) | ((word & 0x3333333333333333ULL) << 2);
+    word = ((word >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((word & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    if(buffered + cnt > BIT_WRITER_BUFFER_SIZE)
+      flushBuffer();
+    for(uint8_t i = 0; i < cnt; i++) {
+      buffer[buffered++] = (char)(word & 0xFF);
+      word >>= 8;
     }
   }
+  void BitWriter::flushBuffer() {
+    if(buffered > 0)
+      ostream->write(buffer, buffered);
+    buffered = 0;
+  }
   void BitWriter::writeCounts(const Counts &c) {
     if(largeCountsRequired) {
       if(c.symmetric180 >= 4294967295 || c.symmetric90 >= 65535) {
@@ -3217,56 +4459,193 @@ namespace rectilinear {
     sumTotal += c.all;
     sumSymmetric180 += c.symmetric180;
 
+    const bool with90 = (base & 3) == 0;
+    if(with90)
+      sumSymmetric90 += c.symmetric90;
     if(largeCountsRequired) {
       writeUInt64(c.all);
-      writeUInt32(c.symmetric180);
-      if((base & 3) == 0) {
-	writeUInt16(c.symmetric90);
-	sumSymmetric90 += c.symmetric90;
-      }
+      writeBits(c.symmetric180 | (with90 ? c.symmetric90 << 32 : 0), with90 ? 48 : 32);
     }
     else {
-      writeUInt32(c.all);
-      writeUInt16(c.symmetric180);
-      if((base & 3) == 0) {
-	writeUInt8(c.symmetric90);
-	sumSymmetric90 += c.symmetric90;
-      }
+      writeBits(c.all | (c.symmetric180 << 32) | (with90 ? c.symmetric90 << 48 : 0), with90 ? 56 : 48);
     }
 
     lines++;
   }
   void BitWriter::flushBits() {
-    while(cntBits > 0) {
-      writeBit(0);
-    }
+    // Pad the last byte with 0's:
+    writeBytes(bits, (cntBits + 7) / 8);
+    bits = 0;
+    cntBits = 0;
   }
   void BitWriter::writeUInt8(uint8_t toWrite) {
-    for(int j = 0; j < 8; j++) {
-      writeBit(toWrite & 1);
-      toWrite >>= 1;
-    }
+    writeBits(toWrite, 8);
   }
   void BitWriter::writeUInt16(uint16_t toWrite) {
-    for(int j = 0; j < 16; j++) {
-      writeBit(toWrite & 1);
-      toWrite >>= 1;
-    }
+    writeBits(toWrite, 16);
   }
   void BitWriter::writeUInt32(uint32_t toWrite) {
-    for(int j = 0; j < 32; j++) {
-      writeBit(toWrite & 1);
-      toWrite >>= 1;
-    }
+    writeBits(toWrite, 32);
   }
   void BitWriter::writeUInt64(uint64_t toWrite) {
-    for(int j = 0; j < 64; j++) {
-      writeBit(toWrite & 1);
-      toWrite >>= 1;
+    writeBits(toWrite, 64);
+  }
+
+  void BitWriter::writeBatch(const Base &c, bool baseSymmetric180, bool baseSymmetric90, const Report *reports, int cnt) {
+    writeBit(1); // New batch
+    writeBit(baseSymmetric180);
+    if((base & 3) == 0)
+      writeBit(baseSymmetric90);
+    if(base <= 4) {
+      for(int i = 1; i < base; i++)
+	writeBrick(c.bricks[i]);
+    }
+    for(int i = 0; i < cnt; i++) {
+      if(i > 0)
+	writeBit(0); // Indicate we are still in same batch
+      for(int j = 0; j < base-1; j++)
+	writeColor(reports[i].colors[j]);
+      writeCounts(reports[i].counts);
     }
   }
 
   void BitWriter::commit() {
+    // Write the whole bytes, so that the file can be recovered up to here:
+    const uint8_t cntBytes = cntBits / 8;
+    if(cntBytes > 0) {
+      writeBytes(bits, cntBytes);
+      bits >>= 8 * cntBytes;
+      cntBits -= 8 * cntBytes;
+    }
+    flushBuffer();
+    ostream->flush();
+  }
+
+  VarintWriter::VarintWriter(const std::string &fileName, const Combination &maxCombination, int D) :
+    base(maxCombination.layerSizes[0]),
+    offset(0),
+    prevBlock(0),
+    blocks(0),
+    blockBatches(0),
+    sumTotal(0),
+    sumSymmetric180(0),
+    sumSymmetric90(0),
+    lines(0) {
+    ostream = new std::ofstream(fileName.c_str(), std::ios::binary);
+    std::string header("WAVE");
+    header += (char)2;
+    header += (char)base;
+    header += (char)D;
+    header += (char)0;
+    putUInt64(header, maxCombination.getTokenFromLayerSizes());
+    ostream->write(header.data(), header.size());
+    offset = header.size();
+  }
+  VarintWriter::~VarintWriter() {
+    commit();
+    // Index:
+    std::string payload;
+    putVarint(payload, blocks);
+    payload += index;
+    const uint64_t indexOffset = offset;
+    writeBlock('I', payload);
+    // Footer:
+    std::string footer;
+    putUInt64(footer, indexOffset);
+    putUInt64(footer, sumTotal);
+    putUInt64(footer, sumSymmetric180);
+    putUInt64(footer, sumSymmetric90);
+    putUInt64(footer, lines);
+    const uint32_t sum = FNV1a::hash32((const uint8_t*)footer.data(), footer.size());
+    for(int i = 0; i < 4; i++)
+      footer += (char)((sum >> (8*i)) & 0xFF);
+    footer += "WAVE";
+    ostream->write(footer.data(), footer.size());
+    ostream->flush();
+    ostream->close();
+    delete ostream;
+  }
+  void VarintWriter::putVarint(std::string &s, uint64_t v) {
+    while(v >= 0x80) {
+      s += (char)((v & 0x7F) | 0x80);
+      v >>= 7;
+    }
+    s += (char)v;
+  }
+  void VarintWriter::putUInt64(std::string &s, uint64_t v) {
+    for(int i = 0; i < 8; i++)
+      s += (char)((v >> (8*i)) & 0xFF);
+  }
+  void VarintWriter::putBricks(std::string &s, const Base &c, uint8_t base) {
+    for(uint8_t i = 1; i < base; i++) {
+      const Brick &prev = i == 1 ? FirstBrick : c.bricks[i-1]; // As the first brick is read as FirstBrick
+      const int64_t dx = c.bricks[i].x - prev.x;
+      const int64_t dy = c.bricks[i].y - prev.y;
+      // Zigzag encoding maps small negative differences to small numbers:
+      putVarint(s, ((((uint64_t)dx << 1) ^ (uint64_t)(dx >> 63)) << 1) | (c.bricks[i].isVertical ? 1 : 0));
+      putVarint(s, ((uint64_t)dy << 1) ^ (uint64_t)(dy >> 63));
+    }
+  }
+  void VarintWriter::writeBlock(char type, const std::string &payload) {
+    std::string prefix(1, type);
+    putVarint(prefix, payload.size());
+    const uint32_t sum = FNV1a::hash32((const uint8_t*)payload.data(), payload.size());
+    char suffix[4];
+    for(int i = 0; i < 4; i++)
+      suffix[i] = (char)((sum >> (8*i)) & 0xFF);
+    ostream->write(prefix.data(), prefix.size());
+    ostream->write(payload.data(), payload.size());
+    ostream->write(suffix, 4);
+    offset += prefix.size() + payload.size() + 4;
+  }
+  void VarintWriter::writeBatch(const Base &c, bool baseSymmetric180, bool baseSymmetric90, const Report *reports, int cnt) {
+    if(cnt == 0)
+      return; // Nothing to sum for this base
+    assert(cnt <= MAX_BATCH_REPORTS && MAX_BATCH_REPORTS <= 16);
+    bool anySymmetric = false;
+    for(int i = 0; i < cnt; i++)
+      anySymmetric = anySymmetric || reports[i].counts.symmetric180 != 0 || reports[i].counts.symmetric90 != 0;
+
+    block += (char)((baseSymmetric180 ? 1 : 0) | (baseSymmetric90 ? 2 : 0) | (anySymmetric ? 4 : 0) | ((cnt-1) << 3));
+    const size_t bricksStart = block.size();
+    putBricks(block, c, base);
+    blockBases.append(block, bricksStart, std::string::npos);
+    blockBatches++;
+    for(int i = 0; i < cnt; i++) {
+      const Report &r = reports[i];
+      uint64_t colors = 0;
+      for(int j = base-2; j >= 0; j--) {
+	assert(r.colors[j] <= j+1);
+	colors = colors * (j+2) + r.colors[j];
+      }
+      putVarint(block, colors);
+      // Symmetric models are included in all, and symmetric90 in symmetric180:
+      putVarint(block, r.counts.all - r.counts.symmetric180);
+      if(anySymmetric) {
+	putVarint(block, r.counts.symmetric180 - r.counts.symmetric90);
+	if((base & 3) == 0)
+	  putVarint(block, r.counts.symmetric90);
+      }
+      sumTotal += r.counts.all;
+      sumSymmetric180 += r.counts.symmetric180;
+      sumSymmetric90 += r.counts.symmetric90;
+      lines++;
+    }
+    if(block.size() >= VARINT_WRITER_BLOCK_SIZE)
+      commit();
+  }
+  void VarintWriter::commit() {
+    if(!block.empty()) {
+      putVarint(index, offset - prevBlock);
+      putVarint(index, blockBatches);
+      index += blockBases;
+      prevBlock = offset;
+      blocks++;
+      writeBlock('B', block);
+      block.clear();
+      blockBases.clear();
+      blockBatches = 0;
+    }
     ostream->flush();
   }
 
@@ -3376,92 +4755,146 @@ namespace rectilinear {
     }
   }
   
-  bool BitReader::readBit() {
-    if(bitIdx == 8) {
-      istream->read((char*)&bits, 1);
-      bitIdx = 0;
-    }
-    bool bit = (bits >> (7-bitIdx)) & 1;
-    bitIdx++;
-    return bit;
-  }
-  uint8_t BitReader::readColor() {
-    uint8_t ret = 0;
-    for(int i = 0; i < 3; i++) {
-      ret = ret | (uint8_t)(readBit() << i);
-    }
-    return ret;
+  uint64_t BitReader::loadWord(uint64_t byteIdx) const {
+    uint64_t word = 0;
+    if(byteIdx + 8 <= size)
+      memcpy(&word, data + byteIdx, 8);
+    else if(byteIdx < size)
+      memcpy(&word, data + byteIdx, size - byteIdx);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    // Reverse the bits of each byte, as the first bit of a byte is the most significant:
+    word = ((word >> 1) & 0x5555555555555555ULL) | ((word & 0x5555555555555555ULL) << 1);
+    word = ((word >> 2) & 0x3333333333333333ULL) | ((word & 0x3333333333333333ULL) << 2);
+    word = ((word >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((word & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    return word;
+  }
+  uint64_t BitReader::readBits(uint8_t cnt) {
+    assert(cnt > 0 && cnt <= 64);
+    const uint64_t byteIdx = pos >> 3;
+    const uint8_t shift = pos & 7;
+    uint64_t ret = loadWord(byteIdx) >> shift;
+    if(shift + cnt > 64)
+      ret |= (loadWord(byteIdx + 8) & 0xFF) << (64 - shift);
+    pos += cnt;
+    return cnt == 64 ? ret : ret & ((1ULL << cnt) - 1);
   }
-  void BitReader::readBrick(Brick &b) {
-    b.isVertical = readBit();
-    b.x = readUInt16();
-    b.y = readUInt16();
+  bool BitReader::readBit() {
+    return readBits(1) == 1;
   }
-  uint8_t BitReader::readUInt8() {
-    uint8_t ret = 0;
-    for(int i = 0; i < 8; i++) {
-      ret = ret | (uint8_t)(readBit() << i);
-    }
-    return ret;
+  uint8_t BitReader::readColor() {
+    return (uint8_t)readBits(3);
   }
-  uint16_t BitReader::readUInt16() {
-    uint16_t ret = 0;
-    for(int i = 0; i < 16; i++) {
-      ret = ret | (uint16_t)(readBit() << i);
-    }
-    return ret;
+  void BitReader::readBrick(Brick &b) {
+    const uint64_t bits = readBits(33); // isVertical, x, y
+    b.isVertical = (bits & 1) == 1;
+    b.x = (int16_t)(uint16_t)(bits >> 1);
+    b.y = (int16_t)(uint16_t)(bits >> 17);
   }
-  uint32_t BitReader::readUInt32() {
-    uint32_t ret = 0;
-    for(int i = 0; i < 32; i++) {
-      ret = ret | ((uint32_t)readBit() << i);
+  void BitReader::readCounts(Counts &c) {
+    const bool with90 = (base & 3) == 0;
+    if(largeCountsRequired) {
+      c.all = readBits(64);
+      const uint64_t bits = readBits(with90 ? 48 : 32);
+      c.symmetric180 = bits & 0xFFFFFFFF;
+      c.symmetric90 = bits >> 32;
     }
-    return ret;
-  }
-  uint64_t BitReader::readUInt64() {
-    uint64_t ret = 0;
-    for(int i = 0; i < 64; i++) {
-      ret = ret | ((uint64_t)readBit() << i);
+    else {
+      const uint64_t bits = readBits(with90 ? 56 : 48);
+      c.all = bits & 0xFFFFFFFF;
+      c.symmetric180 = (bits >> 32) & 0xFFFF;
+      c.symmetric90 = bits >> 48;
     }
-    return ret;
   }
-  void BitReader::readCounts(Counts &c) {
-    c.all = readUInt32();
-    c.symmetric180 = readUInt16();
-    c.symmetric90 = ((base & 3) == 0) ? readUInt8() : 0;
+  std::string BitReader::getFileName(const Combination &maxCombination, int D, std::string directorySuffix) {
+    std::stringstream ss;
+    ss << "base_" << (int)maxCombination.layerSizes[0] << "_size_" << (int)maxCombination.size;
+    ss << "_refinement_" << (int)maxCombination.getTokenFromLayerSizes();
+    ss << directorySuffix;
+    ss << "/d" << (int)D << ".bin";
+    return ss.str();
   }
   BitReader::BitReader(const Combination &maxCombination, int D, std::string directorySuffix) :
-    bits(0),
-    bitIdx(8),
+    data(NULL),
+    size(0),
+    pos(0),
+    cursor(0),
+    blockEnd(0),
+    nextBlock(0),
     base(maxCombination.layerSizes[0]),
+    format(0),
     sumTotal(0),
     sumSymmetric180(0),
     sumSymmetric90(0),
     lines(0),
     largeCountsRequired(BitWriter::areLargeCountsRequired(maxCombination)),
-    good(true) {
-    std::stringstream ss;
-    ss << "base_" << (int)base << "_size_" << (int)maxCombination.size;
-    ss << "_refinement_" << (int)maxCombination.getTokenFromLayerSizes();
-    ss << directorySuffix;
-    ss << "/d" << (int)D << ".bin";
-    std::string fileName = ss.str();
-    istream = new std::ifstream(fileName.c_str(), std::ios::binary);
-    bool firstBit = readBit();
+    good(true),
+    seeked(false) {
+    mapFile(getFileName(maxCombination, D, directorySuffix), maxCombination.getTokenFromLayerSizes(), D);
+  }
+  BitReader::BitReader(const std::string &fileName, const Combination &maxCombination, int D) :
+    data(NULL),
+    size(0),
+    pos(0),
+    cursor(0),
+    blockEnd(0),
+    nextBlock(0),
+    base(maxCombination.layerSizes[0]),
+    format(0),
+    sumTotal(0),
+    sumSymmetric180(0),
+    sumSymmetric90(0),
+    lines(0),
+    largeCountsRequired(BitWriter::areLargeCountsRequired(maxCombination)),
+    good(true),
+    seeked(false) {
+    mapFile(fileName, maxCombination.getTokenFromLayerSizes(), D);
+  }
+  void BitReader::mapFile(const std::string &fileName, Token token, int D) {
+    const int fd = open(fileName.c_str(), O_RDONLY);
+    struct stat st;
+    if(fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(mapped != MAP_FAILED) {
+	data = (const uint8_t*)mapped;
+	size = st.st_size;
+	madvise(mapped, size, MADV_SEQUENTIAL);
+      }
+    }
+    if(fd >= 0)
+      close(fd); // The mapping stays valid
     std::cout << "  Reader set up for " << fileName << std::endl;
+    if(size >= 16 && memcmp(data, "WAVE", 4) == 0) {
+      format = 2;
+      cursor = blockEnd = nextBlock = 16;
+      if(data[4] != 2 || data[5] != base || data[6] != D || loadUInt64(8) != token) {
+	good = false;
+	std::cerr << "   Header of format " << (int)data[4] << " for base " << (int)data[5] << ", distance " << (int)data[6] << " and refinement " << loadUInt64(8);
+	std::cerr << " does not match base " << (int)base << ", distance " << D << " and refinement " << token << std::endl;
+      }
+      return;
+    }
+    bool firstBit = readBit();
     if(!firstBit) {
       good = false;
       std::cerr << "   Empty stream!" << std::endl;
     }
+    else
+      format = 1;
   }
   BitReader::~BitReader() {
-    if(istream != NULL) {
-      istream->close();
-      delete istream;
-    }
+    if(data != NULL)
+      munmap((void*)data, size);
   }
-  bool BitReader::next(std::vector<Report> &v) {
-    Report r;
+  int BitReader::next(Report *reports) {
+    if(format == 2)
+      return nextFormat2(reports);
+    return nextFormat1(reports);
+  }
+
+  int BitReader::nextFormat1(Report *reports) {
+    Report &r = reports[0];
     r.base = base;
     r.baseSymmetric180 = readBit();
     r.baseSymmetric90 = ((base & 3) == 0) && readBit();
@@ -3471,70 +4904,300 @@ namespace rectilinear {
 	readBrick(r.c.bricks[i]);
     }
     r.c.layerSize = base;
-    bool first = true;
+    int cnt = 0;
     while(true) {
-      if(!first) {
+      if(cnt > 0) {
 	bool indicator = readBit();
 	if(indicator)
-	  return true; // Now at next batch
+	  return cnt; // Now at next batch
+	if(cnt == MAX_BATCH_REPORTS) {
+	  std::cerr << "Batch with more than " << MAX_BATCH_REPORTS << " reports!" << std::endl;
+	  good = false;
+	  return 0;
+	}
+	Report &prev = reports[cnt-1], &q = reports[cnt];
+	q.base = base;
+	q.baseSymmetric180 = prev.baseSymmetric180;
+	q.baseSymmetric90 = prev.baseSymmetric90;
+	q.c = prev.c;
       }
-      first = false;
+      Report &q = reports[cnt];
       for(uint8_t i = 0; i < base-1; i++)
-	r.colors[i] = readColor();
+	q.colors[i] = readColor();
+      readCounts(q.counts);
 
-      if(largeCountsRequired) {
-	r.counts.all = readUInt64();
-	r.counts.symmetric180 = readUInt32();
-	if((base & 3) == 0)
-	  r.counts.symmetric90 = readUInt16();
-	else
-	  r.counts.symmetric90 = 0;
-      }
-      else {
-	r.counts.all = readUInt32();
-	r.counts.symmetric180 = readUInt16();
-	if((base & 3) == 0)
-	  r.counts.symmetric90 = readUInt8();
-	else
-	  r.counts.symmetric90 = 0;
-      }
-
-      sumTotal += r.counts.all;
-      sumSymmetric180 += r.counts.symmetric180;
-      sumSymmetric90 += r.counts.symmetric90;
+      sumTotal += q.counts.all;
+      sumSymmetric180 += q.counts.symmetric180;
+      sumSymmetric90 += q.counts.symmetric90;
 
-      if(!istream->good()) {
+      if(pos > 8 * size) { // Read past the end of the file
 	good = false;
-	return false;
+	return 0;
       }
 
-      if(r.counts.all == 0) {
+      if(q.counts.all == 0) {
 	// Cross checks:
-	uint64_t readBase = readUInt64();
-	uint64_t readTotal = readUInt64();
-	uint64_t readSumSymmetric180 = readUInt64();
-	uint64_t readSumSymmetric90 = readUInt64();
-	uint64_t readLines = readUInt64();
+	uint64_t readBase = readBits(64);
+	uint64_t readTotal = readBits(64);
+	uint64_t readSumSymmetric180 = readBits(64);
+	uint64_t readSumSymmetric90 = readBits(64);
+	uint64_t readLines = readBits(64);
 	if(readBase != base ||
-	   readTotal != sumTotal ||
-	   readSumSymmetric180 != sumSymmetric180 ||
-	   readSumSymmetric90 != sumSymmetric90 ||
-	   readLines != lines) {
+	   (pos + 7) / 8 != size ||
+	   (!seeked && (readTotal != sumTotal ||
+			readSumSymmetric180 != sumSymmetric180 ||
+			readSumSymmetric90 != sumSymmetric90 ||
+			readLines != lines))) {
 	  std::cerr << "Cross check error: Cross check value from file vs counted:" << std::endl;
 	  std::cerr << " Base: " << readBase << " vs " << (int)base << std::endl;
 	  std::cerr << " Total: " << readTotal << " vs " << sumTotal << std::endl;
 	  std::cerr << " Total 180 degree symmetries: " << readSumSymmetric180 << " vs " << sumSymmetric180 << std::endl;
 	  std::cerr << " Total 90 degree symmetries: " << readSumSymmetric90 << " vs " << sumSymmetric90 << std::endl;
 	  std::cerr << " Lines: " << readLines << " vs " << lines << std::endl;
+	  std::cerr << " Bytes: " << ((pos + 7) / 8) << " vs " << size << std::endl;
 	  assert(false);
 	  good = false;
 	}
+	return 0;
+      }
+      lines++;
+      assert(q.counts.all > 0);
+      cnt++;
+    }
+  }
+
+  bool BitReader::next(std::vector<Report> &v) {
+    Report reports[MAX_BATCH_REPORTS];
+    const int cnt = next(reports);
+    v.insert(v.end(), reports, reports + cnt);
+    return cnt > 0;
+  }
+
+  uint64_t BitReader::loadUInt64(uint64_t byteIdx) const {
+    uint64_t ret = 0;
+    for(int i = 7; i >= 0; i--)
+      ret = (ret << 8) | data[byteIdx + i];
+    return ret;
+  }
+
+  uint32_t BitReader::loadUInt32(uint64_t byteIdx) const {
+    uint32_t ret = 0;
+    for(int i = 3; i >= 0; i--)
+      ret = (ret << 8) | data[byteIdx + i];
+    return ret;
+  }
+
+  bool BitReader::getVarint(uint64_t end, uint64_t &v) {
+    v = 0;
+    for(int shift = 0; shift < 64 && cursor < end; shift += 7) {
+      const uint8_t b = data[cursor++];
+      v |= (uint64_t)(b & 0x7F) << shift;
+      if((b & 0x80) == 0)
+	return true;
+    }
+    return false;
+  }
+
+  bool BitReader::getBricks(uint64_t end, Base &c) {
+    c.layerSize = base;
+    c.bricks[0] = FirstBrick;
+    for(uint8_t i = 1; i < base; i++) {
+      uint64_t dx, dy;
+      if(!getVarint(end, dx) || !getVarint(end, dy))
 	return false;
+      Brick &b = c.bricks[i];
+      b.isVertical = (dx & 1) == 1;
+      dx >>= 1;
+      b.x = (int16_t)(c.bricks[i-1].x + (int16_t)((dx >> 1) ^ -(dx & 1))); // Zigzag decoding
+      b.y = (int16_t)(c.bricks[i-1].y + (int16_t)((dy >> 1) ^ -(dy & 1)));
+    }
+    return true;
+  }
+
+  char BitReader::openBlock(uint64_t offset) {
+    if(offset >= size)
+      return 0;
+    const char type = data[offset];
+    cursor = offset + 1;
+    uint64_t payloadSize;
+    if(!getVarint(size, payloadSize) || payloadSize > size - cursor || size - cursor - payloadSize < 4)
+      return 0;
+    blockEnd = cursor + payloadSize;
+    nextBlock = blockEnd + 4;
+    const uint32_t sum = loadUInt32(blockEnd);
+    if(FNV1a::hash32(data + cursor, payloadSize) != sum) {
+      std::cerr << "   Checksum error in block at offset " << offset << std::endl;
+      return 0;
+    }
+    return type;
+  }
+
+  bool BitReader::checkFooter(uint64_t indexOffset) {
+    if(size < 16 + 48 || memcmp(data + size - 4, "WAVE", 4) != 0)
+      return false; // Incomplete
+    const uint64_t footer = size - 48;
+    const uint32_t sum = loadUInt32(footer + 40);
+    if(FNV1a::hash32(data + footer, 40) != sum) {
+      std::cerr << "   Checksum error in footer" << std::endl;
+      return false;
+    }
+    const uint64_t readIndexOffset = loadUInt64(footer);
+    const uint64_t readTotal = loadUInt64(footer + 8);
+    const uint64_t readSumSymmetric180 = loadUInt64(footer + 16);
+    const uint64_t readSumSymmetric90 = loadUInt64(footer + 24);
+    const uint64_t readLines = loadUInt64(footer + 32);
+    if(indexOffset != 0 && readIndexOffset != indexOffset) {
+      std::cerr << "   Index at offset " << indexOffset << " vs " << readIndexOffset << " in footer" << std::endl;
+      return false;
+    }
+    if(!seeked && indexOffset != 0 &&
+       (readTotal != sumTotal ||
+	readSumSymmetric180 != sumSymmetric180 ||
+	readSumSymmetric90 != sumSymmetric90 ||
+	readLines != lines)) {
+      std::cerr << "Cross check error: Cross check value from file vs counted:" << std::endl;
+      std::cerr << " Total: " << readTotal << " vs " << sumTotal << std::endl;
+      std::cerr << " Total 180 degree symmetries: " << readSumSymmetric180 << " vs " << sumSymmetric180 << std::endl;
+      std::cerr << " Total 90 degree symmetries: " << readSumSymmetric90 << " vs " << sumSymmetric90 << std::endl;
+      std::cerr << " Lines: " << readLines << " vs " << lines << std::endl;
+      assert(false);
+      return false;
+    }
+    return true;
+  }
+
+  int BitReader::nextFormat2(Report *reports) {
+    if(!good)
+      return 0;
+    if(cursor == blockEnd) {
+      const uint64_t offset = nextBlock;
+      const char type = openBlock(offset);
+      if(type == 'I') {
+	good = checkFooter(offset);
+	return 0;
+      }
+      if(type != 'B') {
+	good = false; // Incomplete file
+	return 0;
+      }
+    }
+    return decodeBatch(reports);
+  }
+
+  int BitReader::decodeBatch(Report *reports) {
+    if(cursor >= blockEnd) {
+      good = false;
+      return 0;
+    }
+    Report &r = reports[0];
+    const uint8_t flags = data[cursor++];
+    const bool anySymmetric = (flags & 4) != 0;
+    const int cnt = 1 + (flags >> 3);
+    r.base = base;
+    r.baseSymmetric180 = (flags & 1) != 0;
+    r.baseSymmetric90 = (flags & 2) != 0;
+    if(cnt > MAX_BATCH_REPORTS || !getBricks(blockEnd, r.c)) {
+      good = false;
+      return 0;
+    }
+    for(int i = 0; i < cnt; i++) {
+      Report &q = reports[i];
+      if(i > 0) {
+	q.base = base;
+	q.baseSymmetric180 = r.baseSymmetric180;
+	q.baseSymmetric90 = r.baseSymmetric90;
+	q.c = r.c;
+      }
+      uint64_t colors, all, symmetric180 = 0, symmetric90 = 0;
+      if(!getVarint(blockEnd, colors) || !getVarint(blockEnd, all) ||
+	 (anySymmetric && !getVarint(blockEnd, symmetric180)) ||
+	 (anySymmetric && (base & 3) == 0 && !getVarint(blockEnd, symmetric90))) {
+	good = false;
+	return 0;
       }
+      for(uint8_t j = 0; j < base-1; j++) {
+	q.colors[j] = colors % (j+2);
+	colors /= j+2;
+      }
+      // Counts are stored as differences:
+      q.counts.symmetric90 = symmetric90;
+      q.counts.symmetric180 = symmetric180 + symmetric90;
+      q.counts.all = all + q.counts.symmetric180;
+      sumTotal += q.counts.all;
+      sumSymmetric180 += q.counts.symmetric180;
+      sumSymmetric90 += q.counts.symmetric90;
       lines++;
-      assert(r.counts.all > 0);
-      v.push_back(r);
     }
+    return cnt;
+  }
+
+  bool BitReader::loadIndex() {
+    if(!index.empty())
+      return true;
+    if(size < 16 + 48 || memcmp(data + size - 4, "WAVE", 4) != 0) {
+      std::cerr << "   No index in incomplete file" << std::endl;
+      return false;
+    }
+    const uint64_t indexOffset = loadUInt64(size - 48);
+    if(openBlock(indexOffset) != 'I')
+      return false;
+    uint64_t blockCount, blockOffset = 0;
+    if(!getVarint(blockEnd, blockCount))
+      return false;
+    for(uint64_t i = 0; i < blockCount; i++) {
+      uint64_t deltaBlock, bases;
+      if(!getVarint(blockEnd, deltaBlock) || !getVarint(blockEnd, bases))
+	return false;
+      blockOffset += deltaBlock;
+      for(uint64_t j = 0; j < bases; j++) {
+	Base c;
+	if(!getBricks(blockEnd, c))
+	  return false;
+	index[c] = std::make_pair(blockOffset, j);
+      }
+    }
+    return true;
+  }
+
+  bool BitReader::seek(const Base &c) {
+    if(format == 2) {
+      if(!loadIndex()) {
+	good = false;
+	return false;
+      }
+      std::map<Base,std::pair<uint64_t,uint64_t> >::const_iterator it = index.find(c);
+      if(it == index.end() || openBlock(it->second.first) != 'B') {
+	cursor = blockEnd; // Next read opens the block after
+	return false;
+      }
+      seeked = true;
+      // Skip the batches before c in the block:
+      Report reports[MAX_BATCH_REPORTS];
+      for(uint64_t i = 0; i < it->second.second; i++) {
+	if(decodeBatch(reports) == 0)
+	  return false;
+      }
+      return true;
+    }
+    if(format != 1)
+      return false;
+    // Read from the start:
+    pos = 1;
+    seeked = true;
+    Report reports[MAX_BATCH_REPORTS];
+    while(true) {
+      const uint64_t start = pos;
+      if(nextFormat1(reports) == 0)
+	return false;
+      if(reports[0].c == c) {
+	pos = start;
+	return true;
+      }
+    }
+  }
+
+  int BitReader::getFormat() const {
+    return format;
   }
 
   bool BitReader::isGood() const {
@@ -3542,25 +5205,29 @@ namespace rectilinear {
   }
 
   bool BitReader::nextCountsMap(BaseResultsMap &m, const Token &baseToken) {
-    std::vector<Report> v;
-    if(!next(v)) {
+    Report reports[MAX_BATCH_REPORTS];
+    const int cnt = next(reports);
+    if(cnt == 0) {
       return false;
     }
-    // Transform reports int counts map:
+    // Transform reports into encoding counts:
     CountsMap cm;
     Base b;
     // TODO: Use a map based on base
-    for(std::vector<Report>::const_iterator it = v.begin(); it != v.end(); it++) {
+    for(int j = 0; j < cnt; j++) {
+      const Report &report = reports[j];
       Token token = baseToken;
       token = 10 * token + 1; // First color is always 1
-      for(uint8_t i = 0; i < it->base-1; i++) {
-	assert(it->colors[i] <= it->base);
-	token = 10 * token + (it->colors[i]+1);
+      for(uint8_t i = 0; i < report.base-1; i++) {
+	assert(report.colors[i] <= report.base);
+	token = 10 * token + (report.colors[i]+1);
       }
-      cm[token] = it->counts;
-      b = it->c;
+      cm[token] = report.counts;
+      b = report.c;
     }
-    m[b] = cm;
+    EncodingCounts ec(baseToken, b.layerSize);
+    ec.add(cm);
+    m[b] = ec;
     return true;
   }
 
@@ -3571,7 +5238,7 @@ namespace rectilinear {
       delete innerBuilder;
   }
 
-  void BaseProducer::setWriter(BitWriter *w) {
+  void BaseProducer::setWriter(IBatchWriter *w) {
     writer = w;
   }
 
@@ -3742,7 +5409,7 @@ namespace rectilinear {
   }
 
   bool BaseProducer::nextBaseToBuildOn(Base &buildBase, Base &registrationBase, const Combination &maxCombination) {
-    std::lock_guard<std::mutex> guard(mutex);
+    TimedLock guard(mutex);
 
     if(isBacked) {
       buildBase = backedBuildBase;
@@ -3786,7 +5453,7 @@ namespace rectilinear {
 
 	if(smallerBase.layerSize < c.layerSize) {
 	  bases.push_back(BaseWithID(c, BaseIdentification(SMALLER_BASE,smallerBase)));
-	  resultsMap[c] = CountsMap(); // Reserve to avoid repeats in output
+	  resultsMap[c] = EncodingCounts(); // Reserve to avoid repeats in output
 
 	  Base cleanSmallerBase(smallerBase);
 	  if(resultsMap.find(cleanSmallerBase) != resultsMap.end()) { // Known smaller base: Point to same original:
@@ -3795,7 +5462,7 @@ namespace rectilinear {
 	    continue;
 	  }
 	  else { // First time the smaller base is encountered: Mark it:
-	    resultsMap[cleanSmallerBase] = CountsMap();
+	    resultsMap[cleanSmallerBase] = EncodingCounts();
 	    buildBase = registrationBase = cleanSmallerBase;
 	    // Add back unreachable bricks to buildBase:
 	    int16_t largestDx = ABS(buildBase.bricks[0].x - buildBase.bricks[buildBase.layerSize-1].x);
@@ -3816,11 +5483,11 @@ namespace rectilinear {
       int mirrorSymmetryType = checkMirrorSymmetries(c, mirrored);
       if(mirrorSymmetryType != NORMAL) {
 	bases.push_back(BaseWithID(c, BaseIdentification(mirrorSymmetryType,mirrored)));
-	resultsMap[c] = CountsMap(); // Reserve to avoid repeats in output
+	resultsMap[c] = EncodingCounts(); // Reserve to avoid repeats in output
 	continue;
       }
 
-      resultsMap[c] = CountsMap(); // Reserve the entry so that check for "seen" above works.
+      resultsMap[c] = EncodingCounts(); // Reserve the entry so that check for "seen" above works.
       bases.push_back(BaseWithID(c, BaseIdentification(NORMAL,CBase(c))));
       if(++noSkips % 100000 == 0)
 	std::cout << "  Skips: reach " << (reachSkips/1000) << " k, mirror " << (mirrorSkips/1000) << " k, NONE " << (noSkips/1000) << " k" << std::endl;
@@ -3829,8 +5496,8 @@ namespace rectilinear {
     }
   }
 
-  void BaseProducer::registerCounts(const Base &registrationBase, const CountsMap &counts) {
-    std::lock_guard<std::mutex> guard(mutex);
+  void BaseProducer::registerCounts(const Base &registrationBase, const EncodingCounts &counts) {
+    TimedLock guard(mutex);
     resultsMap[registrationBase] = counts;
   }
 
@@ -3843,29 +5510,19 @@ namespace rectilinear {
       int baseType = it->second.first;
       CBase cBaseIt = it->second.second;
 
-      CountsMap cm = resultsMap[Base(cBaseIt)];
-      CountsMap cmForOriginalBase;
+      const EncodingCounts cm = resultsMap[Base(cBaseIt)];
+      EncodingCounts cmForOriginalBase(maxCombination.getTokenFromLayerSizes(), base);
 
       // Write results:
       bool baseSymmetric180 = c.is180Symmetric();
       bool baseSymmetric90 = baseSymmetric180 && c.is90Symmetric();
-      writer->writeBit(1); // New batch
-      writer->writeBit(baseSymmetric180);
-      if((base & 3) == 0)
-	writer->writeBit(baseSymmetric90);
-      if(base <= 4) {
-	for(int i = 1; i < base; i++)
-	  writer->writeBrick(c.bricks[i]);
-      }
-
-      bool any = false;
-      for(CountsMap::const_iterator it3 = cm.begin(); it3 != cm.end(); it3++) {
-	if(it3->second.all == 0)
+      Report reports[MAX_BATCH_REPORTS];
+      int cnt = 0;
+      for(int rank = 0; rank < cm.size(); rank++) {
+	const Counts &c3 = cm[rank];
+	if(c3.all == 0)
 	  continue; // Skip empty!
-	if(any)
-	  writer->writeBit(0); // Indicate we are still in same batch
-	any = true;
-	Token token = it3->first;
+	Token token = cm.getToken(rank);
 	for(int i = 0; i < base; i++) {
 	  colors[base-1-i] = token % 10 - 1; // 1-indexed in token, 0 in colors
 	  token /= 10;
@@ -3901,15 +5558,18 @@ namespace rectilinear {
 	  }
 	}
 
+	assert(cnt < MAX_BATCH_REPORTS);
+	Report &r = reports[cnt++];
 	for(int i = 1; i < base; i++)
-	  writer->writeColor(colors[i]);
-	writer->writeCounts(it3->second);
+	  r.colors[i-1] = colors[i];
+	r.counts = c3;
 
 	// Write back for reuse:
 	for(int i = 0; i < base; i++)
 	  token = 10 * token + (colors[i]+1);
-	cmForOriginalBase[token] = it3->second;
-      } // for it3
+	cmForOriginalBase.get(token) = c3;
+      } // for rank
+      writer->writeBatch(c, baseSymmetric180, baseSymmetric90, reports, cnt);
       resultsMap[c] = cmForOriginalBase;
     } // for bases
     writer->commit();
@@ -3940,23 +5600,163 @@ namespace rectilinear {
     }
   }
 
-  void Lemma3Runner::run() {
-    Base buildBase, registrationBase;
+  Lemma1::Lemma1() {
+    Combination::setupKnownCounts(known);
+    // Impossible constructions:
+    known[71] = Counts();
+    known[81] = Counts();
+    known[91] = Counts();
+  }
+
+  bool Lemma1::findKnown(const Token token, Counts &c) const {
+    CountsMap::const_iterator it = known.find(token);
+    if(it == known.end())
+      it = known.find(Combination::reverseToken(token));
+    if(it == known.end())
+      return false;
+    c = it->second;
+    return true;
+  }
+
+  bool Lemma1::load(const std::string &fileName) {
+    std::ifstream istream(fileName.c_str());
+    if(!istream.good()) {
+      std::cerr << "Unable to read results file " << fileName << std::endl;
+      return false;
+    }
+    std::string line;
+    int lines = 0;
+    while(std::getline(istream, line)) {
+      // Lines without a token are ignored, so outputs of R mode can be concatenated:
+      std::string::size_type start = line.find('<');
+      if(start == std::string::npos)
+	continue;
+      std::stringstream ss(line.substr(start+1));
+      Token token;
+      char c;
+      Counts counts;
+      if(!(ss >> token >> c >> counts.all) || c != '>')
+	continue;
+      while(ss >> c) {
+	if(c == '(')
+	  ss >> counts.symmetric180;
+	else if(c == '{')
+	  ss >> counts.symmetric90;
+      }
+
+      Counts prev;
+      if(findKnown(token, prev) && prev != counts) {
+	std::cerr << "Conflicting counts for <" << token << "> in " << fileName << ": " << counts << " Expected: " << prev << std::endl;
+	return false;
+      }
+      known[token] = counts;
+      loaded.insert(token);
+      lines++;
+    }
+    std::cout << "Read " << lines << " refinement counts from " << fileName << std::endl;
+    composed.clear();
+    return true;
+  }
+
+  bool Lemma1::isLoaded(const Token token) const {
+    return loaded.find(token) != loaded.end() || loaded.find(Combination::reverseToken(token)) != loaded.end();
+  }
 
-    Lemma4CacheManager *Q = NULL;
-    if(maxCombination->height >= 3) {
-      // For Lemma 4:
-      Combination maxCombinationForLemma4Cache;
-      maxCombinationForLemma4Cache.height = maxCombination->height-1;
-      maxCombinationForLemma4Cache.size = 0;
-      for(uint8_t i = 1; i < maxCombination->height; i++) {
-	maxCombinationForLemma4Cache.layerSizes[i-1] = maxCombination->layerSizes[i];
-	maxCombinationForLemma4Cache.size += maxCombination->layerSizes[i];
-	for(uint8_t j = 0; j < maxCombination->layerSizes[i]; j++)
-	  maxCombinationForLemma4Cache.bricks[i-1][j] = maxCombination->bricks[i][j];
+  bool Lemma1::hasBottleneck(const Token token) {
+    const PackedToken t = PackedToken::fromDecimal(token);
+    for(uint8_t i = 1; i+1 < t.length(); i++) {
+      if(t.fromRight(i) == 1)
+	return true;
+    }
+    return false;
+  }
+
+  /*
+    With C and D being the refinements on each side of the bottleneck and N and S denoting the non-symmetric and symmetric counts:
+    S = S_C * S_D and N = N_C * (2 N_D + S_D) + S_C * N_D,
+    as a non-symmetric model of C combines with the models of D in both directions, except for the symmetric models of D.
+   */
+  bool Lemma1::get(const Token token, Counts &c, std::set<Token> &missing) {
+    if(findKnown(token, c))
+      return true;
+    CountsMap::const_iterator it = composed.find(token);
+    if(it != composed.end()) {
+      c = it->second;
+      return true;
+    }
+    const PackedToken t = PackedToken::fromDecimal(token);
+    const uint8_t L = t.length();
+    bool first = true;
+    std::set<Token> missingFirst;
+    for(uint8_t i = 1; i+1 < L; i++) { // i is the index from the right of the bottleneck
+      if(t.fromRight(i) != 1)
+	continue;
+      const Token tokenC = PackedToken::fromBits(t.getBits() >> (4*i)).toDecimal();
+      const Token tokenD = PackedToken::fromBits(t.getBits() & ((1ULL << (4*(i+1))) - 1)).toDecimal();
+      std::set<Token> missingSplit;
+      Counts cc, cd;
+      const bool okC = get(tokenC, cc, missingSplit);
+      const bool okD = get(tokenD, cd, missingSplit);
+      if(okC && okD) {
+	typedef unsigned __int128 uint128;
+	const uint128 sc = cc.symmetric180, nc = cc.all - sc, sd = cd.symmetric180, nd = cd.all - sd;
+	const uint128 s = sc * sd;
+	const uint128 n = nc * (2 * nd + sd) + sc * nd;
+	assert(n + s < ((uint128)1 << 64));
+	c = Counts((uint64_t)(n + s), (uint64_t)s, 0);
+	composed[token] = c;
+	return true;
+      }
+      if(first) {
+	missingFirst = missingSplit; // Report the refinements missing for the first bottleneck
+	first = false;
       }
-      Q = new Lemma4CacheManager(maxCombinationForLemma4Cache);
     }
+    if(first) {
+      // No bottleneck: Report the smaller of the token and its reverse:
+      missing.insert(MIN(token, Combination::reverseToken(token)));
+    }
+    else {
+      missing.insert(missingFirst.begin(), missingFirst.end());
+    }
+    return false;
+  }
+
+  Lemma4CacheManager *Lemma3Runner::createLemma4Cache(const Combination &maxCombination) {
+    if(maxCombination.height < 3)
+      return NULL;
+    // For Lemma 4:
+    Combination maxCombinationForLemma4Cache;
+    maxCombinationForLemma4Cache.height = maxCombination.height-1;
+    maxCombinationForLemma4Cache.size = 0;
+    for(uint8_t i = 1; i < maxCombination.height; i++) {
+      maxCombinationForLemma4Cache.layerSizes[i-1] = maxCombination.layerSizes[i];
+      maxCombinationForLemma4Cache.size += maxCombination.layerSizes[i];
+      for(uint8_t j = 0; j < maxCombination.layerSizes[i]; j++)
+	maxCombinationForLemma4Cache.bricks[i-1][j] = maxCombination.bricks[i][j];
+    }
+    return new Lemma4CacheManager(maxCombinationForLemma4Cache);
+  }
+
+  void Lemma3Runner::build(CombinationBuilder &builder, const Combination &maxCombination, Lemma4CacheManager *Q) {
+    if(maxCombination.height >= 3) {
+      builder.buildUsingLemma4(*Q);
+      builder.buildSymmetricOnly();
+#ifdef TRACE
+      std::cout << "Counts after building:" << std::endl;
+      for(int rank = 0; rank < builder.counts.size(); rank++)
+	std::cout << " " << builder.counts.getToken(rank) << ": " << builder.counts[rank] << std::endl;
+#endif
+    }
+    else {
+      builder.build();
+    }
+  }
+
+  void Lemma3Runner::run() {
+    Base buildBase, registrationBase;
+
+    Lemma4CacheManager *Q = createLemma4Cache(*maxCombination);
 
     while(baseProducer->nextBaseToBuildOn(buildBase, registrationBase, *maxCombination)) {
       if(maxCombination->layerSizes[0] < 4 &&
@@ -3966,25 +5766,16 @@ namespace rectilinear {
 	 threadName[0] == 'A')
 	std::cout << threadName << " builds on " << buildBase << std::endl;
       CombinationBuilder builder(buildBase, neighbours, *maxCombination);
-      if(maxCombination->height >= 3) {
-	builder.buildUsingLemma4(*Q);
-	builder.buildSymmetricOnly();
-#ifdef TRACE
-	std::cout << "Counts after building on " << buildBase << ":" << std::endl;
-	for(CountsMap::const_iterator it = builder.counts.begin(); it != builder.counts.end(); it++)
-	  std::cout << " " << it->first << ": " << it->second << std::endl;
-#endif
-      }
-      else {
-	builder.build();
-      }
+      build(builder, *maxCombination, Q);
       baseProducer->registerCounts(registrationBase, builder.counts);
+      Telemetry::countUnit();
     }
     if(Q != NULL)
       delete Q;
+    timeFinished = std::chrono::steady_clock::now();
   }
 
-  Lemma3::Lemma3(int base, int threadCount, const Combination &maxCombination): base(base), threadCount(threadCount), token(maxCombination.getTokenFromLayerSizes()), maxCombination(maxCombination) {
+  Lemma3::Lemma3(int base, int threadCount, const Combination &maxCombination): base(base), threadCount(threadCount), token(maxCombination.getTokenFromLayerSizes()), format(2), maxCombination(maxCombination) {
     assert(base >= 2);
     assert(base < maxCombination.size);
     assert(maxCombination.size <= MAX_BRICKS);
@@ -3994,6 +5785,11 @@ namespace rectilinear {
     precompute(maxDist, false);
   }
 
+  void Lemma3::setFormat(int format) {
+    assert(format == 1 || format == 2);
+    this->format = format;
+  }
+
   void Lemma3::precompute(int maxDist, bool overwriteFiles) {
     BaseProducer baseProducer;
     for(int d = 2; d <= maxDist; d++) {
@@ -4034,17 +5830,98 @@ namespace rectilinear {
 	}
       }
 
-      BitWriter writer(fileName, maxCombination);
-      baseProducer.setWriter(&writer);
+      IBatchWriter *writer;
+      if(format == 1)
+	writer = new BitWriter(fileName, maxCombination);
+      else
+	writer = new VarintWriter(fileName, maxCombination, d);
+      baseProducer.setWriter(writer);
       std::vector<int> distances;
 
       precompute(&baseProducer, distances, d);
+      delete writer; // Writes the end of the file
 
       std::chrono::duration<double, std::ratio<1> > duration(std::chrono::steady_clock::now() - timeStart);
       std::cout << "Precomputation done for max distance " << d << " in " << duration.count() << " seconds" << std::endl;
     }
   }
 
+  /*
+    The bases of precompute(maxDist) are enumerated exactly, as that is fast compared to building on them.
+    Building on a uniform sample of the bases then estimates the total time.
+    Notice that the sampled bases share a Lemma 4 cache, as the bases of a worker thread do.
+   */
+  double Lemma3::estimate(int maxDist, double seconds, const uint64_t seed) {
+    std::chrono::time_point<std::chrono::steady_clock> timeStart { std::chrono::steady_clock::now() };
+    BaseProducer baseProducer;
+    std::vector<Base> buildBases;
+    for(int d = 2; d <= maxDist; d++) {
+      std::vector<int> distances;
+      collectBases(&baseProducer, distances, d, buildBases);
+    }
+    std::chrono::duration<double, std::ratio<1> > duration(std::chrono::steady_clock::now() - timeStart);
+    std::cout << "Lemma 3 bases to build on up to distance " << maxDist << ": " << buildBases.size() << " (enumerated in " << duration.count() << " seconds)" << std::endl;
+    if(buildBases.empty())
+      return 0;
+
+    std::mt19937_64 rng(seed);
+    std::shuffle(buildBases.begin(), buildBases.end(), rng);
+
+    BrickPlane neighbours[MAX_HEIGHT];
+    for(uint8_t i = 0; i < MAX_HEIGHT; i++)
+      neighbours[i].reset();
+    Lemma4CacheManager *Q = Lemma3Runner::createLemma4Cache(maxCombination);
+    SampleStatistics time;
+    timeStart = std::chrono::steady_clock::now();
+    for(std::vector<Base>::const_iterator it = buildBases.begin(); it != buildBases.end(); it++) {
+      std::chrono::time_point<std::chrono::steady_clock> timeBase { std::chrono::steady_clock::now() };
+      CombinationBuilder builder(*it, neighbours, maxCombination);
+      Lemma3Runner::build(builder, maxCombination, Q);
+      std::chrono::duration<double, std::ratio<1> > durationBase(std::chrono::steady_clock::now() - timeBase);
+      time.add(durationBase.count());
+      duration = std::chrono::steady_clock::now() - timeStart;
+      if(duration.count() >= seconds)
+	break;
+    }
+    if(Q != NULL)
+      delete Q;
+
+    const double N = (double)buildBases.size();
+    const int workerCount = MAX(1, threadCount-1);
+    std::cout << "Lemma 3 bases sampled: " << time.size() << std::endl;
+    std::cout << "Seconds per base: " << time << " (95% confidence)" << std::endl;
+    if(time.size() == buildBases.size()) {
+      std::cout << "All bases were built. Precomputation time: " << (time.getMean() * N) << " seconds" << std::endl;
+      return time.getMean() * N;
+    }
+    std::cout << "Estimated precomputation time: " << (time.getMean() * N) << " +- " << (time.halfWidth95() * N) << " seconds" << std::endl;
+    std::cout << "Estimated precomputation time using " << workerCount << " worker threads: " << (time.getMean() * N / workerCount) << " seconds" << std::endl;
+    return time.getMean() * N;
+  }
+
+  void Lemma3::collectBases(BaseProducer *baseProducer, std::vector<int> &distances, int maxDist, std::vector<Base> &buildBases) {
+    int S = (int)distances.size();
+
+    if(S == base-2) {
+      distances.push_back(maxDist); // Last dist is max dist
+      baseProducer->reset(distances);
+      Base buildBase, registrationBase;
+      while(baseProducer->nextBaseToBuildOn(buildBase, registrationBase, maxCombination)) {
+	buildBases.push_back(buildBase);
+	baseProducer->registerCounts(registrationBase, EncodingCounts()); // Lets nextBaseToBuildOn() skip mirrored bases
+      }
+      distances.pop_back();
+      return;
+    }
+
+    int prevD = distances.empty() ? 2 : distances[S-1];
+    for(int d = prevD; d <= maxDist; d++) {
+      distances.push_back(d);
+      collectBases(baseProducer, distances, maxDist, buildBases);
+      distances.pop_back();
+    }
+  }
+
   void Lemma3::precompute(BaseProducer *baseProducer, std::vector<int> &distances) {
     baseProducer->reset(distances);
 
@@ -4059,7 +5936,7 @@ namespace rectilinear {
          knownResults.clear();
          break;
        }
-       CountsMap &cm = knownResults[buildBase];
+       EncodingCounts &cm = knownResults[buildBase];
        baseProducer->registerCounts(registrationBase, cm);
       }
       else {
@@ -4087,6 +5964,14 @@ namespace rectilinear {
       threads[i]->join();
       delete threads[i];
     }
+    // Idle tails of the threads done before the last:
+    std::chrono::time_point<std::chrono::steady_clock> lastFinished = builders[0].timeFinished;
+    for(int i = 1; i < workerCount; i++)
+      lastFinished = MAX(lastFinished, builders[i].timeFinished);
+    for(int i = 0; i < workerCount; i++) {
+      std::chrono::duration<double, std::nano> tail(lastFinished - builders[i].timeFinished);
+      WaitStatistics::tail += (uint64_t)tail.count();
+    }
     delete[] threads;
     delete[] builders;
     delete[] neighbourCache;
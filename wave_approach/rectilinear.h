@@ -24,12 +24,37 @@
 // These are used in bitmap lookups for checking positions of bricks:
 #define PLANE_MID 100
 #define PLANE_WIDTH 200
+// Words in a row of a BrickPlane. The extra word allows reading any window using two words:
+#define PLANE_WORDS ((PLANE_WIDTH+63)/64 + 1)
+// Rows of the crossing (5) and largest parallel (7) stencils of a brick:
+#define STENCIL_ROWS 12
+
+// A BrickBatch can hold all candidates of a wave: MAX_BRICKS * 2 layers * (25 crossing + 21 parallel)
+#define BRICK_BATCH_CAPACITY 1024
+#define BRICK_BATCH_WORDS (BRICK_BATCH_CAPACITY/64)
+#define BATCH_LAYER_STRIDE 256
+
+// Bases counted concurrently by a SplitWorkerPool, and tasks queued per worker before the producer waits:
+#define MAX_ACTIVE_BASES 8
+#define SPLIT_TASKS_PER_WORKER 256
+// Subtrees are published to idle workers at sizes where tasks take at least this long on average:
+#define SPLIT_MIN_MICROS 1000
+#define SPLIT_MIN_SAMPLES 8
+// Work units of a depth 2 journal with smaller counts are cheaper to recount than to journal:
+#define JOURNAL_MIN_UNIT_COUNT 1000000
 
 #define BRICK first
 #define LAYER second
 
 #define BINOMIAL_CACHE_SIZE 256
 
+// Bytes buffered by a BitWriter between writes to the file:
+#define BIT_WRITER_BUFFER_SIZE 65536
+// Reports in a batch of a precomputation file: One for each encoding of a base of size 4 (Bell(4) = 15)
+#define MAX_BATCH_REPORTS 15
+// Bytes of batches in a block of a VarintWriter. Smaller blocks are written when committing:
+#define VARINT_WRITER_BLOCK_SIZE 4096
+
 // For reporting on bases:
 #define NORMAL 0
 #define MIRROR_X 1
@@ -43,9 +68,13 @@
 #include <map>
 #include <set>
 #include <vector>
+#include <deque>
+#include <atomic>
 #include <mutex>
+#include <condition_variable>
 #include <thread>
 #include <chrono>
+#include <random>
 
 namespace rectilinear {
 
@@ -62,6 +91,14 @@ namespace rectilinear {
     static uint64_t nChooseK(uint64_t n, uint64_t k);
   };
 
+  /*
+    FNV-1a hashes used as checksums of journals (64 bit) and precomputation files (32 bit).
+   */
+  struct FNV1a {
+    static uint32_t hash32(const uint8_t *data, const uint64_t size);
+    static uint64_t hash64(const uint8_t *data, const uint64_t size);
+  };
+
   /**
    * Struct used for totalling the number of models.
    * Note: 'all' includes the models counted for 'symmetric180' and 'symmetric90'.
@@ -113,39 +150,229 @@ namespace rectilinear {
   const Brick FirstBrick = Brick(); // At 0,0, horizontal
 
   typedef uint64_t Token;
+
+  /**
+   * A token packed with one digit per nibble (4 bits), where the last digit is in the lowest nibble.
+   * Digits of tokens (layer sizes and colors) are 1-9, so the length is given by the highest non-zero nibble.
+   * Decimal tokens (Token) are used for I/O and known counts. Use fromDecimal() and toDecimal() to convert.
+   */
+  class PackedToken {
+    uint64_t bits;
+    constexpr PackedToken reverseOnto(const PackedToken &acc) const {
+      return bits == 0 ? acc : withoutLast().reverseOnto(acc.append(last()));
+    }
+  public:
+    constexpr PackedToken() : bits(0) {}
+    static constexpr PackedToken fromBits(const uint64_t bits) {
+      return PackedToken(bits, 0);
+    }
+    static constexpr PackedToken fromDecimal(const Token token) {
+      return token == 0 ? PackedToken() : fromDecimal(token / 10).append((uint8_t)(token % 10));
+    }
+    constexpr Token toDecimal() const {
+      return bits == 0 ? 0 : 10 * withoutLast().toDecimal() + last();
+    }
+    constexpr uint64_t getBits() const {
+      return bits;
+    }
+    constexpr uint8_t length() const {
+      return bits == 0 ? 0 : (uint8_t)((67 - __builtin_clzll(bits)) / 4);
+    }
+    constexpr uint8_t last() const {
+      return bits & 15;
+    }
+    constexpr uint8_t fromRight(const uint8_t i) const { // Digit i from the right. fromRight(0) == last()
+      return (bits >> (4*i)) & 15;
+    }
+    constexpr uint8_t sum() const {
+      return bits == 0 ? 0 : last() + withoutLast().sum();
+    }
+    constexpr PackedToken withoutLast() const {
+      return fromBits(bits >> 4);
+    }
+    constexpr PackedToken append(const uint8_t digit) const {
+      return fromBits((bits << 4) | digit);
+    }
+    constexpr PackedToken concat(const PackedToken &b) const {
+      return fromBits((bits << (4*b.length())) | b.bits);
+    }
+    constexpr PackedToken reverse() const {
+      return reverseOnto(PackedToken());
+    }
+    constexpr bool operator ==(const PackedToken &b) const {
+      return bits == b.bits;
+    }
+    constexpr bool operator !=(const PackedToken &b) const {
+      return bits != b.bits;
+    }
+  private:
+    constexpr PackedToken(const uint64_t bits, int) : bits(bits) {}
+  };
   typedef std::pair<Brick,uint8_t> LayerBrick; // A brick placed at a given layer of a combination
   typedef std::pair<uint8_t,uint8_t> BrickIdentifier; // Identify a brick in a combination (layer, idx)
   typedef std::map<Token,Counts> CountsMap; // token -> counts
 
+  /**
+   * Counts for each connectivity encoding of a refinement, stored densely in an array.
+   * The encoding of a base of size n consists of a color for each base brick: 1 + index of the first
+   * base brick connected to it (see Combination::encodeConnectivity()).
+   * Encodings correspond to partitions of the base bricks, so there are Bell(n) of them (15 for n=4).
+   * Encodings are indexed by rank in lexicographic order, which is also the order of their tokens.
+   * Remember to call init() once and before using this class!
+   */
+  class EncodingCounts {
+    static uint32_t completions[MAX_LAYER_SIZE+1][MAX_LAYER_SIZE+2]; // [r][m]: Encodings of the last r bricks when m colors are used
+    PackedToken refinement; // Token of the layer sizes. The token of an encoding is refinement followed by the colors
+    uint8_t baseSize;
+    std::vector<Counts> counts; // Indexed by rank
+  public:
+    EncodingCounts();
+    EncodingCounts(const Token refinement, const uint8_t baseSize);
+    EncodingCounts(const EncodingCounts &b);
+
+    static void init();
+    static int countEncodings(const uint8_t baseSize);
+    static int rank(const uint8_t *colors, const uint8_t baseSize); // colors as in encodeConnectivity()
+    static void unrank(int rank, const uint8_t baseSize, uint8_t *colors);
+
+    int size() const;
+    Counts& operator [](const int rank);
+    const Counts& operator [](const int rank) const;
+    Token getToken(const int rank) const;
+    PackedToken getPackedToken(const int rank) const;
+    Counts& get(const Token token); // Counts for the encoding in token
+    Counts& get(const PackedToken &token);
+    void add(const CountsMap &m);
+  };
+
+  typedef void (*IntersectKernel)(const int16_t *x, const int16_t *y, const uint64_t *vertical, const int size, const int16_t bx, const int16_t by, const bool bv, uint64_t *mask);
+
+  /**
+   * Bricks stored as a structure of arrays, so that a brick can be tested
+   * for intersection against all bricks of the batch using vector instructions.
+   * Bricks of different layers are BATCH_LAYER_STRIDE apart in y, so they never intersect.
+   * The kernel (AVX2, SSE4 or scalar) is chosen at runtime. Compile with -DNO_SIMD to only use the scalar kernel.
+   */
+  struct BrickBatch {
+    int16_t x[BRICK_BATCH_CAPACITY], y[BRICK_BATCH_CAPACITY];
+    uint64_t vertical[BRICK_BATCH_WORDS]; // Bit i is set if brick i is vertical
+    uint16_t size;
+
+    BrickBatch();
+    void clear();
+    void push(const Brick &b);
+    void push(const LayerBrick &lb);
+    void pop();
+    Brick get(const uint16_t i) const; // y includes the layer offset
+    uint16_t words() const; // Number of words in a mask
+    void intersectMask(const Brick &b, uint64_t *mask) const; // Set bit i of mask if b intersects brick i
+    void intersectMask(const LayerBrick &lb, uint64_t *mask) const;
+    uint64_t intersectMask(const Brick &b) const; // Only for batches of at most 64 bricks
+    uint64_t intersectMask(const LayerBrick &lb) const;
+    static uint32_t countBits(const uint64_t *mask, const uint32_t from, const uint32_t to); // Bits set in [from;to)
+    static const char* kernelName();
+  private:
+    static IntersectKernel kernel;
+    static IntersectKernel selectKernel();
+  };
+
+  /**
+   * Conflict graph of the bricks in a BrickBatch: Bit j of row i is set if brick i intersects brick j.
+   * A valid pick of k bricks is an independent set of size k. These are counted by extending
+   * the pick in increasing brick order while AND-NOT'ing the remaining candidates with the row
+   * of each picked brick, so no intersection test is performed while counting.
+   * The rows are scratch space of a builder: They grow to the largest batch built. A copied builder constructs its own empty graph.
+   */
+  struct ConflictGraph {
+    uint64_t *rows; // Row i starts at rows[i*words]
+    uint32_t capacity; // Words allocated for rows
+    uint16_t size, words;
+
+    ConflictGraph();
+    ConflictGraph(const ConflictGraph &g) = delete;
+    ConflictGraph& operator=(const ConflictGraph &g) = delete;
+    ~ConflictGraph();
+    void build(const BrickBatch &batch);
+    uint64_t countIndependent(const uint32_t k) const; // Pick k among all bricks
+    // Pick sizes[j] bricks among bricks [starts[j];ends[j]) for each of the numBuckets buckets:
+    uint64_t countIndependent(const uint16_t *starts, const uint16_t *ends, const uint32_t *sizes, const uint32_t numBuckets) const;
+  private:
+    uint64_t countIndependent(uint64_t const * const candidates, const uint16_t *starts, const uint16_t *ends, const uint32_t *sizes, const uint32_t numBuckets, uint32_t bucketI, uint32_t idx, uint32_t left) const;
+  };
+
+  class Combination; // To be defined later. Needed here to allow for C++ compilation.
+
+  /**
+   * Positions blocked around a brick, relative to its center:
+   * 'rows' rows of x starting at dx, each blocking 'bits' values of y starting at dy.
+   */
+  struct BrickStencil {
+    int8_t dx, dy;
+    uint8_t rows, bits;
+  };
+
   /**
    * Cache for bricks placed in a plane or layer.
-   * A brick is cached by its orientation, then x, and finally by y.
-   * int8_t is used to allow for multiple bricks at the same location.
-   * This is used for speeding up checks for colissions.
+   * A brick is cached by its orientation, then x, and finally as a bit in a row of y values.
+   * This is used for speeding up checks for colissions:
+   * The positions blocked by a brick are given by precomputed stencils, so
+   * that candidate bricks are found using a few word-wide operations per row.
+   * Blocked positions are recorded in frames, which are undone in LIFO order.
    */
   struct BrickPlane {
-    int8_t bricks[2][PLANE_WIDTH][PLANE_WIDTH];
-#ifdef DEBUG
-    int sum;
-#endif
+    struct Blocked {
+      bool v;
+      int16_t x, y;
+      uint64_t bits;
+    };
+    uint64_t rows[2][PLANE_WIDTH][PLANE_WORDS];
+    Blocked log[MAX_LAYER_SIZE * STENCIL_ROWS];
+    uint16_t frames[MAX_LAYER_SIZE + 1], logSize;
+    uint8_t frameCount;
+
+    static const BrickStencil crossing, parallel[2]; // parallel is indexed by isVertical
+
     void reset();
     void set(const bool v, const int16_t x, const int16_t y);
-    void set(const bool v, const int16_t x, const int16_t y, const int8_t add);
     void unset(const bool v, const int16_t x, const int16_t y);
     void unset(const Brick &b);
-    bool contains(const bool v, const int16_t x, const int16_t y);
+    bool contains(const bool v, const int16_t x, const int16_t y) const;
+    void pushFrame();
+    void addStencil(const Brick &b); // Block all positions of bricks intersecting b
+    void popFrame(); // Unblock all positions blocked since last pushFrame()
+
+    static void addWave(BrickPlane *neighbours, const Combination &c, const uint8_t waveStart, const uint8_t waveSize, const int8_t add);
+    static void findPotentialBricks(BrickPlane *neighbours, const Combination &c, const uint8_t waveStart, const uint8_t waveSize, const Combination &maxCombination, std::vector<LayerBrick> &v);
+  private:
+    uint64_t window(const bool v, const int16_t x, const int16_t y) const; // 64 bits of row x from y
+    void setWindow(const bool v, const int16_t x, const int16_t y, const uint64_t bits);
+    void unsetWindow(const bool v, const int16_t x, const int16_t y, const uint64_t bits);
+    void block(const bool v, const Brick &b, const BrickStencil &s);
+    void claim(const bool v, const Brick &b, const BrickStencil &s, BrickPlane const * const below, BrickPlane const * const above, uint64_t *free);
   };
 
   struct Base; // To be defined later. Needed here to allow for C++ compilation.
 
   // Represents a combination/model
   class Combination {
-    // State to check connectivity:
-    void colorConnected(uint8_t layer, uint8_t idx, uint8_t color);
-    uint8_t countConnected(uint8_t layer, uint8_t idx);
+    /*
+      State to check connectivity: An undoable union-find over the bricks, indexed by their position in history.
+      Bricks are united with the bricks they intersect in the layers below and above, but only once connectivity is queried,
+      so that bricks which are added and removed without queries (such as when counting the last wave) cost nothing.
+      The unions are logged, so that removeLastBrick() can undo them. No path compression is used, so that undo stays cheap.
+     */
+    uint8_t ids[MAX_HEIGHT][MAX_LAYER_SIZE]; // Position in history of each brick
+    uint8_t parents[MAX_BRICKS], componentSizes[MAX_BRICKS], unionCounts[MAX_BRICKS]; // unionCounts[i] is the number of unions performed when connecting brick i
+    uint8_t unionLog[MAX_BRICKS], unionLogSize; // Roots that have been attached to other roots
+    uint8_t connectedSize; // Bricks in history before this have been connected
+    uint8_t findComponent(uint8_t id) const;
+    void connectAll(); // Connect the bricks added since last query
+    void colorBase(); // Set colors of layer 0 as in encodeConnectivity()
+    void connect(const uint8_t id);
+    void resetConnectivity(); // Rebuild union-find when bricks have been rearranged
     bool hasVerticalLayer0Brick() const;
   public:
-    uint8_t colors[MAX_HEIGHT][MAX_LAYER_SIZE]; // Colors of bricks. Used for checking connectivity.
+    uint8_t colors[MAX_HEIGHT][MAX_LAYER_SIZE]; // Colors of bricks. Set by colorFull() and encodeConnectivity().
     uint8_t layerSizes[MAX_HEIGHT], height, size;
     Brick bricks[MAX_HEIGHT][MAX_LAYER_SIZE];
     BrickIdentifier history[MAX_BRICKS]; // Used for knowing which bricks belong to current and previous layers.
@@ -179,6 +406,8 @@ namespace rectilinear {
     void addBrick(const Brick &b, const uint8_t layer);
     void addBrick(const LayerBrick &lb);
     Token encodeConnectivity(Token baseToken);
+    int rankConnectivity(); // Rank of encodeConnectivity() in EncodingCounts
+    uint8_t sizeOfBase() const; // Number of bricks in layer 0 added before any brick of another layer
     void removeLastBrick();
     Token getTokenFromLayerSizes() const;
     bool isConnected();
@@ -187,7 +416,7 @@ namespace rectilinear {
     static Token reverseToken(Token token);
     static uint8_t heightOfToken(Token token);
     static uint8_t sizeOfToken(Token token);
-    static void getLayerSizesFromToken(Token token, uint8_t *layerSizes);
+    static void getLayerSizesFromToken(Token token, uint8_t *layerSizes); // layerSizes has room for MAX_HEIGHT layers
     static int countBricksToBridge(const Combination &maxCombination);
     static void setupKnownCounts(CountsMap &m);
     static bool checkCounts(Token token, const Counts &c);
@@ -264,34 +493,34 @@ namespace rectilinear {
     bool hasVerticalLayer0Brick() const;
   };
 
-  /**
-   * Helper class to pick all combinations of 'numberOfBricks' bricks from a list of bricks 'v'.
+  /*
+    Picks numberOfBricksToPick bricks from v in increasing index order.
+    The picked indices are kept on a fixed size stack, so no allocations are performed.
    */
   class BrickPicker {
     const std::vector<LayerBrick> &v; // Available bricks
-    int vIdx; // First index of available bricks
     const int numberOfBricksToPick;
-    BrickPicker *inner;
+    int indices[MAX_BRICKS]; // Index in v of the brick picked at each level
+    int level; // Level to advance on next call. -1 when done
+    bool started;
 
-    bool checkVIdx(const Combination &c, const Combination &maxCombination) const;
-    void nextVIdx(const Combination &c, const Combination &maxCombination);
+    bool checkVIdx(const int vIdx, const Combination &c, const Combination &maxCombination) const;
 
   public:
     BrickPicker(const std::vector<LayerBrick> &v, const int vIdx, const int numberOfBricksToPick);
-    ~BrickPicker();
 
     bool next(Combination &c, const Combination &maxCombination);
   };
 
-  typedef std::map<Base,CountsMap> BaseResultsMap; // CountsMap for each base. Used for caching results during computation of precomputations.
+  typedef std::map<Base,EncodingCounts> BaseResultsMap; // EncodingCounts for each base. Used for caching results during computation of precomputations.
   typedef std::map<Combination,Counts> CombinationCountsMap;
 
   struct Lemma4Info {
-    Token cacheToken, computedToken;
+    PackedToken cacheToken, computedToken;
     uint64_t count;
     Lemma4Info();
     Lemma4Info(const Lemma4Info &x);
-    Lemma4Info(Token cacheToken, Token computedToken, uint64_t count);
+    Lemma4Info(const PackedToken &cacheToken, const PackedToken &computedToken, uint64_t count);
   };
   typedef std::vector<Lemma4Info> InfoVector;
   typedef std::map<Base,InfoVector> Lemma4CacheMap;
@@ -308,39 +537,21 @@ namespace rectilinear {
     BrickPicker *inner;
     CombinationCountsMap countsMap; // Combination -> Counts
     std::vector<Combination> combinations;
+    Combination normalized, mirrored; // Used by next() for lookups in countsMap
     std::mutex mutex;
   public:
     BaseBuildingManager(const std::vector<LayerBrick> &v, const int maxPick);
     uint8_t next(Combination &c, const Combination &maxCombination);
     void add(const Combination &c, const Counts &counts);
     Counts getCounts() const;
-  };
-
-  /*
-    The "Normal" building manager simply serves combinations and does not
-    perform the optimizations of BaseBuildingManager as wave information would
-    then have to be used to properly detect duplicates.
-   */
-  class NormalBuildingManager {
-    const std::vector<LayerBrick> &v;
-    const int maxPick;
-    int toPick;
-    LayerBrick bricks[MAX_BRICKS];
-    BrickPicker *inner;
-    Counts sum;
-    std::mutex mutex;
-  public:
-    NormalBuildingManager(const std::vector<LayerBrick> &v, const int maxPick);
-    uint8_t next(Combination &c, const Combination &maxCombination);
-    void add(const Counts &counts);
-    Counts getCounts() const;
+    int getMultiplicity(const Combination &c) const; // Number of combinations served as c or mirrored to c
   };
 
   class Lemma4Cache {
     BaseResultsMap cache; // base -> counts
   public:
-    void set(const Base &b, const CountsMap &m);
-    bool get(const Base &b, CountsMap &m);
+    void set(const Base &b, const EncodingCounts &m);
+    bool get(const Base &b, EncodingCounts &m);
   };
 
   class Lemma4CacheManager {
@@ -350,26 +561,36 @@ namespace rectilinear {
   public:
     Lemma4CacheManager(const Combination &maxCombination);
     Counts getBase1Counts();
-    void computeOrGet(const Base &b, CountsMap &m, BrickPlane *neighbours);
-    Token computeToken(const Combination &baseCombination,
-		       const CBase &secondLayer,
-		       Token cacheToken,
-		       const Token baseToken) const;
-    bool didSmallerBaseContribute(Token t,
-				  Token T,
+    void computeOrGet(const Base &b, EncodingCounts &m, BrickPlane *neighbours);
+    PackedToken computeToken(const Combination &baseCombination,
+			     const CBase &secondLayer,
+			     const PackedToken &cacheToken,
+			     const PackedToken &baseToken) const;
+    bool didSmallerBaseContribute(const PackedToken &t,
+				  const PackedToken &T,
 				  const CBase &base_t,
 				  const CBase &base_T,
 				  const CBase &t_to_T) const;
   };
 
   class CombinationBuilder {
+    /*
+      The recursion over waves runs in place on baseCombination:
+      Each wave saves the state below in a WaveState, which is restored when the wave has been built.
+     */
+    struct WaveState {
+      uint8_t waveStart, waveSize;
+      bool encodingLocked;
+    };
     Combination baseCombination;
-    uint8_t waveStart, waveSize;
+    uint8_t waveStart, waveSize, depth;
     BrickPlane *neighbours;
     const Combination &maxCombination;
     bool encodingLocked;
+    std::vector<LayerBrick> candidates[MAX_BRICKS]; // Potential bricks of the wave at each depth. Reused between waves
+    ConflictGraph graph; // Of the buckets in placeAllInAllBuckets()
   public:
-    CountsMap counts;
+    EncodingCounts counts;
 
     CombinationBuilder(const Combination &c,
 		       const uint8_t waveStart,
@@ -393,70 +614,405 @@ namespace rectilinear {
     void addWaveToNeighbours(int8_t add);
   private:
     void findPotentialBricksForNextWave(std::vector<LayerBrick> &v);
-    uint64_t simonWithBuckets(std::vector<std::vector<LayerBrick> > &buckets, uint32_t *bucketIndices, uint32_t numBuckets, uint32_t *bucketSizes);
-    uint64_t placeAllSizedBuckets(std::vector<std::vector<LayerBrick> > &buckets, uint32_t *bucketIndices, uint32_t numBuckets, uint32_t leftToPlace, uint32_t *bucketSizes, uint32_t bucketSizesI);
-    void placeAllInBuckets(std::vector<std::vector<LayerBrick> > &buckets, uint32_t *bucketIndices, uint32_t bucketI, uint32_t bucketIndicesI, uint32_t numBuckets, uint32_t leftToPlace);
+    WaveState pushWave(const uint8_t toPick); // Make the toPick bricks last added the current wave
+    void popWave(const WaveState &s);
+    uint64_t simonWithBuckets(const ConflictGraph &graph, const uint16_t *bucketOffsets, std::vector<std::vector<LayerBrick> > &buckets, uint32_t *bucketIndices, uint32_t numBuckets, uint32_t *bucketSizes);
+    uint64_t placeAllSizedBuckets(const ConflictGraph &graph, const uint16_t *bucketOffsets, std::vector<std::vector<LayerBrick> > &buckets, uint32_t *bucketIndices, uint32_t numBuckets, uint32_t leftToPlace, uint32_t *bucketSizes, uint32_t bucketSizesI);
+    void placeAllInBuckets(const ConflictGraph &graph, const uint16_t *bucketOffsets, std::vector<std::vector<LayerBrick> > &buckets, uint32_t *bucketIndices, uint32_t bucketI, uint32_t bucketIndicesI, uint32_t numBuckets, uint32_t leftToPlace);
     void setUpBucketsForSimon(std::vector<std::vector<LayerBrick> > &buckets, const std::vector<LayerBrick> &v);
+    void placeAllInAllBuckets(std::vector<std::vector<LayerBrick> > &buckets, const uint8_t leftToPlace);
     bool placeAllLeftToPlace(const uint8_t &leftToPlace, const std::vector<LayerBrick> &v); // Return true if all done here
     bool placeAllSymmetricLeftToPlace(const uint8_t &leftToPlace, const std::vector<LayerBrick> &v); // Return true if all done here
     bool placeAllLeftToPlaceWithoutSymmetries(const uint8_t &leftToPlace, const std::vector<LayerBrick> &v);
-    void addCountsFrom(const CountsMap &counts);
-    uint64_t countInvalid(std::vector<std::vector<LayerBrick> > &buckets, uint32_t *bucketIndices, uint32_t numBuckets, uint32_t *bucketSizes, uint32_t bucketI, uint32_t bucketII, uint32_t pickedFromCurrentBucket, uint32_t pickedTotal);
   private:
-    void buildUsingLemma4ForSizeMax(const std::vector<LayerBrick> &v, const Token baseToken, Lemma4CacheMap &m, const uint8_t toPick);
-    void buildUsingLemma4ForSize2Plus(Lemma4CacheManager &Q, const std::vector<LayerBrick> &v, const Token baseToken, Lemma4CacheMap &m, const uint8_t toPick);
-    void buildUsingLemma4ForSize1(Lemma4CacheManager &Q, const std::vector<LayerBrick> &v, const Token baseToken, Lemma4CacheMap &m);
+    void buildUsingLemma4ForSizeMax(const std::vector<LayerBrick> &v, const PackedToken &baseToken, Lemma4CacheMap &m, const uint8_t toPick);
+    void buildUsingLemma4ForSize2Plus(Lemma4CacheManager &Q, const std::vector<LayerBrick> &v, const PackedToken &baseToken, Lemma4CacheMap &m, const uint8_t toPick);
+    void buildUsingLemma4ForSize1(Lemma4CacheManager &Q, const std::vector<LayerBrick> &v, Lemma4CacheMap &m);
+  };
+
+  /*
+    Knuth estimate of the size of a wave tree from a single random path through it (Knuth, 1975):
+    Each node on the path is weighted by the product of the branching factors above it.
+    Leaves are nodes where the recursion stops. Seconds are the time spent in the nodes themselves.
+    The counts of the leaf kernel are weighted the same way, so all, symmetric180 and symmetric90 are
+    unbiased estimates of the Counts returned by build().
+   */
+  struct TreeProbe {
+    double nodes, leaves, seconds;
+    double all, symmetric180, symmetric90;
+    TreeProbe();
+    TreeProbe& operator +=(const TreeProbe &p);
+  };
+
+  /*
+    Mean and variance of independent samples, such as the TreeProbes of E mode.
+   */
+  class SampleStatistics {
+    uint64_t n;
+    double mean, m2; // Running mean and sum of squared differences from the mean (Welford)
+  public:
+    SampleStatistics();
+    void add(const double x);
+    uint64_t size() const;
+    double getMean() const;
+    double standardError() const;
+    double halfWidth95() const; // Of the 95% confidence interval of the mean
+  };
+  std::ostream& operator<<(std::ostream &os, const SampleStatistics &s);
+
+  /*
+    Progress counters of a single thread. Only the owning thread writes its counters, so they are incremented
+    by a relaxed load and store without locking, while the reporter of Telemetry reads them concurrently.
+   */
+  struct alignas(64) ThreadCounters { // A cache line of its own, so counting threads do not share lines
+    std::atomic<uint64_t> nodes, leaves, simonCalls, unitsCompleted;
+    ThreadCounters();
+  };
+
+  /*
+    Progress telemetry: A background reporter sums the counters of all threads and appends a JSON line
+    with totals, rates and ETA to a stats file every interval, and a final line when stopped.
+    Units are the bases of R mode and the bases built on in P mode. The ETA is only known when the total
+    number of units has been added using addUnitsTotal().
+   */
+  class Telemetry {
+    static std::mutex registryMutex;
+    static std::vector<ThreadCounters*> registry; // Counters of all threads that have counted. Kept, as the reporter may read them after the threads have ended
+    static std::atomic<uint64_t> unitsTotal;
+    static std::atomic<int> reporters;
+    static thread_local ThreadCounters *local;
+
+    std::ofstream stream;
+    const double intervalSeconds;
+    bool stopping;
+    std::mutex mutex;
+    std::condition_variable stopRequested;
+    std::thread *reporter;
+    std::chrono::time_point<std::chrono::steady_clock> timeStart;
+    double previousSeconds;
+    uint64_t previousNodes; // At previousSeconds, for the rate of the last interval
+
+    static ThreadCounters *registerThread();
+    static inline ThreadCounters &counters() {
+      if(local == NULL)
+	local = registerThread();
+      return *local;
+    }
+    static inline void increment(std::atomic<uint64_t> &counter) {
+      counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+    void run();
+    void report(const bool final);
+  public:
+    Telemetry(const std::string &fileName, const double intervalSeconds);
+    ~Telemetry(); // Stops the reporter after writing the final line
+    bool ok() const;
+
+    static inline void countNode() { increment(counters().nodes); }
+    static inline void countLeaf() { increment(counters().leaves); }
+    static inline void countSimon() { increment(counters().simonCalls); }
+    static inline void countUnit() { increment(counters().unitsCompleted); }
+    static void addUnitsTotal(const uint64_t units);
+    static int sum(uint64_t &nodes, uint64_t &leaves, uint64_t &simonCalls, uint64_t &units); // Sums the counters of all threads. Returns the number of threads
+    static bool isActive(); // True while a reporter runs, so callers can skip computing the total number of units
+  };
+
+  /*
+    Time in nanoseconds spent waiting by the threads of R and P modes, summed over the threads. Reported by H mode:
+    - lockWait: Waiting for contended mutexes of BaseBuildingManager, BaseProducer, SplitWorkerPool and Journal (see TimedLock)
+    - idle: Workers of a SplitWorkerPool waiting for tasks
+    - joinWait: The producer of R mode waiting for the tasks of a base in SplitWorkerPool::collect()
+    - tail: Threads of Lemma3::precompute() done before the last thread at each join
+   */
+  struct WaitStatistics {
+    static std::atomic<uint64_t> lockWait, idle, joinWait, tail;
+    static void reset();
+    static uint64_t nanosSince(const std::chrono::time_point<std::chrono::steady_clock> &t);
+  };
+
+  /*
+    Locks like std::lock_guard. Only contended locks are timed, so uncontended locks cost a try_lock().
+   */
+  class TimedLock {
+    std::mutex &m;
+  public:
+    explicit TimedLock(std::mutex &m) : m(m) {
+      if(m.try_lock())
+	return;
+      std::chrono::time_point<std::chrono::steady_clock> timeStart { std::chrono::steady_clock::now() };
+      m.lock();
+      WaitStatistics::lockWait += WaitStatistics::nanosSince(timeStart);
+    }
+    ~TimedLock() {
+      m.unlock();
+    }
+  };
+
+#ifdef PROFILE
+  // Power of 2 buckets of candidate counts |v|: Bucket b holds sizes in [2^(b-1), 2^b), bucket 0 holds 0
+#define PROFILE_BUCKETS 12
+
+  /*
+    Counters of the wave tree at a depth (number of bricks placed). See Profile.
+   */
+  struct DepthProfile {
+    uint64_t nodes, resolved, recursed; // Nodes resolved by placeAllLeftToPlace() and nodes recursing into the next wave
+    uint64_t candidates, maxCandidates, candidateBuckets[PROFILE_BUCKETS]; // |v|
+    uint64_t picks[MAX_BRICKS]; // Children by toPick
+    uint64_t simonCalls;
+    double simonAll, simonValid; // Picks of simon(): All and those without overlaps
+    uint64_t symmetricChecks, symmetricPasses; // Of Combination::canBecomeSymmetric()
+    uint64_t pickerChecks, rejectsFullLayer, rejectsIntersection; // Of bricks checked by BrickPicker
+    DepthProfile();
+    DepthProfile& operator +=(const DepthProfile &p);
+  };
+
+  /*
+    Histograms of the hot paths by depth, compiled in when building with -DPROFILE.
+    Each thread counts in its own DepthProfiles without synchronization. The profiles of all threads are
+    summed by report(), which must only be called when the counting threads are done.
+   */
+  class Profile {
+    static std::mutex mutex;
+    static std::vector<DepthProfile*> registry; // Of all threads that have counted
+    static thread_local DepthProfile *local; // MAX_BRICKS+1 depths
+    static DepthProfile *registerThread();
+  public:
+    static inline DepthProfile &at(const int depth) {
+      if(local == NULL)
+	local = registerThread();
+      return local[depth];
+    }
+    static void countCandidates(const int depth, const size_t size);
+    static void report(std::ostream &os);
   };
+#define PROFILE_COUNT(depth, counter, n) (rectilinear::Profile::at(depth).counter += (n))
+#define PROFILE_CANDIDATES(depth, size) rectilinear::Profile::countCandidates(depth, size)
+#else
+#define PROFILE_COUNT(depth, counter, n)
+#define PROFILE_CANDIDATES(depth, size)
+#endif
+
+  class SplitWorkerPool; // Defined below
+  struct SplitWorker;
+  struct SplitUnit;
+  class Journal;
 
   class NonEncodingCombinationBuilder {
   public:
     Combination baseCombination;
   private:
-    uint8_t waveStart, waveSize;
+    uint8_t waveStart, waveSize, depth; // Recursion over waves runs in place. See CombinationBuilder
     BrickPlane *neighbours;
     Combination const * maxCombination;
+    std::vector<LayerBrick> candidates[MAX_BRICKS];
+    ConflictGraph graph; // Of a layer in simon()
+    SplitWorker *worker; // Worker to publish subtrees to when other workers are idle. NULL if not running in a SplitWorkerPool
+    int slot;
+    SplitUnit *unit;
   public:
     NonEncodingCombinationBuilder(const Combination &c,
 				  const uint8_t waveStart,
 				  const uint8_t waveSize,
 				  BrickPlane *neighbours,
 				  Combination const * maxCombination);
+    NonEncodingCombinationBuilder(const Combination &c,
+				  const uint8_t waveStart,
+				  const uint8_t waveSize,
+				  BrickPlane *neighbours,
+				  Combination const * maxCombination,
+				  SplitWorker *worker,
+				  const int slot,
+				  SplitUnit *unit);
     NonEncodingCombinationBuilder(const NonEncodingCombinationBuilder& b);
     NonEncodingCombinationBuilder();
 
     static Counts buildWithPartials(int threadCount, const Combination &maxCombination);
+    // Counts before the final division for the work units of shard shardIndex of shardCount:
+    static Counts buildShard(int threadCount, const Combination &maxCombination, const int shardIndex, const int shardCount, Journal *journal);
+    static Counts finalizeCounts(const Counts &shardSum, const Combination &maxCombination);
     Counts build();
-    int addFrom(NormalBuildingManager *manager, const std::string &threadName);
-    void countAndRemoveFrom(NormalBuildingManager *manager, const Counts &counts, int toRemove);
+    void probe(std::mt19937_64 &rng, const double weight, TreeProbe &p); // Adds the estimate of the subtree of a random path to p
     void addWaveToNeighbours(int8_t add);
   private:
-    Counts buildSplit(int threadCount);
+    Counts buildSplit(SplitWorkerPool &pool, const int slot);
     void findPotentialBricksForNextWave(std::vector<LayerBrick> &v);
-    uint64_t countInvalid(Brick *combination, int combinationSize, int N, Brick const * const v, const int sizeV, const int vIndex) const;
-    uint64_t simon(const uint8_t &N, const std::vector<LayerBrick> &v) const;
+    uint64_t simon(const std::vector<LayerBrick> &v);
     Counts placeAllLeftToPlace(const uint8_t &leftToPlace, const std::vector<LayerBrick> &v);
+  public:
+    friend class TreeEstimator; // Sets up the root as buildShard()
+    friend struct Microbenchmark; // Benchmarks the private kernels. See benchmark/microbenchmark.cpp
   };
 
-  class SplitBuildingBuilder {
-    BrickPlane *neighbours;
-    Combination *baseCombination;
-    Combination const * maxCombination;
-    NormalBuildingManager *manager;
-    std::chrono::time_point<std::chrono::steady_clock> timeStart { std::chrono::steady_clock::now() }, timePrev = timeStart;
+  /*
+    Random probes of the wave tree of R mode. The root is set up as in NonEncodingCombinationBuilder::buildShard(),
+    so the bases of the first wave are deduplicated by mirroring, and each probe starts from a uniformly chosen base.
+   */
+  class TreeEstimator {
+    const Combination &maxCombination;
+    BrickPlane neighbours[MAX_HEIGHT];
+    NonEncodingCombinationBuilder root;
+    std::vector<Combination> bases;
+    std::vector<uint8_t> picked; // Size of the first wave of each base
+    std::vector<int> multiplicities; // Number of first waves mirroring to each base
+    TreeProbe rootProbe; // The root node and the time to set up the bases
+    std::mt19937_64 rng;
+  public:
+    TreeEstimator(const Combination &maxCombination, const uint64_t seed);
+    ~TreeEstimator();
+    size_t numberOfBases() const;
+    TreeProbe probe();
+  };
+
+  /*
+    Append-only journal of the work units completed by an R mode run, used to resume after a crash.
+    The first line identifies the run: "J <token> <shard index> <shard count> <depth>"
+    Each following line is a completed unit: "U <base> <unit> <all> <symmetric180> <symmetric90> <checksum>"
+    Whole bases are recorded as unit -1. Depth 2 also records the work units of a base (see SplitWorkerPool::nextUnit())
+    with counts of at least JOURNAL_MIN_UNIT_COUNT, so a large base is resumed where it was.
+    The file is read line by line when loading. Lines torn by a crash fail the checksum, and the records of units
+    of completed bases are obsolete. If any such lines are found, the journal is compacted by rewriting it without them.
+    Records are written in batches of batchSize, and fsync is performed at most every syncSeconds.
+   */
+  class Journal {
+    int fd;
+    bool valid;
+    const int depth, batchSize;
+    const double syncSeconds;
+    std::map<std::pair<int,int>,Counts> completed; // Loaded from file
+    std::string buffer;
+    int buffered;
+    std::chrono::time_point<std::chrono::steady_clock> timePrevSync;
+    std::mutex mutex;
+
+    static void formatFields(const int base, const int unit, const Counts &c, char *fields); // Room for 96 chars
+    static void formatLine(const int base, const int unit, const Counts &c, std::string &out);
+    void writeBuffer(bool sync); // Call with mutex held
+  public:
+    Journal(const std::string &fileName, const Token token, const int shardIndex, const int shardCount, const int depth, const int batchSize, const double syncSeconds);
+    ~Journal(); // Flushes and closes
+
+    bool ok() const;
+    int getDepth() const;
+    int size() const; // Number of completed units loaded
+    bool get(const int base, const int unit, Counts &c) const;
+    void add(const int base, const int unit, const Counts &c);
+    void flush();
+  };
+
+  /*
+    Work unit being journaled. Tasks published from a unit by adaptive splitting are part of the unit,
+    so the unit is complete when the last of its tasks completes.
+   */
+  struct SplitUnit {
+    const int base, index;
+    std::atomic<int> outstanding;
+    Counts counts;
+    std::mutex mutex; // Protects counts
+
+    SplitUnit(const int base, const int index);
+  };
+
+  /*
+    Subtree of NonEncodingCombinationBuilder::build() to be counted by a worker:
+    The bricks before waveStart are blockers and the bricks of [waveStart;waveStart+waveSize) form the wave to build on.
+   */
+  struct SplitTask {
+    Combination c;
+    uint8_t waveStart, waveSize;
+    int slot; // Base being counted. See SplitWorkerPool
+    SplitUnit *unit; // NULL when not journaling units
+
+    SplitTask();
+    SplitTask(const Combination &c, const uint8_t waveStart, const uint8_t waveSize, const int slot, SplitUnit *unit);
+  };
+
+  /*
+    Worker thread of a SplitWorkerPool. Runs tasks from the back of its own deque and
+    steals from the front of the deques of other workers when empty.
+    Counts are accumulated locally for each slot and only merged once all tasks of the slot are done.
+   */
+  struct SplitWorker {
+    SplitWorkerPool *pool;
     std::string threadName;
+    BrickPlane neighbours[MAX_HEIGHT];
+    Combination blockers; // Bricks marked in neighbours. Kept between tasks of the same base
+    uint8_t blockersSize;
+    Counts counts[MAX_ACTIVE_BASES];
+    std::deque<SplitTask> tasks;
+    std::mutex mutex; // Protects tasks
+    std::thread *thread;
+    std::chrono::time_point<std::chrono::steady_clock> timeStart { std::chrono::steady_clock::now() }, timePrev = timeStart;
+
+    SplitWorker();
+    void run();
+    void runTask(const SplitTask &t);
+    void setBlockers(const Combination &c, const uint8_t size);
+    bool pop(SplitTask &t);
+    bool steal(SplitTask &t);
+  };
+
+  /*
+    Persistent pool of workers used for all bases in NonEncodingCombinationBuilder::buildWithPartials().
+    The producer pushes the tasks of a base into a "slot" and collects the counts of the slot when
+    all its tasks are done. Up to MAX_ACTIVE_BASES bases can be in the pool at the same time, so
+    the workers keep busy with the next bases while the last tasks of a base complete.
+   */
+  class SplitWorkerPool {
+    SplitWorker *workers;
+    const int workerCount;
+    std::atomic<int64_t> outstanding[MAX_ACTIVE_BASES]; // Tasks not completed for each slot. +1 while the producer pushes
+    bool inUse[MAX_ACTIVE_BASES];
+    std::atomic<int> queued; // Tasks in the deques of all workers
+    std::atomic<int> idle; // Workers waiting for tasks
+    std::atomic<uint64_t> costMicros[MAX_BRICKS+1], costSamples[MAX_BRICKS+1]; // Observed task durations by size of task combination
+    int nextWorker; // Workers are pushed to in round robin
+    int shardIndex, shardCount, unitBase, unitIndex; // See nextUnit()
+    bool stopping;
+    std::mutex mutex; // Used for waiting
+    std::condition_variable workAvailable, spaceAvailable, slotDone;
   public:
-    SplitBuildingBuilder();
-    SplitBuildingBuilder(const SplitBuildingBuilder &b);
-    SplitBuildingBuilder(BrickPlane *neighbours,
-			 Combination *baseCombination,
-			 Combination const * maxCombination,
-			 NormalBuildingManager *manager,
-			 int threadIndex);
-    void build();
+    Combination const * const maxCombination;
+    Journal * const journal; // NULL if not journaling
+
+    SplitWorkerPool(const int workerCount, Combination const * maxCombination, Journal *journal);
+    ~SplitWorkerPool(); // Stops and joins all workers
+
+    void setShard(const int shardIndex, const int shardCount);
+    void beginBase(const int baseIndex);
+    bool nextUnit(int &unit); // Advance to next work unit of the base. Returns true if it belongs to this shard
+    void pushUnit(const SplitTask &t, Counts &journaled); // Push as next work unit unless it is for another shard or in the journal
+    void completeUnit(SplitUnit *unit, const Counts &c);
+    bool getJournaled(const int unit, Counts &c) const; // Counts of unit of current base if journaled at depth 2
+    void journalUnit(const int unit, const Counts &c);
+    int acquireSlot(); // Returns -1 if all slots are in use
+    void push(const SplitTask &t);
+    void publish(const SplitTask &t, SplitWorker *w); // Push subtree of a running task without waiting
+    bool shouldSplit(const uint8_t size) const;
+    void addCost(const uint8_t size, const uint64_t micros);
+    void release(const int slot); // Producer done pushing tasks for slot
+    Counts collect(const int slot); // Waits for all tasks of slot, merges counts and frees the slot
+    bool take(SplitTask &t, SplitWorker *thief); // Steal a task from a worker other than thief
+    void complete(const int slot);
+    bool waitForWork(); // Returns false when stopping
+  private:
+    void pushTo(const SplitTask &t, SplitWorker &w);
+  };
+
+  struct Report; // Defined below
+
+  /*
+    Common interface for writing precomputation files. See BitWriter (format 1) and VarintWriter (format 2)
+   */
+  class IBatchWriter {
+  public:
+    virtual void writeBatch(const Base &c, bool baseSymmetric180, bool baseSymmetric90, const Report *reports, int cnt) = 0; // The reports of base c
+    virtual void commit() = 0;
+    virtual ~IBatchWriter() = default;
   };
 
   /*
-    Write precalculations to stream:
+    Write precalculations to stream (format 1):
     bit=1 to indicate start of a batch of results
     bit to indicate if base is symmetric
     for each result in batch:
@@ -470,11 +1026,17 @@ namespace rectilinear {
      End of stream:
      1 to indicate a batch, then bs=0, indicator=0, colors all 0, 0 for all counts.
      Finally totals in 64 bit integers for cross checking
+
+     Bits fill each byte from the most significant bit. Values are written least significant bit first.
+     Bits are collected in a 64 bit register in the order written, and full words go to a buffer of BIT_WRITER_BUFFER_SIZE bytes.
    */
-  class BitWriter {
+  class BitWriter : public IBatchWriter {
     std::ofstream *ostream;
     uint8_t base;
-    uint8_t bits, cntBits;
+    uint8_t cntBits; // Bits in register. Always < 64
+    uint64_t bits; // Bit i is the i'th bit written since the last word
+    char *buffer;
+    size_t buffered;
     uint64_t sumTotal, sumSymmetric180, sumSymmetric90, lines;
     bool largeCountsRequired;
 
@@ -490,13 +1052,52 @@ namespace rectilinear {
     void writeUInt8(uint8_t toWrite); // Used for symmetric90 - only when base = 4
     void writeCounts(const Counts &c);
     static bool areLargeCountsRequired(const Combination &maxCombination);
+    void writeBatch(const Base &c, bool baseSymmetric180, bool baseSymmetric90, const Report *reports, int cnt);
     void commit();
   private:
+    void writeBits(uint64_t toWrite, uint8_t cnt); // Lowest cnt bits of toWrite, 0 < cnt <= 64
+    void writeBytes(uint64_t word, uint8_t cnt); // First cnt bytes of bits in word to buffer
+    void flushBuffer();
     void flushBits();
     void writeUInt32(uint32_t toWrite); // Used for total
     void writeUInt64(uint64_t toWrite); // Used for totals
   };
 
+  /*
+    Write precalculations to stream (format 2). Integers are little endian. Varints have 7 bits per byte, lowest bits first.
+    Header (16 bytes): "WAVE", version 2, base, max distance D, 0, token of the refinement (64 bit)
+    Blocks: type ('B' for batches, 'I' for the index), varint size of payload, payload, FNV-1a checksum of the payload (32 bit)
+    A batch in a payload holds the reports of a base:
+     flags (bit 0: baseSymmetric180, bit 1: baseSymmetric90, bit 2: symmetric counts follow, bits 3-6: number of reports - 1)
+     bricks 1 to base-1, each relative to the brick before: varint (zigzag(dx) << 1 | isVertical), varint zigzag(dy)
+     for each report:
+      colors in mixed radix (color i is at most i+1), which is a single byte up to base 5
+      varint all - symmetric180, and if bit 2 is set: varint symmetric180 - symmetric90 and varint symmetric90 if base == 4
+    The index has a varint number of blocks of batches. For each block:
+     varint offset of the block relative to the block before, varint number of bases and their bricks as in the batches
+    Footer (48 bytes): offset of the index block, totals of all, symmetric180, symmetric90 and reports (64 bit each),
+     checksum of these 40 bytes (32 bit) and "WAVE". A file without a footer is incomplete.
+   */
+  class VarintWriter : public IBatchWriter {
+    std::ofstream *ostream;
+    uint8_t base;
+    std::string block, index; // Payloads
+    std::string blockBases; // Bricks of the bases in block
+    uint64_t offset; // Bytes written to file
+    uint64_t prevBlock, blocks, blockBatches;
+    uint64_t sumTotal, sumSymmetric180, sumSymmetric90, lines;
+
+    void writeBlock(char type, const std::string &payload);
+  public:
+    VarintWriter(const std::string &fileName, const Combination &maxCombination, int D);
+    ~VarintWriter(); // Write the index and footer
+    void writeBatch(const Base &c, bool baseSymmetric180, bool baseSymmetric90, const Report *reports, int cnt);
+    void commit();
+    static void putVarint(std::string &s, uint64_t v);
+    static void putUInt64(std::string &s, uint64_t v);
+    static void putBricks(std::string &s, const Base &c, uint8_t base);
+  };
+
   /*
     A "Report" represents a batch of data from a base in a precomputation.
    */
@@ -515,26 +1116,48 @@ namespace rectilinear {
     static void getReports(const CountsMap &cm, std::vector<Report> &reports, uint8_t base, bool b180, bool b90);
   };
 
+  /*
+    Reads the files of BitWriter (format 1) and VarintWriter (format 2). The file is memory mapped.
+    Fields of format 1 are extracted from 64 bit words. The totals at the end of the file are checked against the reports read.
+   */
   class BitReader {
-    std::ifstream *istream;
-    uint8_t bits, bitIdx, base;
+    const uint8_t *data; // The memory mapped file. NULL if empty or missing
+    uint64_t size; // Bytes
+    uint64_t pos; // Bits read (format 1)
+    uint64_t cursor, blockEnd, nextBlock; // Bytes (format 2)
+    uint8_t base, format;
     uint64_t sumTotal, sumSymmetric180, sumSymmetric90, lines;
-    bool largeCountsRequired, good;
+    bool largeCountsRequired, good, seeked; // Totals are not checked after seek()
+    std::map<Base,std::pair<uint64_t,uint64_t> > index; // Base -> block, batches before it in the block (format 2)
 
+    uint64_t loadWord(uint64_t byteIdx) const; // 64 bits in the order read, padded with 0's after the end of the file
+    uint64_t readBits(uint8_t cnt); // 0 < cnt <= 64, first bit read is lowest
     bool readBit();
     uint8_t readColor();
     void readBrick(Brick &b);
-    uint8_t readUInt8();
-    uint16_t readUInt16();
-    uint32_t readUInt32();
-    uint64_t readUInt64();
     void readCounts(Counts &c);
+    int nextFormat1(Report *reports);
+    uint64_t loadUInt64(uint64_t byteIdx) const;
+    uint32_t loadUInt32(uint64_t byteIdx) const;
+    bool getVarint(uint64_t end, uint64_t &v); // At cursor. False if beyond end
+    bool getBricks(uint64_t end, Base &c);
+    char openBlock(uint64_t offset); // Type of block, or 0 if incomplete or the checksum fails
+    bool checkFooter(uint64_t indexOffset);
+    bool loadIndex();
+    int decodeBatch(Report *reports); // At cursor
+    int nextFormat2(Report *reports);
+    void mapFile(const std::string &fileName, Token token, int D);
   public:
     BitReader(const Combination &maxCombination, int D, std::string directorySuffix);
+    BitReader(const std::string &fileName, const Combination &maxCombination, int D);
     ~BitReader();
+    int next(Report *reports); // Decodes a batch into reports (room for MAX_BATCH_REPORTS). Returns the number of reports, 0 when done
     bool next(std::vector<Report> &v);
+    bool seek(const Base &c); // The following next() reads the batch of c. Format 2 uses the index. False if c is not in the file
     bool isGood() const;
+    int getFormat() const; // 0 if the file is empty or missing
     bool nextCountsMap(BaseResultsMap &m, const Token &baseToken);
+    static std::string getFileName(const Combination &maxCombination, int D, std::string directorySuffix);
   };
 
   /*
@@ -593,7 +1216,7 @@ namespace rectilinear {
   class BaseProducer {
     std::vector<int> distances;
     IBaseProducer *innerBuilder;
-    BitWriter *writer;
+    IBatchWriter *writer;
     bool isBacked;
     Base backedBuildBase, backedRegistrationBase;
   public:
@@ -607,18 +1230,39 @@ namespace rectilinear {
     ~BaseProducer();
     bool nextBaseToBuildOn(Base &buildBase, Base &registrationBase, const Combination &maxCombination);
     void back(const Base &buildBase, const Base &registrationBase);
-    void registerCounts(const Base &registrationBase, const CountsMap &counts);
+    void registerCounts(const Base &registrationBase, const EncodingCounts &counts);
     void report(const Combination &maxCombination);
-    void setWriter(BitWriter *writer);
+    void setWriter(IBatchWriter *writer);
     void reset(const std::vector<int> &distances);
   };
 
+  /*
+    Lemma 1: The counts of a refinement with a bottleneck (a non-extreme layer of size 1) are composed from
+    the counts of the refinements obtained by dividing it at the bottleneck.
+    Counts are known from Combination::setupKnownCounts() and results files with lines "<TOKEN> ALL (SYMMETRIC180) {SYMMETRIC90}",
+    as written by R and M modes.
+   */
+  class Lemma1 {
+    CountsMap known, composed; // token -> counts
+    std::set<Token> loaded; // Tokens read from results files
+    bool findKnown(const Token token, Counts &c) const; // Also looks up the reversed token
+  public:
+    Lemma1();
+    bool load(const std::string &fileName); // Returns false if the file is missing or conflicts with known counts
+    bool isLoaded(const Token token) const; // True if the counts of the token or the reversed token have been read from a results file
+    bool get(const Token token, Counts &c, std::set<Token> &missing); // Adds the missing non-bottleneck refinements if the counts can not be composed
+    static bool hasBottleneck(const Token token);
+  };
+
   class Lemma3Runner {
     BaseProducer *baseProducer;
     Combination const * maxCombination; // Notice: Not a reference in order to get local reference in thread
     BrickPlane *neighbours;
     std::string threadName;
   public:
+    std::chrono::time_point<std::chrono::steady_clock> timeFinished; // Set when run() is done
+    static Lemma4CacheManager *createLemma4Cache(const Combination &maxCombination); // NULL if Lemma 4 is not used for maxCombination
+    static void build(CombinationBuilder &builder, const Combination &maxCombination, Lemma4CacheManager *Q);
     Lemma3Runner();
     Lemma3Runner(const Lemma3Runner &b);
     Lemma3Runner(BaseProducer *b,
@@ -629,7 +1273,7 @@ namespace rectilinear {
   };
 
   class Lemma3 {
-    int base, threadCount, token;
+    int base, threadCount, token, format;
     CountsMap counts;
     const Combination &maxCombination;
     BaseResultsMap knownResults;
@@ -637,7 +1281,10 @@ namespace rectilinear {
     Lemma3(int base, int threads, const Combination &maxCombination);
     void precompute(int maxDist);
     void precompute(int maxDist, bool overwriteFiles);
+    void setFormat(int format); // Of the files written: 1 (BitWriter) or 2 (VarintWriter, default)
+    double estimate(int maxDist, double seconds, const uint64_t seed); // Estimate the time in seconds of precompute(maxDist) using a single thread from a sample of the bases
   private:
+    void collectBases(BaseProducer *baseProducer, std::vector<int> &distances, int maxDist, std::vector<Base> &buildBases);
     void precompute(BaseProducer *baseProducer, std::vector<int> &distances);
     void precompute(BaseProducer *baseProducer, std::vector<int> &distances, int maxDist);
   };